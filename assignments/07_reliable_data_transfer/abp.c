@@ -2,6 +2,8 @@
 #include <stdlib.h> // for malloc, free, srand, rand
 #include <string.h>
 
+#include "checksum.h"
+
 /*******************************************************************
  ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.1  J.F.Kurose
 
@@ -68,19 +70,21 @@ struct sender {
     struct pkt last_packet;
 } A_sender, B_sender;
 
-/* Performs simple checksum on a packet's sequence number,
-   acknowledgement number and payload */
-int checksum(int seqnum, int acknum, char payload[20])
+/* CRC32C of a packet's payload followed by its sequence and acknowledgement
+   numbers. payload_crc is the CRC of the payload alone, which A_output()
+   gets while copying the payload into the packet. */
+int header_checksum(int seqnum, int acknum, uint32_t payload_crc)
 {
-    int sum = 0;
+    int header[] = { seqnum, acknum };
 
-    sum += (seqnum + acknum);
-
-    for (int i=0; i < 20; i++) {
-        sum += (int) payload[i];
-    }
+    return (int) crc32c(payload_crc, header, sizeof(header));
+}
 
-    return sum;
+/* Performs checksum on a packet's sequence number,
+   acknowledgement number and payload */
+int checksum(int seqnum, int acknum, char payload[20])
+{
+    return header_checksum(seqnum, acknum, crc32c(0, payload, 20));
 }
 
 // called from layer 5, passed the data to be sent to other side
@@ -96,10 +100,8 @@ void A_output(struct msg message)
 
     A_out.seqnum = A_sender.seqnum;
     A_out.acknum = A_sender.acknum;
-    A_out.checksum = checksum(A_sender.seqnum, A_sender.acknum, message.data);
-
-    size_t dest_size = sizeof (message.data);
-    strncpy(A_out.payload, message.data, dest_size);
+    A_out.checksum = header_checksum(A_sender.seqnum, A_sender.acknum,
+                                     crc32c_copy(0, A_out.payload, message.data, sizeof(message.data)));
 
     printf("\t\tA_OUTPUT seq: %d, ack: %d, checksum: %d, payload: %s\n", A_out.seqnum, A_out.acknum, A_out.checksum, A_out.payload);
 
@@ -315,6 +317,7 @@ int main()
     int i,j;
     int terminate = 0;
 
+    checksum_init();
     init();
     A_init();
     B_init();
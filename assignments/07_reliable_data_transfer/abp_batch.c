@@ -0,0 +1,644 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h> // for malloc, qsort
+#include <string.h>
+#include <math.h>   // for sqrt
+#include <time.h>   // for clock_gettime
+#include <unistd.h> // for getopt
+
+/* Monte Carlo runs of the alternating-bit protocol of abp.c: many short
+   independent replicas, for statistics over them rather than one trace.
+
+   The replicas are the protocol of abp.c, with its A_output(), A_input(),
+   A_timerinterrupt() and B_input() and the channel of its tolayer3(), but
+   without the event list and the printing. run_replica() runs one of them
+   the plain way, and is the reference. The batched engine keeps a vector
+   lane per replica: all the state of A, B and the channel is in vectors,
+   struct of arrays, and every step runs the next event of each lane at
+   once, the branches of the protocol being masks that pick per lane which
+   result to keep. Lanes whose replica is through take on the next one.
+   With AVX-512 a vector holds 16 replicas, with AVX2 8 and otherwise 4.
+
+   Both draw the same random numbers per replica, four per event, so they
+   come to the same results, which are compared first. */
+
+#define TIMEOUT         20.0f   // what A passes to starttimer()
+#define CHANNEL_SLOTS   4       // packets each way a replica's channel holds at most
+#define NEVER           1e30f   // the time of a timer that is off, or of an empty channel's next arrival
+#define NO_PACKET       (-999)  // B_sender.last_packet.seqnum before the first packet
+#define HARVEST_STEPS   4       // steps between looking for lanes that are through
+#define SELF_TEST_MAX   1000    // replicas run by both engines and compared
+
+#if defined(__AVX512F__)
+#define LANES 16
+#elif defined(__AVX2__)
+#define LANES 8
+#else
+#define LANES 4
+#endif
+
+typedef float    vfloat __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t  vint   __attribute__((vector_size(LANES * sizeof(int32_t))));
+typedef uint32_t vuint  __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+int     nsimmax     = 20;        // msgs from layer 5 per replica, as in abp.c
+float   lossprob    = 0.2;       // probability that a packet is dropped
+float   corruptprob = 0.1;       // probability that a packet is corrupted
+float   lambda      = 2000.0;    // mean time between msgs from layer 5
+long    nreplicas   = 100000;    // replicas to run
+uint32_t seed       = 9999;
+
+// What a replica comes to.
+struct result {
+    float time;                 // when its last msg came from layer 5, where abp.c stops
+    int sent;                   // packets into layer 3, both ways
+    int lost;
+    int corrupted;
+    int retransmitted;          // data packets sent again, on a timeout or a NACK
+    int delivered;              // msgs B handed to layer 5
+    int duplicates;             // data packets B had delivered already
+    int dropped;                // msgs A turned away while waiting for an ACK
+    int overflowed;             // packets that found CHANNEL_SLOTS in flight before them, dropped
+};
+
+
+/****************************************************************************
+  The random numbers: an xorshift32 generator per replica, seeded from the
+  replica number, so a replica draws the same numbers in any lane.
+ ***************************************************************************/
+
+uint32_t replica_seed(long replica)
+{
+    uint32_t x = seed * 0x9e3779b9u + (uint32_t) replica * 0x85ebca6bu;
+
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x != 0 ? x : 1;      // xorshift never leaves 0
+}
+
+float uniform(uint32_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return (float) (*x >> 8) * (1.0f / 16777216);
+}
+
+vfloat uniform_lanes(vuint *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return __builtin_convertvector((vint) (*x >> 8), vfloat) * (1.0f / 16777216);
+}
+
+
+/****************************************************************************
+  One replica at a time.
+ ***************************************************************************/
+
+struct channel {
+    float at[CHANNEL_SLOTS];    // arrival times, in order
+    int num[CHANNEL_SLOTS];     // the seqnum of a data packet, the acknum of an ACK
+    int bad[CHANNEL_SLOTS];     // whether it was corrupted, which the CRC always catches
+    int head;
+    int count;
+};
+
+struct replica {
+    float now;
+    float next_msg;             // when the next msg comes from layer 5
+    float timer;                // when A's timer goes off, NEVER while it is off
+    int a_seq;                  // A_sender.seqnum
+    int a_wait;                 // A_sender.sending_state == WAITING_FOR_ACK
+    int a_last;                 // A_sender.last_packet.seqnum
+    int b_ack;                  // B_sender.acknum
+    int b_last;                 // B_sender.last_packet.seqnum
+    struct channel to_b;
+    struct channel to_a;
+    uint32_t rand;
+    int nsim;
+    struct result result;
+};
+
+// tolayer3(): loses, delays behind what is in flight and corrupts the packet.
+void channel_send(struct replica *r, struct channel *ch, int num, float u_loss, float u_delay, float u_corrupt)
+{
+    float lastime = r->now;
+    int slot;
+
+    r->result.sent++;
+    if (u_loss < lossprob) {
+        r->result.lost++;
+        return;
+    }
+    if (ch->count == CHANNEL_SLOTS) {
+        r->result.overflowed++;
+        return;
+    }
+
+    if (ch->count > 0) {
+        lastime = ch->at[(ch->head + ch->count - 1) % CHANNEL_SLOTS];
+    }
+    slot = (ch->head + ch->count++) % CHANNEL_SLOTS;
+    ch->at[slot] = lastime + 1.0f + 9.0f * u_delay;
+    ch->num[slot] = num;
+    ch->bad[slot] = u_corrupt < corruptprob;
+    r->result.corrupted += ch->bad[slot];
+}
+
+void channel_pop(struct channel *ch, int *num, int *bad)
+{
+    *num = ch->num[ch->head];
+    *bad = ch->bad[ch->head];
+    ch->head = (ch->head + 1) % CHANNEL_SLOTS;
+    ch->count--;
+}
+
+float channel_next(struct channel *ch)
+{
+    return ch->count > 0 ? ch->at[ch->head] : NEVER;
+}
+
+void replica_init(struct replica *r, long replica)
+{
+    memset(r, 0, sizeof(*r));
+    r->rand = replica_seed(replica);
+    r->next_msg = 2.0f * lambda * uniform(&r->rand);
+    r->timer = NEVER;
+    r->b_last = NO_PACKET;
+}
+
+// The next event of the replica: a msg from layer 5, the timer, or a packet arriving at B or at A.
+void replica_step(struct replica *r)
+{
+    float at_b = channel_next(&r->to_b);
+    float at_a = channel_next(&r->to_a);
+    float u_gap = uniform(&r->rand);
+    float u_loss = uniform(&r->rand);
+    float u_delay = uniform(&r->rand);
+    float u_corrupt = uniform(&r->rand);
+    int num, bad;
+
+    if (r->next_msg <= r->timer && r->next_msg <= at_b && r->next_msg <= at_a) {
+        r->now = r->next_msg;
+        r->next_msg = r->now + 2.0f * lambda * u_gap;
+        r->nsim++;
+        if (r->a_wait) {
+            r->result.dropped++;
+            return;
+        }
+        r->a_last = r->a_seq;
+        r->a_seq = 1 - r->a_seq;
+        channel_send(r, &r->to_b, r->a_last, u_loss, u_delay, u_corrupt);
+        if (r->timer == NEVER) {
+            r->timer = r->now + TIMEOUT;
+        }
+        r->a_wait = 1;
+    }
+    else if (r->timer <= at_b && r->timer <= at_a) {
+        r->now = r->timer;
+        r->a_wait = 0;
+        r->result.retransmitted++;
+        channel_send(r, &r->to_b, r->a_last, u_loss, u_delay, u_corrupt);
+        r->timer = r->now + TIMEOUT;
+    }
+    else if (at_b <= at_a) {
+        r->now = at_b;
+        channel_pop(&r->to_b, &num, &bad);
+        if (bad) {
+            channel_send(r, &r->to_a, r->b_ack - 2, u_loss, u_delay, u_corrupt);   // NACK
+            return;
+        }
+        channel_send(r, &r->to_a, num, u_loss, u_delay, u_corrupt);
+        if (num == r->b_last) {
+            r->result.duplicates++;
+            return;
+        }
+        r->b_ack = 1 - r->b_ack;
+        r->b_last = num;
+        r->result.delivered++;
+    }
+    else {
+        r->now = at_a;
+        channel_pop(&r->to_a, &num, &bad);
+        if (bad) {
+            return;
+        }
+        if (num == r->a_last - 2) {
+            r->result.retransmitted++;
+            channel_send(r, &r->to_b, r->a_last, u_loss, u_delay, u_corrupt);
+            r->timer = r->now + TIMEOUT;
+        }
+        else if (num == r->a_last) {
+            r->timer = NEVER;
+            r->a_wait = 0;
+        }
+    }
+}
+
+void run_replica(long replica, struct result *result)
+{
+    struct replica r;
+
+    replica_init(&r, replica);
+    while (r.nsim < nsimmax) {
+        replica_step(&r);
+    }
+    r.result.time = r.now;
+    *result = r.result;
+}
+
+
+/****************************************************************************
+  A vector of replicas at a time. Masks are -1 in the lanes they select and
+  0 elsewhere, so subtracting one counts in those lanes.
+ ***************************************************************************/
+
+/* A channel's packets in a lane are in slots 0 up, the one to arrive first
+   in slot 0, and the free slots arrive at NEVER. A packet is its number
+   times two plus its corrupted bit. */
+struct channel_lanes {
+    vfloat at[CHANNEL_SLOTS];
+    vint packet[CHANNEL_SLOTS];
+    vint count;
+};
+
+struct batch {
+    vfloat now;
+    vfloat next_msg;
+    vfloat timer;
+    vint a_seq;
+    vint a_wait;                // a mask
+    vint a_last;
+    vint b_ack;
+    vint b_last;
+    struct channel_lanes to_b;
+    struct channel_lanes to_a;
+    vuint rand;
+    vint nsim;
+    vint sent, lost, corrupted, retransmitted, delivered, duplicates, dropped, overflowed;
+    long replica[LANES];        // the replica in each lane, -1 for none
+};
+
+vfloat select_float(vint mask, vfloat a, vfloat b)
+{
+    return (vfloat) ((mask & (vint) a) | (~mask & (vint) b));
+}
+
+vint select_int(vint mask, vint a, vint b)
+{
+    return (mask & a) | (~mask & b);
+}
+
+vfloat all_lanes_float(float x)
+{
+    vfloat v;
+
+    for (int i = 0; i < LANES; i++) {
+        v[i] = x;
+    }
+    return v;
+}
+
+vint all_lanes_int(int x)
+{
+    vint v;
+
+    for (int i = 0; i < LANES; i++) {
+        v[i] = x;
+    }
+    return v;
+}
+
+vfloat min_float(vfloat a, vfloat b)
+{
+    return select_float(a <= b, a, b);
+}
+
+// channel_send() in the lanes of mask.
+void channel_send_lanes(struct batch *s, struct channel_lanes *ch, vint mask, vint num,
+                        vfloat u_loss, vfloat u_delay, vfloat u_corrupt)
+{
+    vint lost = mask & (u_loss < lossprob);
+    vint full = mask & ~lost & (ch->count == CHANNEL_SLOTS);
+    vint go = mask & ~lost & ~full;
+    vint bad = go & (u_corrupt < corruptprob);
+    vint packet = (num << 1) - bad;
+    vfloat lastime = s->now;
+    vfloat at;
+
+    for (int i = 0; i < CHANNEL_SLOTS - 1; i++) {
+        lastime = select_float(ch->count == i + 1, ch->at[i], lastime);
+    }
+    at = lastime + 1.0f + 9.0f * u_delay;
+
+    for (int i = 0; i < CHANNEL_SLOTS; i++) {
+        vint write = go & (ch->count == i);
+
+        ch->at[i] = select_float(write, at, ch->at[i]);
+        ch->packet[i] = select_int(write, packet, ch->packet[i]);
+    }
+    ch->count -= go;
+
+    s->sent -= mask;
+    s->lost -= lost;
+    s->overflowed -= full;
+    s->corrupted -= bad;
+}
+
+// The packet in slot 0, taken off in the lanes of mask.
+void channel_pop_lanes(struct channel_lanes *ch, vint mask, vint *num, vint *bad)
+{
+    *num = ch->packet[0] >> 1;
+    *bad = -(ch->packet[0] & 1);
+    for (int i = 0; i < CHANNEL_SLOTS - 1; i++) {
+        ch->at[i] = select_float(mask, ch->at[i + 1], ch->at[i]);
+        ch->packet[i] = select_int(mask, ch->packet[i + 1], ch->packet[i]);
+    }
+    ch->at[CHANNEL_SLOTS - 1] = select_float(mask, all_lanes_float(NEVER), ch->at[CHANNEL_SLOTS - 1]);
+    ch->count += mask;
+}
+
+
+// replica_step() in every lane still running, each taking its own branch.
+void batch_step(struct batch *s)
+{
+    vint active = s->nsim < nsimmax;
+    vfloat at_b = s->to_b.at[0];
+    vfloat at_a = s->to_a.at[0];
+    vfloat u_gap = uniform_lanes(&s->rand);
+    vfloat u_loss = uniform_lanes(&s->rand);
+    vfloat u_delay = uniform_lanes(&s->rand);
+    vfloat u_corrupt = uniform_lanes(&s->rand);
+    vint num, bad;
+
+    // the same ties as replica_step(): msg, then timer, then B, then A
+    vint is_msg = active & (s->next_msg <= s->timer) & (s->next_msg <= at_b) & (s->next_msg <= at_a);
+    vint is_timer = active & ~is_msg & (s->timer <= at_b) & (s->timer <= at_a);
+    vint is_b = active & ~is_msg & ~is_timer & (at_b <= at_a);
+    vint is_a = active & ~is_msg & ~is_timer & ~is_b;
+
+    s->now = select_float(active, min_float(min_float(s->next_msg, s->timer), min_float(at_b, at_a)), s->now);
+
+    // a msg from layer 5: A_output()
+    vint accept = is_msg & ~s->a_wait;
+
+    s->next_msg = select_float(is_msg, s->now + 2.0f * lambda * u_gap, s->next_msg);
+    s->nsim -= is_msg;
+    s->dropped -= is_msg & s->a_wait;
+    s->a_last = select_int(accept, s->a_seq, s->a_last);
+    s->a_seq = select_int(accept, 1 - s->a_seq, s->a_seq);
+
+    // a packet at A: A_input()
+    channel_pop_lanes(&s->to_a, is_a, &num, &bad);
+    vint nack = is_a & ~bad & (num == s->a_last - 2);
+    vint acked = is_a & ~bad & ~nack & (num == s->a_last);
+
+    // a packet at B: B_input(), which always answers
+    vint seq, corrupt;
+
+    channel_pop_lanes(&s->to_b, is_b, &seq, &corrupt);
+    vint deliver = is_b & ~corrupt & (seq != s->b_last);
+
+    s->duplicates -= is_b & ~corrupt & (seq == s->b_last);
+    channel_send_lanes(s, &s->to_a, is_b, select_int(corrupt, s->b_ack - 2, seq), u_loss, u_delay, u_corrupt);
+    s->b_ack = select_int(deliver, 1 - s->b_ack, s->b_ack);
+    s->b_last = select_int(deliver, seq, s->b_last);
+    s->delivered -= deliver;
+
+    // A sends a new packet, or the last one again on a timeout or a NACK
+    vint again = is_timer | nack;
+
+    s->retransmitted -= again;
+    channel_send_lanes(s, &s->to_b, accept | again, s->a_last, u_loss, u_delay, u_corrupt);
+
+    s->timer = select_float(accept & (s->timer == NEVER), s->now + TIMEOUT, s->timer);
+    s->timer = select_float(again, s->now + TIMEOUT, s->timer);
+    s->timer = select_float(acked, all_lanes_float(NEVER), s->timer);
+    s->a_wait = select_int(accept, all_lanes_int(-1), s->a_wait);
+    s->a_wait = select_int(is_timer | acked, all_lanes_int(0), s->a_wait);
+}
+
+// Starts the replica in lane i, as replica_init().
+void lane_init(struct batch *s, int i, long replica)
+{
+    uint32_t x = replica_seed(replica);
+
+    s->replica[i] = replica;
+    s->next_msg[i] = 2.0f * lambda * uniform(&x);
+    s->rand[i] = x;
+    s->now[i] = 0.0f;
+    s->timer[i] = NEVER;
+    s->a_seq[i] = s->a_wait[i] = s->a_last[i] = s->b_ack[i] = 0;
+    s->b_last[i] = NO_PACKET;
+    for (int k = 0; k < CHANNEL_SLOTS; k++) {
+        s->to_b.at[k][i] = s->to_a.at[k][i] = NEVER;
+    }
+    s->to_b.count[i] = s->to_a.count[i] = 0;
+    s->nsim[i] = 0;
+    s->sent[i] = s->lost[i] = s->corrupted[i] = s->retransmitted[i] = 0;
+    s->delivered[i] = s->duplicates[i] = s->dropped[i] = s->overflowed[i] = 0;
+}
+
+void lane_result(struct batch *s, int i, struct result *result)
+{
+    result->time = s->now[i];
+    result->sent = s->sent[i];
+    result->lost = s->lost[i];
+    result->corrupted = s->corrupted[i];
+    result->retransmitted = s->retransmitted[i];
+    result->delivered = s->delivered[i];
+    result->duplicates = s->duplicates[i];
+    result->dropped = s->dropped[i];
+    result->overflowed = s->overflowed[i];
+}
+
+// Runs replicas first .. first + n - 1 into results, LANES at a time.
+void run_batched(long first, long n, struct result *results)
+{
+    struct batch s;
+    long next = first;
+    int running = 0;
+
+    memset(&s, 0, sizeof(s));
+    for (int i = 0; i < LANES; i++) {
+        s.nsim[i] = nsimmax;    // idle until a replica is put in
+        s.replica[i] = -1;
+    }
+
+    do {
+        running = 0;
+        for (int i = 0; i < LANES; i++) {
+            if (s.nsim[i] == nsimmax && s.replica[i] >= 0) {
+                lane_result(&s, i, &results[s.replica[i] - first]);
+                s.replica[i] = -1;
+            }
+            if (s.replica[i] < 0 && next < first + n) {
+                lane_init(&s, i, next++);
+            }
+            running += s.replica[i] >= 0;
+        }
+
+        for (int k = 0; k < HARVEST_STEPS && running > 0; k++) {
+            batch_step(&s);
+        }
+    } while (running > 0);
+}
+
+
+/****************************************************************************
+  The runs and the report.
+ ***************************************************************************/
+
+double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int compare_float(const void *a, const void *b)
+{
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Runs the first replicas both ways and compares what they come to.
+int self_test(struct result *results)
+{
+    long n = nreplicas < SELF_TEST_MAX ? nreplicas : SELF_TEST_MAX;
+    struct result expected;
+    int errors = 0;
+
+    run_batched(0, n, results);
+    for (long i = 0; i < n; i++) {
+        run_replica(i, &expected);
+        if (memcmp(&expected, &results[i], sizeof(expected)) != 0) {
+            printf("replica %ld differs: time %f / %f, delivered %d / %d\n",
+                   i, expected.time, results[i].time, expected.delivered, results[i].delivered);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+void report(struct result *results)
+{
+    float *times = (float *)malloc(nreplicas * sizeof(float));
+    double sum = 0.0, squares = 0.0;
+    long total[8] = { 0 };
+
+    if (times == NULL) {
+        printf("report: unable to allocate %ld times\n", nreplicas);
+        exit(1);
+    }
+
+    for (long i = 0; i < nreplicas; i++) {
+        struct result *r = &results[i];
+
+        times[i] = r->time;
+        sum += r->time;
+        squares += (double) r->time * r->time;
+        total[0] += r->sent;
+        total[1] += r->lost;
+        total[2] += r->corrupted;
+        total[3] += r->retransmitted;
+        total[4] += r->delivered;
+        total[5] += r->duplicates;
+        total[6] += r->dropped;
+        total[7] += r->overflowed;
+    }
+    qsort(times, nreplicas, sizeof(float), compare_float);
+
+    double mean = sum / nreplicas;
+
+    printf("Run time mean / stdev:                       %f / %f\n", mean, sqrt(squares / nreplicas > mean * mean ? squares / nreplicas - mean * mean : 0.0));
+    printf("Run time p50 / p90 / p99:                    %f / %f / %f\n",
+           times[nreplicas / 2], times[nreplicas * 9 / 10], times[nreplicas * 99 / 100]);
+    printf("Packets sent per replica:                    %f\n", (double) total[0] / nreplicas);
+    printf("Packets lost / corrupted per replica:        %f / %f\n", (double) total[1] / nreplicas, (double) total[2] / nreplicas);
+    printf("Retransmissions per replica:                 %f\n", (double) total[3] / nreplicas);
+    printf("Msgs delivered / dropped at A per replica:   %f / %f\n", (double) total[4] / nreplicas, (double) total[6] / nreplicas);
+    printf("Duplicates at B per replica:                 %f\n", (double) total[5] / nreplicas);
+    printf("Delivered fraction of msgs:                  %f\n", (double) total[4] / ((double) nreplicas * nsimmax));
+    if (total[7] > 0) {
+        printf("Packets dropped at a full channel:           %ld\n", total[7]);
+    }
+
+    free(times);
+}
+
+void usage(char *progname)
+{
+    printf("usage: %s [-r replicas] [-n nsimmax] [-l lossprob] [-c corruptprob] [-a lambda] [-S seed]\n", progname);
+    printf("  -r  independent ABP runs (default %ld)\n", nreplicas);
+    printf("  -n  msgs from layer 5 in each run (default %d)\n", nsimmax);
+    printf("  -l  probability that a packet is lost (default %f)\n", lossprob);
+    printf("  -c  probability that a packet is corrupted (default %f)\n", corruptprob);
+    printf("  -a  mean time between msgs from layer 5 (default %f)\n", lambda);
+    printf("  -S  seed of the runs' random numbers (default %u)\n", seed);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct result *results;
+    double start, batched, scalar;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:l:c:a:S:")) != -1) {
+        switch (opt) {
+            case 'r': nreplicas = atol(optarg); break;
+            case 'n': nsimmax = atoi(optarg); break;
+            case 'l': lossprob = atof(optarg); break;
+            case 'c': corruptprob = atof(optarg); break;
+            case 'a': lambda = atof(optarg); break;
+            case 'S': seed = (uint32_t) strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (nreplicas < 1 || nsimmax < 1 || lambda <= 0) {
+        printf("There must be at least one replica and one msg, and lambda must be positive\n");
+        usage(argv[0]);
+    }
+
+    results = (struct result *)malloc(nreplicas * sizeof(struct result));
+    if (results == NULL) {
+        printf("main: unable to allocate results for %ld replicas\n", nreplicas);
+        exit(1);
+    }
+
+    if (self_test(results) > 0) {
+        return 1;
+    }
+
+    start = now_seconds();
+    for (long i = 0; i < nreplicas; i++) {
+        run_replica(i, &results[i]);
+    }
+    scalar = now_seconds() - start;
+
+    start = now_seconds();
+    run_batched(0, nreplicas, results);
+    batched = now_seconds() - start;
+
+    printf("Replicas:                                    %ld\n", nreplicas);
+    printf("Msgs per replica:                            %d\n", nsimmax);
+    printf("Packet loss / corruption probability:        %f / %f\n", lossprob, corruptprob);
+    printf("Time between msgs from layer 5:              %f\n", lambda);
+    printf("Replicas per second one by one:              %.0f\n", nreplicas / scalar);
+    printf("Replicas per second in %2d lanes:             %.0f\n", LANES, nreplicas / batched);
+    printf("\n");
+    report(results);
+
+    free(results);
+    return 0;
+}
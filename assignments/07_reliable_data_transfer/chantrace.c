@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h> // for realloc
+#include <string.h>
+
+#include "chantrace.h"
+
+#define  MAX_LINE            256
+
+
+int chantrace_read(char *path, struct chantrace *trace)
+{
+    char line[MAX_LINE];
+    FILE *file = fopen(path, "r");
+    int size = 0, lineno = 0, nlost = 0, lost;
+    float delay;
+
+    memset(trace, 0, sizeof(*trace));
+    if (file == NULL) {
+        printf("chantrace_read: unable to open %s\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *hash = strchr(line, '#');
+        char rest;
+
+        lineno++;
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        if (sscanf(line, " %c", &rest) != 1) {
+            continue;
+        }
+        if (sscanf(line, "%f %d %c", &delay, &lost, &rest) != 2 || delay <= 0 || (lost != 0 && lost != 1)) {
+            printf("chantrace_read: %s:%d: expected a positive delay and 0 or 1 for lost\n", path, lineno);
+            fclose(file);
+            return -1;
+        }
+
+        if (trace->n == size) {
+            size = size > 0 ? 2 * size : 1024;
+            trace->delay = (float *)realloc(trace->delay, size * sizeof(float));
+            trace->lost = (char *)realloc(trace->lost, size);
+            if (trace->delay == NULL || trace->lost == NULL) {
+                printf("chantrace_read: unable to allocate %d packets\n", size);
+                exit(1);
+            }
+        }
+        trace->delay[trace->n] = delay;
+        trace->lost[trace->n] = lost;
+        trace->n++;
+        nlost += lost;
+
+        if (!lost && (trace->n - nlost == 1 || delay < trace->delay_min)) {
+            trace->delay_min = delay;
+        }
+        if (!lost && delay > trace->delay_max) {
+            trace->delay_max = delay;
+        }
+    }
+    fclose(file);
+
+    if (trace->n == nlost) {
+        printf("chantrace_read: %s has no packet that got through\n", path);
+        return -1;
+    }
+    trace->loss_rate = (float) nlost / trace->n;
+    return 0;
+}
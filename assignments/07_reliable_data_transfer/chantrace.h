@@ -0,0 +1,19 @@
+/* Delay and loss traces of a channel, as pcap_trace writes them from a
+   capture and gbn -X replays them.
+
+   A trace is text, a line per packet that went through the channel: the
+   time it took one way, in the emulator's time units, and 1 if it was lost
+   or 0 if not. A lost packet's delay is the one before it. '#' starts a
+   comment. */
+
+struct chantrace {
+    int n;                      // packets in the trace
+    float *delay;
+    char *lost;
+    float delay_min;            // over the packets that got through
+    float delay_max;
+    float loss_rate;
+};
+
+// Reads the trace at path into trace. Returns 0, or -1 with a message printed.
+int chantrace_read(char *path, struct chantrace *trace);
@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>  // for _mm_add_epi32, _mm_unpacklo_epi16
+#endif
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>  // for _mm_crc32_u64
+#endif
+
+#include "checksum.h"
+
+#define CRC32C_POLY     0x82f63b78  // Castagnoli polynomial, bit reversed
+#define SUM_BLOCKS      16384       // 16-byte blocks a 32-bit lane adds up before it could overflow
+
+uint32_t crc_table[8][256];         // crc_table[n][b]: CRC of byte b followed by n zero bytes
+
+
+void checksum_init()
+{
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = (uint32_t) b;
+
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][b] = crc;
+    }
+    for (int n = 1; n < 8; n++) {
+        for (int b = 0; b < 256; b++) {
+            crc_table[n][b] = (crc_table[n - 1][b] >> 8) ^ crc_table[0][crc_table[n - 1][b] & 0xff];
+        }
+    }
+}
+
+
+// Folds the carries of a wide one's complement sum back into 16 bits.
+unsigned inet_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (unsigned) sum;
+}
+
+// Adds the bytes from i on a word at a time, the last one padded if len is odd.
+uint64_t inet_sum_tail(const unsigned char *p, int i, int len, uint64_t sum)
+{
+    for (; i + 2 <= len; i += 2) {
+        uint16_t w;
+
+        memcpy(&w, p + i, 2);
+        sum += w;
+    }
+    if (i < len) {
+        uint16_t w = 0;
+
+        memcpy(&w, p + i, 1);
+        sum += w;
+    }
+    return sum;
+}
+
+unsigned inet_sum_scalar(const void *data, int len, unsigned sum)
+{
+    return inet_fold(inet_sum_tail(data, 0, len, sum));
+}
+
+/* Widens the eight 16-bit words of each block into 32-bit lanes and adds
+   them up; the lanes go into the 64-bit total every SUM_BLOCKS blocks. With
+   dst, every block is stored there too, so the data is read only once. */
+unsigned inet_sum_blocks(unsigned char *dst, const unsigned char *src, int len, unsigned sum)
+{
+    uint64_t total = sum;
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+
+    while (len - i >= 16) {
+        __m128i acc = zero;
+        int end = len - i < 16 * SUM_BLOCKS ? len - 15 : i + 16 * SUM_BLOCKS;
+        uint32_t lanes[4];
+
+        for (; i < end; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+
+            if (dst != NULL) {
+                _mm_storeu_si128((__m128i *) (dst + i), x);
+            }
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(x, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(x, zero));
+        }
+        _mm_storeu_si128((__m128i *) lanes, acc);
+        total += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+
+    if (dst != NULL) {
+        memcpy(dst + i, src + i, len - i);
+    }
+    return inet_fold(inet_sum_tail(src, i, len, total));
+}
+
+unsigned inet_sum(const void *data, int len, unsigned sum)
+{
+    return inet_sum_blocks(NULL, data, len, sum);
+}
+
+unsigned inet_sum_copy(void *dst, const void *src, int len, unsigned sum)
+{
+    return inet_sum_blocks(dst, src, len, sum);
+}
+
+const char *inet_sum_impl()
+{
+#ifdef __SSE2__
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+
+/* Slicing-by-8: eight bytes are folded into the CRC at once with one table
+   lookup each. The word load assumes a little-endian machine; elsewhere the
+   bytes go one at a time. */
+uint32_t crc32c_scalar(uint32_t crc, const void *data, int len)
+{
+    const unsigned char *p = data;
+
+    crc = ~crc;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff]
+            ^ crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff]
+            ^ crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff]
+            ^ crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+    }
+#endif
+    for (; len > 0; p++, len--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+    }
+    return ~crc;
+}
+
+// The crc32 instruction folds in eight bytes per cycle or so; dst gets a copy of what it read.
+uint32_t crc32c_blocks(uint32_t crc, unsigned char *dst, const unsigned char *src, int len)
+{
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    uint64_t c = ~crc;
+    int i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+
+        memcpy(&w, src + i, 8);
+        if (dst != NULL) {
+            memcpy(dst + i, &w, 8);
+        }
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; i < len; i++) {
+        if (dst != NULL) {
+            dst[i] = src[i];
+        }
+        c = _mm_crc32_u8((uint32_t) c, src[i]);
+    }
+    return ~(uint32_t) c;
+#else
+    if (dst != NULL) {
+        memcpy(dst, src, len);
+    }
+    return crc32c_scalar(crc, src, len);
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, int len)
+{
+    return crc32c_blocks(crc, NULL, data, len);
+}
+
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, int len)
+{
+    return crc32c_blocks(crc, dst, src, len);
+}
+
+const char *crc32c_impl()
+{
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    return "sse4.2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,33 @@
+/* Packet checksums for the RDT emulator.
+
+   inet_sum() is the 16-bit one's complement sum of the Internet checksum
+   (RFC 1071), taken over the data as 16-bit words in host byte order; an odd
+   last byte is padded with a zero byte. It returns the folded sum, which can
+   be passed back in to go on over more data, and the checksum itself is its
+   complement. crc32c() is the CRC-32C (Castagnoli) used by iSCSI and SCTP,
+   chained like zlib's crc32(): start with 0, pass the result back in.
+
+   With SSE2 the sum takes 16 bytes at a time and with SSE4.2 the CRC uses
+   the crc32 instruction; the _scalar versions are the portable fallbacks.
+   The _copy versions copy the data to dst while they go over it. */
+
+#include <stdint.h>
+
+void checksum_init();
+
+unsigned inet_sum(const void *data, int len, unsigned sum);
+
+unsigned inet_sum_copy(void *dst, const void *src, int len, unsigned sum);
+
+unsigned inet_sum_scalar(const void *data, int len, unsigned sum);
+
+uint32_t crc32c(uint32_t crc, const void *data, int len);
+
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, int len);
+
+uint32_t crc32c_scalar(uint32_t crc, const void *data, int len);
+
+// which implementations were compiled in, for reports
+const char *inet_sum_impl();
+
+const char *crc32c_impl();
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h> // for malloc, rand
+#include <string.h>
+#include <time.h>   // for clock_gettime
+
+#include "checksum.h"
+
+/* Microbenchmarks for the packet checksums: every implementation is run over
+   payloads of each size until BENCH_BYTES have gone through it, and the time
+   per call and the throughput are printed. First the fast versions are
+   checked against the scalar ones and known answers. */
+
+#define BENCH_BYTES     (256L * 1024 * 1024)   // bytes each implementation checksums per payload size
+#define MAX_SIZE        65536
+
+unsigned char src[MAX_SIZE + 16];
+unsigned char dst[MAX_SIZE + 16];
+volatile uint32_t sink;             // keeps the compiler from dropping the work
+
+
+// The byte-wise sum gbn.c and abp.c used before, for comparison.
+unsigned byte_sum(const void *data, int len, unsigned sum)
+{
+    const char *p = data;
+
+    for (int i = 0; i < len; i++) {
+        sum += (unsigned) (int) p[i];
+    }
+    return sum;
+}
+
+unsigned byte_sum_copy(void *to, const void *from, int len, unsigned sum)
+{
+    memmove(to, from, len);
+    return byte_sum(to, len, sum);
+}
+
+unsigned inet_sum_then_copy(void *to, const void *from, int len, unsigned sum)
+{
+    memmove(to, from, len);
+    return inet_sum(to, len, sum);
+}
+
+unsigned crc32c_bench(const void *data, int len, unsigned sum)
+{
+    return crc32c(sum, data, len);
+}
+
+unsigned crc32c_scalar_bench(const void *data, int len, unsigned sum)
+{
+    return crc32c_scalar(sum, data, len);
+}
+
+unsigned crc32c_copy_bench(void *to, const void *from, int len, unsigned sum)
+{
+    return crc32c_copy(sum, to, from, len);
+}
+
+unsigned crc32c_then_copy(void *to, const void *from, int len, unsigned sum)
+{
+    memmove(to, from, len);
+    return crc32c(sum, to, len);
+}
+
+struct bench {
+    char *name;
+    unsigned (*sum)(const void *data, int len, unsigned sum);
+    unsigned (*sum_copy)(void *to, const void *from, int len, unsigned sum);
+};
+
+struct bench benches[] = {
+    { "byte sum",             byte_sum,            NULL },
+    { "byte sum, memmove",    NULL,                byte_sum_copy },
+    { "inet scalar",          inet_sum_scalar,     NULL },
+    { "inet",                 inet_sum,            NULL },
+    { "inet, memmove first",  NULL,                inet_sum_then_copy },
+    { "inet, fused copy",     NULL,                inet_sum_copy },
+    { "crc32c scalar",        crc32c_scalar_bench, NULL },
+    { "crc32c",               crc32c_bench,        NULL },
+    { "crc32c, memmove first", NULL,               crc32c_then_copy },
+    { "crc32c, fused copy",   NULL,                crc32c_copy_bench },
+};
+
+int sizes[] = { 20, 64, 256, 1000, 1500, 4096, 65536 };
+
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Compares the fast versions with the scalar ones at every length and alignment, and with known answers.
+int self_test()
+{
+    int errors = 0;
+
+    // RFC 3720 B.4 and the usual "123456789" check value
+    if (crc32c(0, "123456789", 9) != 0xe3069283 || crc32c_scalar(0, "123456789", 9) != 0xe3069283) {
+        printf("crc32c check value wrong\n");
+        errors++;
+    }
+    memset(dst, 0xff, 32);
+    if (crc32c(0, dst, 32) != 0x62a8ab43) {
+        printf("crc32c of 32 0xff bytes wrong\n");
+        errors++;
+    }
+
+    for (int offset = 0; offset < 16; offset++) {
+        for (int len = 0; len <= 300; len++) {
+            unsigned a = inet_sum_scalar(src + offset, len, 0x1234);
+            uint32_t c = crc32c_scalar(0x5678, src + offset, len);
+
+            if (inet_sum(src + offset, len, 0x1234) != a || inet_sum_copy(dst + 1, src + offset, len, 0x1234) != a
+                    || memcmp(dst + 1, src + offset, len) != 0) {
+                printf("inet sum differs at offset %d, length %d\n", offset, len);
+                errors++;
+            }
+            if (crc32c(0x5678, src + offset, len) != c || crc32c_copy(0x5678, dst + 1, src + offset, len) != c
+                    || memcmp(dst + 1, src + offset, len) != 0) {
+                printf("crc32c differs at offset %d, length %d\n", offset, len);
+                errors++;
+            }
+        }
+    }
+
+    // a sum long enough to need the lanes folded in on the way
+    if (inet_sum(src, MAX_SIZE, 0) != inet_sum_scalar(src, MAX_SIZE, 0)) {
+        printf("inet sum differs over %d bytes\n", MAX_SIZE);
+        errors++;
+    }
+    return errors;
+}
+
+int main()
+{
+    checksum_init();
+
+    srand(9999);
+    for (int i = 0; i < MAX_SIZE + 16; i++) {
+        src[i] = (unsigned char) rand();
+    }
+
+    if (self_test() > 0) {
+        return 1;
+    }
+
+    printf("inet sum: %s, crc32c: %s\n\n", inet_sum_impl(), crc32c_impl());
+    printf("%-24s", "ns per call / GB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        printf("%18d", sizes[s]);
+    }
+    printf("\n");
+
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        printf("%-24s", benches[b].name);
+
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            long calls = BENCH_BYTES / sizes[s];
+            unsigned sum = 0;
+            double start = now();
+
+            for (long n = 0; n < calls; n++) {
+                if (benches[b].sum != NULL) {
+                    sum = benches[b].sum(src, sizes[s], sum);
+                }
+                else {
+                    sum = benches[b].sum_copy(dst, src, sizes[s], sum);
+                }
+            }
+
+            double elapsed = now() - start;
+
+            sink = sum;
+            printf("%10.1f / %5.2f", elapsed * 1e9 / calls, (double) calls * sizes[s] / elapsed * 1e-9);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
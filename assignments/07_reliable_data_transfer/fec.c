@@ -0,0 +1,203 @@
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>  // for _mm_shuffle_epi8
+#endif
+
+#include "fec.h"
+
+#define GF_POLY 0x11d       // x^8 + x^4 + x^3 + x^2 + 1
+
+unsigned char gf_exp[512];  // doubled so gf_mul() needs no modulo
+int gf_log[256];
+unsigned char coef[FEC_MAX_M][FEC_MAX_K];
+
+
+unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+unsigned char gf_inv(unsigned char a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+// coefficient of data payload i in parity payload j
+unsigned char fec_coef(int j, int i)
+{
+    return coef[j][i];
+}
+
+void fec_init()
+{
+    int x = 1;
+
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = (unsigned char) x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLY;
+        }
+    }
+    gf_log[0] = 0;
+
+    /* Cauchy matrix 1 / (x_j + y_i) with x_j = j and y_i = FEC_MAX_M + i,
+       which never coincide. Dividing each column by its row 0 entry keeps
+       every square submatrix invertible and turns row 0 into all ones. */
+    for (int i = 0; i < FEC_MAX_K; i++) {
+        unsigned char scale = (unsigned char) (0 ^ (FEC_MAX_M + i));
+
+        for (int j = 0; j < FEC_MAX_M; j++) {
+            coef[j][i] = gf_mul(gf_inv((unsigned char) (j ^ (FEC_MAX_M + i))), scale);
+        }
+    }
+}
+
+
+// dst ^= src, a machine word at a time
+void fec_xor_region(unsigned char *dst, const unsigned char *src, int len)
+{
+    int i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+/* dst ^= c * src. A product c * x is split into c * (x & 0x0f) and
+   c * (x & 0xf0), each looked up in a 16 entry table, so with SSSE3 a
+   single byte shuffle multiplies 16 bytes at once. */
+void fec_mul_add_region(unsigned char *dst, const unsigned char *src, unsigned char c, int len)
+{
+    unsigned char lo[16], hi[16];
+    int i = 0;
+
+    if (c == 0) {
+        return;
+    }
+    if (c == 1) {
+        fec_xor_region(dst, src, len);
+        return;
+    }
+
+    for (int n = 0; n < 16; n++) {
+        lo[n] = gf_mul(c, (unsigned char) n);
+        hi[n] = gf_mul(c, (unsigned char) (n << 4));
+    }
+
+#ifdef __SSSE3__
+    __m128i lo_table = _mm_loadu_si128((const __m128i *) lo);
+    __m128i hi_table = _mm_loadu_si128((const __m128i *) hi);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(lo_table, _mm_and_si128(x, nibble)),
+                                        _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi64(x, 4), nibble)));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, product));
+    }
+#endif
+
+    for (; i < len; i++) {
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+    }
+}
+
+
+// computes the m parity payloads of a block of k data payloads
+void fec_encode(int k, int m, unsigned char **data, unsigned char **parity, int len)
+{
+    for (int j = 0; j < m; j++) {
+        memset(parity[j], 0, len);
+        for (int i = 0; i < k; i++) {
+            fec_mul_add_region(parity[j], data[i], coef[j][i], len);
+        }
+    }
+}
+
+/* Rebuilds the missing data payloads of a block in place. Returns the number
+   rebuilt, or -1 if fewer parities than missing payloads arrived. */
+int fec_decode(int k, int m, unsigned char **data, const char *have_data,
+               unsigned char **parity, const char *have_parity, int len)
+{
+    int missing[FEC_MAX_M], rows[FEC_MAX_M];
+    unsigned char a[FEC_MAX_M][FEC_MAX_M];
+    int e = 0, r = 0;
+
+    for (int i = 0; i < k; i++) {
+        if (!have_data[i]) {
+            if (e == m) {
+                return -1;
+            }
+            missing[e++] = i;
+        }
+    }
+    for (int j = 0; j < m && r < e; j++) {
+        if (have_parity[j]) {
+            rows[r++] = j;
+        }
+    }
+    if (r < e) {
+        return -1;
+    }
+
+    /* Each chosen parity minus the known data leaves a linear combination of
+       the missing payloads; collect those in data[missing[n]] and solve. */
+    for (int n = 0; n < e; n++) {
+        unsigned char *rhs = data[missing[n]];
+
+        memcpy(rhs, parity[rows[n]], len);
+        for (int i = 0; i < k; i++) {
+            if (have_data[i]) {
+                fec_mul_add_region(rhs, data[i], coef[rows[n]][i], len);
+            }
+        }
+        for (int c = 0; c < e; c++) {
+            a[n][c] = coef[rows[n]][missing[c]];
+        }
+    }
+
+    /* Gauss-Jordan elimination. Every leading minor of a Cauchy matrix is
+       nonzero, so the pivots never vanish and no rows need swapping. */
+    for (int c = 0; c < e; c++) {
+        unsigned char inv = gf_inv(a[c][c]);
+        unsigned char scaled[len];
+
+        memset(scaled, 0, len);
+        fec_mul_add_region(scaled, data[missing[c]], inv, len);
+        memcpy(data[missing[c]], scaled, len);
+        for (int n = 0; n < e; n++) {
+            a[c][n] = gf_mul(a[c][n], inv);
+        }
+
+        for (int n = 0; n < e; n++) {
+            unsigned char f = a[n][c];
+
+            if (n == c || f == 0) {
+                continue;
+            }
+            fec_mul_add_region(data[missing[n]], data[missing[c]], f, len);
+            for (int q = 0; q < e; q++) {
+                a[n][q] ^= gf_mul(f, a[c][q]);
+            }
+        }
+    }
+
+    return e;
+}
@@ -0,0 +1,27 @@
+/* Forward error correction over GF(2^8) for the RDT emulator.
+
+   A block of k data payloads is protected by m parity payloads. Parity j is
+   sum_i coef(j, i) * data_i with coefficients from a Cauchy matrix whose
+   columns are scaled so that parity 0 is the plain XOR of the block. Every
+   square submatrix of a Cauchy matrix is invertible, so any m lost payloads
+   of a block can be rebuilt from the m parities. */
+
+#define FEC_MAX_K   64      // largest block of data packets
+#define FEC_MAX_M   16      // most parity packets per block
+
+void fec_init();
+
+unsigned char gf_mul(unsigned char a, unsigned char b);
+
+unsigned char gf_inv(unsigned char a);
+
+unsigned char fec_coef(int j, int i);
+
+void fec_xor_region(unsigned char *dst, const unsigned char *src, int len);
+
+void fec_mul_add_region(unsigned char *dst, const unsigned char *src, unsigned char c, int len);
+
+void fec_encode(int k, int m, unsigned char **data, unsigned char **parity, int len);
+
+int fec_decode(int k, int m, unsigned char **data, const char *have_data,
+               unsigned char **parity, const char *have_parity, int len);
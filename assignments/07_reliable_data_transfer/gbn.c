@@ -1,6 +1,19 @@
 #include <stdio.h>
+#include <stdarg.h> // for va_list
+#include <stddef.h> // for offsetof
 #include <stdlib.h> // for malloc, free, srand, rand
 #include <string.h>
+#include <math.h>   // for cbrt
+#include <unistd.h> // for getopt
+#include <pthread.h>
+#include <arpa/inet.h>  // for htonl, ntohl
+
+#include "checksum.h"
+#include "fec.h"
+#include "qdisc.h"
+#include "impair.h"
+#include "chantrace.h"
+#include "loopback.h"
 
 /*******************************************************************
  ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.1  J.F.Kurose
@@ -13,20 +26,40 @@
    - packets can be corrupted (either the header or the data portion)
      or lost, according to user-defined probabilities
    - packets will be delivered in the order in which they were sent
-     (although some can be lost).
+     (although some can be lost), unless they are set to be reordered
+     or duplicated.
 **********************************************************************/
 
 
-#define  BIDIRECTIONAL    0    // change to 1 if you're doing extra credit
-                               // and write a routine called B_output
+int bidirectional = 0;          // 1 to send data from B to A as well (-b)
+int nflows = 1;                 // independent A to B flows sharing the link (-N)
 
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer
    4 (students' code).  It contains the data (characters) to be delivered
    to layer 5 via the students transport level protocol entities. */
+#define  MSG_SIZE            20      // bytes in a msg
+#define  MAX_PAYLOAD         1000    // most bytes a packet can carry
+
 struct msg {
-    char data[20];
+    char data[MSG_SIZE];
+};
+
+
+/* The payload of a packet lives in a reference-counted buffer. Copies of a
+   packet, in the sender's window, on the wire and at the receiver, copy only
+   the header and share the payload. */
+struct pkt_buf {
+    int refs;
+    struct pkt_buf *next_free;
+    struct pkt_pool *pool;  // where the buffer goes back to
+    char data[MAX_PAYLOAD];
 };
 
+/* Released buffers are kept for reuse by the flow they came from, so flows
+   run by different threads never touch the same list. */
+struct pkt_pool {
+    struct pkt_buf *free;
+};
 
 /* a packet is the data unit passed from layer 4 (students code) to layer
    3 (teachers code).  Note the pre-defined packet structure, which all
@@ -35,451 +68,3591 @@ struct pkt {
     int seqnum;
     int acknum;
     int checksum;
-    char payload[20];
+    int fec;                // 0 for data, j+1 for FEC parity j of the block starting at seqnum
+    int rwnd;               // msgs the sender of this packet can still take in
+    int length;             // bytes of payload that are used
+    int fec_length;         // for FEC parity, the coded lengths of the data packets
+    int ecn;                // ECN_ bits, in the IP and TCP headers of a real packet so not checksummed here
+    char *payload;          // buf->data, or an empty payload without buf
+    struct pkt_buf *buf;
 };
 
+// The ECN bits of a packet (RFC 3168)
+#define  ECN_ECT             1       // sent by an ECN-capable transport
+#define  ECN_CE              2       // marked Congestion Experienced by the bottleneck
+#define  ECN_ECE             4       // ECN-Echo: the receiver saw a mark
+#define  ECN_CWR             8       // Congestion Window Reduced: the sender has reacted to it
+
 
 struct event {
     float evtime;           // event time
     int evtype;             // event type code
     int eventity;           // entity where event occurs
+    int timer;              // which of the entity's timers (if a timer event)
     struct pkt *pktptr;     // pointer to packet (if any) assoc w/ this event
-    struct event *prev;
-    struct event *next;
+    long seq;               // order the event was inserted in
+    int heap_index;         // where the event is in the event heap
+};
+
+// A packet waiting at a bottleneck, or on its way from one hop of the path to the next.
+struct queued {
+    struct qpkt q;          // first, so the queue discipline's packet is this one
+    int AorB;               // entity that sent it
+    struct pkt *packet;
+    int hop;                // the hop it is at, or arrives at
+    float at;               // when it arrives there
+    long seq;               // order it was sent on, to order those arriving at the same time
 };
 
 
+/******************** PACKET BUFFERS ********************/
+
+struct pkt_pool *pools;             // released buffers of each flow, reused before malloc()ing more
+char no_payload[1];                 // what payload points to in a packet without buf
+_Atomic int nbufalloc = 0;          // buffers malloc()ed
+_Atomic long nbufcopied = 0;        // payload bytes copied because a shared buffer was written to
+
+
+// Drops the packet's reference to its payload; the last one frees the buffer.
+void pkt_release(struct pkt *packet)
+{
+    if (packet->buf != NULL && --packet->buf->refs == 0) {
+        packet->buf->next_free = packet->buf->pool->free;
+        packet->buf->pool->free = packet->buf;
+    }
+    packet->buf = NULL;
+    packet->payload = no_payload;
+}
+
+// Gives a packet a fresh, unshared payload buffer of the flow's in place of the one it had.
+void pkt_alloc_payload(struct pkt *packet, int flow)
+{
+    struct pkt_pool *pool = &pools[flow];
+    struct pkt_buf *buf;
+
+    pkt_release(packet);
+
+    if ((buf = pool->free) != NULL) {
+        pool->free = buf->next_free;
+    }
+    else if ((buf = (struct pkt_buf *)malloc(sizeof(struct pkt_buf))) == NULL) {
+        printf("pkt_alloc_payload: unable to allocate a packet buffer\n");
+        exit(1);
+    }
+    else {
+        nbufalloc++;
+    }
+
+    buf->refs = 1;
+    buf->pool = pool;
+    packet->buf = buf;
+    packet->payload = buf->data;
+}
+
+// Makes dst a copy of src that shares its payload; dst may be src.
+void pkt_hold(struct pkt *dst, struct pkt *src)
+{
+    struct pkt copy = *src;
+
+    if (copy.buf != NULL) {
+        copy.buf->refs++;
+    }
+    pkt_release(dst);
+    *dst = copy;
+}
+
+// Copy on write: before a packet's payload is changed, it gets a buffer of its own.
+void pkt_unshare(struct pkt *packet)
+{
+    struct pkt_buf *shared = packet->buf;
+
+    if (shared == NULL || shared->refs == 1) {
+        return;
+    }
+
+    shared->refs++;
+    pkt_alloc_payload(packet, shared->pool - pools);
+    memcpy(packet->payload, shared->data, packet->length);
+    nbufcopied += packet->length;
+
+    shared->refs--;
+}
+
+
 //********* STUDENTS WRITE THE NEXT SEVEN ROUTINES *********
 
 #define  PKT_SIZE            sizeof(struct pkt)         // Size of a pkt struct
+#define  PKT_HEADER_SIZE     (offsetof(struct pkt, fec_length) + sizeof(int))  // Bytes a packet takes on the wire besides its payload
 #define  MSG_BUFFER_SIZE     50                         // Max amount of messages to buffer in sender while the window is full
-#define  WINDOW_SIZE         8                          // Max amount of packets to send before waiting for ACKs from receiver
+#define  STREAM_BUFFER_SIZE  65536                      // Bytes of a byte stream the sender buffers while the window is full
+#define  MAX_WINDOW_SIZE     65536                      // Largest window accepted on the command line
+#define  MAX_SEQNUM_BITS     30                         // Widest sequence number field that still leaves room for NACKs in acknum
+#define  NO_DATA             -1                         // seqnum of a packet that only carries an ACK or NACK
+#define  RTX_TIMER           0                          // retransmission timer, the one starttimer() runs
+#define  ACK_TIMER           1                          // how long an owed ACK waits for data to ride on
+#define  PACE_TIMER          2                          // when the pacer lets the next packet out
+#define  PACING_GAIN         1.25                       // with -P rtt, pace at this many windows per smoothed RTT
+#define  PERSIST_TIMER       3                          // when the sender probes a receiver that advertised a zero window
+#define  APP_TIMER           4                          // when the receiving application takes the next message
+#define  PERSIST_MAX_BACKOFF 4                          // zero-window probes back off up to this many retransmission timeouts apart
+#define  COALESCE_TIMER      5                          // how long messages may wait to fill a packet
+#define  RTT_ALPHA           0.125                      // weight of a new RTT sample in the smoothed RTT (RFC 6298)
+
+int window_size = 8;     // Max amount of packets to send before waiting for ACKs from receiver
+int seqnum_bits = 16;    // Width of the sequence number field, seqnums wrap at 2^seqnum_bits
+char *cc_name = "none";  // Congestion control algorithm used by the sender
+char *cwnd_log = NULL;   // File to write the cwnd time series to, if any
+int ecn = 0;             // Senders mark data ECN-capable and cut their window for echoed marks
+float ack_delay = 0.0;   // How long an ACK may be delayed, waiting for data to ride on or more packets to cover
+int ack_every = 0;       // ACK at once after this many in-order packets, 0 to only wait for the timer
+int dupack_threshold = 3;  // Duplicate ACKs that trigger a fast retransmit, 0 to go back N on every NACK
+float rtx_timeout = 15.0;  // How long the sender waits for an ACK before going back N
+int fec_k = 0;           // Data packets per FEC block, 0 for no FEC
+int fec_m = 1;           // Parity packets sent after each FEC block
+float pace_rate = 0.0;   // Packets per time unit the sender paces at, 0 for no pacing
+int pace_rtt = 0;        // Pace at PACING_GAIN windows per smoothed RTT instead
+float app_rate = 0.0;    // Messages per time unit the receiving application takes, 0 to take them as they come
+int app_buffer_size = 16;  // Messages the receiver holds for the application, advertised as rwnd
+int max_payload = MSG_SIZE;  // Most payload bytes per packet, so at most max_payload / MSG_SIZE msgs
+float coalesce_delay = 0.0;  // How long msgs may wait for more to fill a packet while data is unacknowledged
+long stream_bytes = 0;   // Bytes A sends through its byte-stream API instead of msgs from layer 5, 0 for msgs
+char *checksum_name = "inet";  // Checksum packets carry: sum, inet or crc32c
+char *workload_name = "uniform";  // How msgs come down from layer 5, see workloads[], with its parameters after a comma
+int drain = 0;           // Run until every msg is delivered instead of until the last one comes down from layer 5
 
 
 void init();
-void generate_next_arrival();
+struct workload *workload_lookup(char *name);
+int read_msg_trace(char *path);
+void generate_next_arrival(int flow);
+void give_msg(int AorB);
+void check_drained(int flow);
+void msg_refused(int flow);
 void insertevent(struct event *p);
+void removeevent(struct event *p);
+int event_before(struct event *a, struct event *b);
 void starttimer(int AorB, float increment);
 void stoptimer(int AorB);
-void tolayer3(int AorB, struct pkt);
-void tolayer5(char datasent[20]);
+void start_timer(int AorB, int timer, float increment);
+void stop_timer(int AorB, int timer);
+void tolayer3(int AorB, struct pkt *packet);
+void forward_packet(int AorB, struct pkt *mypktptr);
+int reordered(unsigned short *channel_rand, float *late);
+int replay_channel(int link, float *delay);
+void duplicate_packet(int dest, struct pkt *mypktptr, float at, float min, float max, unsigned short *channel_rand);
+int corrupt_packet(int dest, struct pkt *mypktptr, unsigned short *channel_rand);
+int flip_bits(int link, struct pkt *mypktptr);
+void loopback_forward(int AorB, struct pkt *mypktptr);
+void link_enqueue(int AorB, struct pkt *mypktptr);
+void hop_arrive(int h, struct queued *qp);
+void link_send(int h, struct queued *qp);
+void link_drop(struct qpkt *q, void *arg);
+void queue_depth(int h, int link);
+void transit_push(struct queued *qp);
+struct queued *transit_pop();
+int link_next(float *when);
+void link_step(int link);
+void link_run(float until, int before);
+void tolayer5(int AorB, char datasent[20]);
+void tolayer5_bytes(int AorB, char *data, int length);
+int compare_float(const void *a, const void *b);
+void record_burst(int AorB);
+float simtime();
+void trace_printf(const char *format, ...);
+void trace_fprintf(FILE *out, const char *format, ...);
 
 
 struct receiver {
     int expected_seqnum;
-} B_receiver;
+    int active;                 // whether the other side sends us data at all
+    int ack_pending;            // an ACK is owed to the other side
+    int nack_pending;           // ... and it should be a NACK for expected_seqnum
+    int ack_now;                // ... and it must not be delayed
+    int unacked;                // in-order packets received since the last ACK went out
+    int ack_timer_running;
+    long delivered;             // packets handed to layer 5 so far, to find the FEC block of expected_seqnum
+    unsigned ring_mask;         // rcv_buffer holds ring_mask + 1 packets, always a power of two
+    struct pkt *rcv_buffer;     // packets received after a gap, and with FEC the block being decoded
+    char *rcv_state;
+    struct pkt *parity_buffer;  // fec_m parities per slot, for the block starting at that seqnum
+    char *parity_valid;
+    char (*app_buffer)[MSG_SIZE];     // delivered messages the application has not taken yet, with app_rate
+    int app_head;
+    int app_count;
+    int app_timer_running;
+    int zero_window;            // the last rwnd we advertised was 0, so an opening must be announced
+    int ece;                    // with ECN, echo a mark back on every packet until the sender says it reacted
+};
+
+// rcv_state of a slot, which only counts if the packet in it has the seqnum we look for
+#define  RCV_EMPTY           0
+#define  RCV_WAITING         1                          // arrived after a gap, not yet delivered
+#define  RCV_DELIVERED       2                          // delivered, kept to decode the rest of its FEC block
+
+/* Congestion control state of a flow. cwnd and ssthresh are in packets;
+   the w_max/k/epoch_start/w_est fields are only used by CUBIC. */
+struct cc_state {
+    double cwnd;
+    double ssthresh;
+    int in_recovery;        // set between a loss and the ACK that covers `recover`
+    int recover;            // next_seqnum when the loss was detected
+    double w_max;
+    double k;
+    float epoch_start;
+    double w_est;
+};
+
+/* A congestion control algorithm reacts to newly ACKed packets, to a loss
+   signalled by the receiver (a NACK) and to a retransmission timeout.
+   on_ack() can check in_recovery to hold the window while recovering. */
+struct cc_algorithm {
+    char *name;
+    void (*init)(struct cc_state *cc);
+    void (*on_ack)(struct cc_state *cc, int acked);
+    void (*on_loss)(struct cc_state *cc);
+    void (*on_timeout)(struct cc_state *cc);
+    int partial_ack_ends_recovery;  // Reno leaves recovery on any new ACK, NewReno waits for `recover`
+};
 
 struct sender {
-    int next_seqnum;
+    int next_seqnum;            // one past the highest seqnum sent so far
+    int send_seqnum;            // next seqnum to put on the wire, goes back to the base on loss
     int window_base_seqnum;
-    struct pkt pkt_buffer[WINDOW_SIZE];
-} A_sender;
+    int timer_running;
+    int dupacks;                // duplicate ACKs in a row for window_base_seqnum
+    int fec_start;              // first seqnum of the FEC block being sent
+    int fec_count;              // new packets sent in that block so far
+    unsigned ring_mask;         // pkt_buffer holds ring_mask + 1 packets, always a power of two
+    struct pkt *pkt_buffer;
+    float *sent_at;             // when each packet in pkt_buffer was sent, -1 once it was sent again
+    unsigned *payload_sum;      // checksum_algo's sum over each payload in pkt_buffer, taken while it was copied in
+    float srtt;                 // smoothed RTT, 0 until the first sample
+    float next_send_at;         // the pacer holds packets back until then
+    int pace_timer_running;
+    int coalesce_timer_running;
+    int flush;                  // send a packet that is not full, the coalescing delay is over
+    int peer_rwnd;              // msgs the receiver can take in from window_base_seqnum on
+    int probe;                  // send one packet past a zero window
+    int persist_backoff;        // retransmission timeouts until the next zero-window probe
+    int persist_timer_running;
+    float zero_window_since;    // when the advertised window last closed
+    float zero_window_time;     // total time the sender was stopped by a zero window
+    char *send_buffer;          // bytes from layer 5 not yet in a packet, whole msgs unless it is a byte stream
+    int send_buffer_size;
+    int send_head;
+    int send_count;
+    struct cc_algorithm *cc_algo;
+    struct cc_state cc;
+    int ecn_reacted;            // the window was cut for an ECN-Echo ...
+    int ecn_recover;            // ... while next_seqnum was this, echoes are ignored until the packet after it is ACKed
+    int cwr_pending;            // the next data packet tells the receiver the window was cut
+};
+
+/* A and B are symmetric: each sends its own data and acknowledges the
+   other's, and ACKs ride on data packets going the other way whenever
+   there are any. Every flow has its own pair: A of flow i is entity 2i and
+   B is entity 2i + 1, so an entity's peer is AorB ^ 1. */
+struct entity {
+    struct sender sender;
+    struct receiver receiver;
+} *entities;
+
+FILE *cwnd_file = NULL;
+
+// Counted from every thread that runs flows, so they are atomic.
+_Atomic int npiggyback = 0;       // ACKs that rode on a data packet
+_Atomic int npureack = 0;         // packets sent only to carry an ACK or NACK
+_Atomic int nretransmit = 0;      // data packets sent more than once
+_Atomic int nfastretransmit = 0;  // fast retransmits after dupack_threshold duplicate ACKs
+_Atomic int nduplicate = 0;       // data packets that arrived again after they had been received
+_Atomic int nahead = 0;           // data packets that arrived past a gap in the seqnums
+_Atomic int nnack = 0;            // NACKs sent, on data or on their own
+_Atomic int nparity = 0;          // FEC parity packets sent
+_Atomic int nfecrecovered = 0;    // lost data packets rebuilt from FEC parity
+_Atomic int nce = 0;              // data packets that arrived marked Congestion Experienced
+_Atomic int necnreduce = 0;       // windows cut for an ECN-Echo
+_Atomic int nrwnddrop = 0;        // in-order packets dropped because the application buffer was full
+_Atomic int nprobe = 0;           // zero-window probes sent
+_Atomic int nwindowupdate = 0;    // ACKs sent only to announce that a zero window opened
+
+
+/* Name of an entity in the traces: A and B, or A0, B0, A1, ... with several
+   flows. Up to four names per thread can be in use at once. */
+char *entity_name(int AorB)
+{
+    static _Thread_local char names[4][16];
+    static _Thread_local int next = 0;
+    char *name = names[next++ % 4];
+
+    if (nflows == 1) {
+        snprintf(name, sizeof(names[0]), "%c", 'A' + (AorB & 1));
+    }
+    else {
+        snprintf(name, sizeof(names[0]), "%c%d", 'A' + (AorB & 1), AorB >> 1);
+    }
+    return name;
+}
+
+
+/* Sequence numbers live in [0, 2^seqnum_bits) and wrap around, so they are
+   compared with serial number arithmetic (RFC 1982) rather than with < and >.
+   seqnum_dist() is how far a lies ahead of b, for the sender where a is
+   never behind b. seqnum_diff() is the signed distance from b to a, which is
+   only meaningful while the two are less than half the sequence space apart. */
+unsigned seqnum_mask()
+{
+    return (1u << seqnum_bits) - 1;
+}
 
+int seqnum_add(int seqnum, int n)
+{
+    return (int) (((unsigned) seqnum + (unsigned) n) & seqnum_mask());
+}
 
-/* Performs simple checksum on a packet's sequence number,
-   acknowledgement number and payload */
-int checksum(int seqnum, int acknum, char payload[20])
+int seqnum_dist(int a, int b)
 {
-    int sum = 0;
+    return (int) (((unsigned) a - (unsigned) b) & seqnum_mask());
+}
 
-    sum += (seqnum + acknum);
+int seqnum_diff(int a, int b)
+{
+    unsigned d = ((unsigned) a - (unsigned) b) & seqnum_mask();
 
-    for (int i=0; i < 20; i++) {
-        sum += (int) payload[i];
+    if (d & (1u << (seqnum_bits - 1))) {
+        return (int) d - (int) (1u << seqnum_bits);
     }
+    return (int) d;
+}
 
-    return sum;
+/* NACKs carry the receiver's expected seqnum in acknum as a negative number.
+   Seqnum 0 is valid once the sequence space wraps, so offset by one. */
+int nack_encode(int seqnum)
+{
+    return -seqnum - 1;
 }
 
+int nack_decode(int acknum)
+{
+    return -acknum - 1;
+}
 
-// called from layer 5, passed the data to be sent to other side
-void A_output(struct msg message)
+// Packets of the window live in a power-of-two ring, so the slot is just the low bits of the seqnum.
+struct pkt *window_slot(struct sender *sender, int seqnum)
 {
+    return &sender->pkt_buffer[(unsigned) seqnum & sender->ring_mask];
+}
 
-    if ( A_sender.next_seqnum > A_sender.window_base_seqnum + WINDOW_SIZE) {
-        printf("\t\t A_OUTPUT Buffer full. Dropping message: %s\n", message.data);
-        return;
-    }
 
-    // Create a packet, with initial seq number, acknum, checksum and payload
-    struct pkt *pkt_ptr = &A_sender.pkt_buffer[A_sender.next_seqnum % WINDOW_SIZE];
+/******************** CONGESTION CONTROL ********************/
 
-    pkt_ptr->seqnum = A_sender.next_seqnum;
-    pkt_ptr->acknum = 0;
-    pkt_ptr->checksum = checksum(A_sender.next_seqnum, 0, message.data);
+#define  CC_INITIAL_SSTHRESH 65536.0
+#define  CC_MIN_SSTHRESH     2.0
+#define  RENO_BETA           0.5
+#define  CUBIC_BETA          0.7
+#define  CUBIC_C             0.4
+#define  CUBIC_TIME_UNIT     100.0      // emulator time units per CUBIC "second", about ten RTTs
 
-    memmove(pkt_ptr->payload, message.data, 20);
 
-    printf("\t\t--------------------\n");
-    printf("\t\tA_OUTPUT begin\n");
-    printf("\t\t--------------------\n");
-    printf("\t\tA_OUTPUT seq: %d, ack: %d, checksum: %d, payload: %s\n", pkt_ptr->seqnum, pkt_ptr->acknum, pkt_ptr->checksum, pkt_ptr->payload);
+// "none" keeps the window pinned at window_size, which is plain Go-Back-N.
+void none_init(struct cc_state *cc)
+{
+    cc->cwnd = window_size;
+    cc->ssthresh = window_size;
+}
 
-    // Send packet to B
-    tolayer3(0, *pkt_ptr);
+void none_on_event(struct cc_state *cc)
+{
+    (void) cc;
+}
 
-    // Start timer only when sending first packet of window.
-    if ( A_sender.window_base_seqnum == A_sender.next_seqnum) {
-        printf("\t\tA_OUTPUT starting timer.\n");
-        starttimer(0, 15.0);
-    }
+void none_on_ack(struct cc_state *cc, int acked)
+{
+    (void) cc;
+    (void) acked;
+}
 
-    printf("\t\tA_OUTPUT (A_sender.next_seqnum mod WINDOW_SIZE): %d\n", (A_sender.next_seqnum % WINDOW_SIZE));
-    printf("\t\tEND A_OUTPUT\n");
-    printf("\t\t--------------------\n");
+// Additive increase of one packet per window, multiplicative decrease on every loss. No slow start.
+void aimd_init(struct cc_state *cc)
+{
+    cc->cwnd = 1.0;
+    cc->ssthresh = 1.0;
+}
 
-    // Incrementseq number
-    A_sender.next_seqnum++;
+void aimd_on_ack(struct cc_state *cc, int acked)
+{
+    cc->cwnd += (double) acked / cc->cwnd;
 }
 
+void aimd_on_loss(struct cc_state *cc)
+{
+    cc->cwnd = cc->cwnd * RENO_BETA < 1.0 ? 1.0 : cc->cwnd * RENO_BETA;
+    cc->ssthresh = cc->cwnd;
+}
 
-// called from layer 3, when a packet arrives for layer 4
-void A_input(struct pkt packet)
+void reno_init(struct cc_state *cc)
 {
-    printf("\t\tA_INPUT seq: %d, ack: %d, checksum: %d, payload: %s\n", packet.seqnum, packet.acknum, packet.checksum, packet.payload);
+    cc->cwnd = 1.0;
+    cc->ssthresh = CC_INITIAL_SSTHRESH;
+}
 
-    // If packet is corrupt, ignore it.
-    int csum = checksum(packet.seqnum, packet.acknum, packet.payload);
-    if ( csum != packet.checksum ) {
-        printf("\t\tPacket arriving at A is CORRUPT! Packet checksum %d differs from %d\n", packet.checksum, csum);
+// Slow start below ssthresh, then one packet per window of ACKs.
+void reno_on_ack(struct cc_state *cc, int acked)
+{
+    if (cc->in_recovery) {
         return;
     }
 
-    // If we receive a NACK, do a fast retransmit.
-    if ( packet.acknum < 0 ) {
-        stoptimer(0);
+    while (acked > 0 && cc->cwnd < cc->ssthresh) {
+        cc->cwnd += 1.0;
+        acked--;
+    }
+    cc->cwnd += (double) acked / cc->cwnd;
+}
 
-        printf("\t\tA_input received NACK message. Retransmitting all packets from window_base_seqnum to next_seqnum. seq: %d, ack: %d, checksum: %d, payload: %s\n", packet.seqnum, packet.acknum, packet.checksum, packet.payload);
+void reno_on_loss(struct cc_state *cc)
+{
+    cc->ssthresh = cc->cwnd * RENO_BETA < CC_MIN_SSTHRESH ? CC_MIN_SSTHRESH : cc->cwnd * RENO_BETA;
+    cc->cwnd = cc->ssthresh;
+}
 
-        printf("\t\t------------------------------\n");
-        printf("\t\tNACK loop: Resending packets in buffer\n");
-        printf("\t\t------------------------------\n");
-        printf("\t\tA_INPUT A_sender.window_base_seqnum: %d\n", A_sender.window_base_seqnum);
-        printf("\t\tA_INPUT A_sender.next_seqnum: %d\n", A_sender.next_seqnum);
-        for (int i = A_sender.window_base_seqnum; i < A_sender.next_seqnum; i++) {
-            int j = i % WINDOW_SIZE;
-            printf("\t\tA_INPUT seq: %d, ack: %d, checksum: %d, payload: %s\n", A_sender.pkt_buffer[j].seqnum, A_sender.pkt_buffer[j].acknum, A_sender.pkt_buffer[j].checksum, A_sender.pkt_buffer[j].payload);
-            tolayer3(0, A_sender.pkt_buffer[j]);
-        }
-        printf("\t\tEND OF NACK LOOP\n");
-        printf("\t\t------------------------------\n");
+void reno_on_timeout(struct cc_state *cc)
+{
+    cc->ssthresh = cc->cwnd * RENO_BETA < CC_MIN_SSTHRESH ? CC_MIN_SSTHRESH : cc->cwnd * RENO_BETA;
+    cc->cwnd = 1.0;
+}
 
-        starttimer(0, 15.0);
+/* CUBIC (RFC 8312): after a loss the window follows W(t) = C(t - K)^3 + W_max,
+   flat around the window where the last loss happened, and never grows slower
+   than the Reno-friendly estimate w_est. */
+void cubic_init(struct cc_state *cc)
+{
+    reno_init(cc);
+    cc->w_max = 0.0;
+    cc->epoch_start = -1.0;
+}
 
+void cubic_on_ack(struct cc_state *cc, int acked)
+{
+    if (cc->in_recovery) {
         return;
     }
 
-    // Deal with ACK by stopping timer
-    if ( packet.acknum > 0 ) {
-        printf("\t\tA_input received ACK message. Stopping timer. seq: %d, ack: %d, checksum: %d, payload: %s\n", packet.seqnum, packet.acknum, packet.checksum, packet.payload);
-
-        if ( packet.acknum >= A_sender.window_base_seqnum ) {
-            printf("\t\tA_INPUT incrementing A_sender.window_base.seqnum to %d\n", packet.acknum);
-
-            // Increment window_base_seqnum
-            A_sender.window_base_seqnum = packet.acknum;
-        }
+    if (cc->cwnd < cc->ssthresh) {
+        reno_on_ack(cc, acked);
+        return;
+    }
 
-        // If base sequence number has caught up to next sequence number, stop timer.
-        if ( A_sender.window_base_seqnum == A_sender.next_seqnum ) {
-            stoptimer(0);
-            return;
+    if (cc->epoch_start < 0) {
+        cc->epoch_start = simtime();
+        cc->k = cc->cwnd < cc->w_max ? cbrt((cc->w_max - cc->cwnd) / CUBIC_C) : 0.0;
+        if (cc->cwnd > cc->w_max) {
+            cc->w_max = cc->cwnd;
         }
-
-        // If base sequence number is not equal to next sequence number, restart the timer.
-        stoptimer(0);
-        starttimer(0, 15.0);
-        return;
+        cc->w_est = cc->cwnd;
     }
-}
 
+    double t = (simtime() - cc->epoch_start) / CUBIC_TIME_UNIT;
+    double target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->w_max;
 
-// called when A's timer goes off
-void A_timerinterrupt()
-{
-    printf("\t\t------------------------------\n");
-    printf("\t\tInterrupt loop\n");
-    printf("\t\t------------------------------\n");
+    cc->w_est += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) * acked / cc->cwnd;
 
-    for (int i = A_sender.window_base_seqnum; i < A_sender.next_seqnum; i++) {
-        int j = i % WINDOW_SIZE;
-        struct pkt *packet = &A_sender.pkt_buffer[j];
-        printf("\t\tA_timerinterrupt  Sending packet: seq: %d, ack: %d, checksum: %d, payload: %s\n", packet->seqnum, packet->acknum, packet->checksum, packet->payload);
-        tolayer3(0, *packet);
+    if (target > cc->cwnd) {
+        cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+    }
+    else {
+        cc->cwnd += 0.01 * acked / cc->cwnd;
     }
-    printf("\t\tEND OF INTERRUPT LOOP\n");
-    printf("\t\t------------------------------\n");
 
-    starttimer(0, 15.0);
+    if (cc->w_est > cc->cwnd) {
+        cc->cwnd = cc->w_est;
+    }
 }
 
+void cubic_on_loss(struct cc_state *cc)
+{
+    cc->w_max = cc->cwnd;
+    cc->cwnd = cc->cwnd * CUBIC_BETA < CC_MIN_SSTHRESH ? CC_MIN_SSTHRESH : cc->cwnd * CUBIC_BETA;
+    cc->ssthresh = cc->cwnd;
+    cc->epoch_start = -1.0;
+}
 
-/* the following routine will be called once (only) before any other
-   entity A routines are called. You can use it to do any initialization */
-void A_init()
+void cubic_on_timeout(struct cc_state *cc)
 {
-    A_sender.next_seqnum = 1;
-    A_sender.window_base_seqnum = 1;
+    cubic_on_loss(cc);
+    cc->cwnd = 1.0;
 }
 
-/* Note that with simplex transfer from a-to-B, there is no B_output() */
-/* need be completed only for extra credit */
-void B_output(struct msg message)  {
-    printf("\t\tB_output. message: %s", message.data);
+struct cc_algorithm cc_algorithms[] = {
+    { "none",    none_init,  none_on_ack,  none_on_event, none_on_event,   1 },
+    { "aimd",    aimd_init,  aimd_on_ack,  aimd_on_loss,  aimd_on_loss,    1 },
+    { "reno",    reno_init,  reno_on_ack,  reno_on_loss,  reno_on_timeout, 1 },
+    { "newreno", reno_init,  reno_on_ack,  reno_on_loss,  reno_on_timeout, 0 },
+    { "cubic",   cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_timeout, 0 },
+};
 
+struct cc_algorithm *cc_lookup(char *name)
+{
+    for (size_t i = 0; i < sizeof(cc_algorithms) / sizeof(cc_algorithms[0]); i++) {
+        if (strcmp(cc_algorithms[i].name, name) == 0) {
+            return &cc_algorithms[i];
+        }
+    }
+    return NULL;
 }
 
-
-// called from layer 3, when a packet arrives for layer 4 at B
-void B_input(struct pkt packet)
+// Appends "time flow cwnd ssthresh" to the cwnd time series, where flow is the sending entity: 2i for A of flow i, 2i + 1 for B.
+void cc_log(int flow, struct cc_state *cc)
 {
-    printf("\t\tB_INPUT seq: %d, ack: %d, checksum: %d, payload: %s\n", packet.seqnum, packet.acknum, packet.checksum, packet.payload);
+    if (cwnd_file != NULL) {
+        trace_fprintf(cwnd_file, "%f %d %f %f\n", simtime(), flow, cc->cwnd, cc->ssthresh);
+    }
+}
 
-    int csum = checksum(packet.seqnum, packet.acknum, packet.payload);
+// The usable window is the smaller of the congestion window and the configured window.
+int send_window(struct sender *sender)
+{
+    int cwnd = (int) sender->cc.cwnd;
 
-    // Send NACK for corrupted packet
-    if ( (csum != packet.checksum) || (packet.seqnum > B_receiver.expected_seqnum) ) {
-        if (csum != packet.checksum) {
-            printf("\t\tB_INPUT Packet is CORRUPT! Packet checksum %d differs from %d\n", packet.checksum, csum);
-        } else {
-            printf("\t\tB_INPUT Packet sequence number %d is not the expected %d\n", packet.seqnum, B_receiver.expected_seqnum);
-        }
+    if (cwnd < 1) {
+        cwnd = 1;
+    }
+    return cwnd < window_size ? cwnd : window_size;
+}
 
-        struct pkt B_out;
-        char payload[20] = {'0'};
+// Messages that fit in one packet.
+int msgs_per_pkt()
+{
+    return max_payload / MSG_SIZE;
+}
 
-        B_out.seqnum = 0;
-        B_out.acknum = -(B_receiver.expected_seqnum);
-        B_out.checksum = checksum(0, -(B_receiver.expected_seqnum), payload);
-        strncpy(B_out.payload, payload, 20);
+/* Payload bytes of a full packet. Msgs are never split across packets, a
+   byte stream is cut into segments of max_payload bytes, the MSS. */
+int segment_size()
+{
+    return stream_bytes > 0 ? max_payload : msgs_per_pkt() * MSG_SIZE;
+}
 
-        printf("\t\tB_INPUT sending NACK. seq: %d, ack: %d, checksum: %d, payload: %s\n", B_out.seqnum, B_out.acknum, B_out.checksum, B_out.payload);
+// The receiver's advertised window in packets; it takes only whole packets.
+int rwnd_packets(struct sender *sender)
+{
+    return sender->peer_rwnd / msgs_per_pkt();
+}
 
-        tolayer3(1, B_out);
+// Bytes of a packet's payload worth printing in the trace.
+int print_length(struct pkt *packet)
+{
+    return packet->length < MSG_SIZE ? packet->length : MSG_SIZE;
+}
 
-        return;
+/* Packets per time unit the sender may put on the wire, 0 if it is not
+   paced. Paced from the RTT, a window is spread over a bit less than one
+   smoothed RTT; until the first sample comes back the retransmission
+   timeout stands in for it. */
+float pacing_rate(struct sender *sender)
+{
+    if (pace_rate > 0) {
+        return pace_rate;
     }
+    if (pace_rtt) {
+        return PACING_GAIN * send_window(sender) / (sender->srtt > 0 ? sender->srtt : rtx_timeout);
+    }
+    return 0.0;
+}
 
-    struct pkt B_out;
-    char payload[20] = {'0'};
-
-    B_out.seqnum = 0;
-    B_out.acknum = B_receiver.expected_seqnum;
-    B_out.checksum = checksum(0, B_receiver.expected_seqnum, payload);
-    strncpy(B_out.payload, payload, 20);
-
-    printf("\t\tB_INPUT sending ACK. seq: %d, ack: %d, checksum: %d, payload: %s\n", B_out.seqnum, B_out.acknum, B_out.checksum, B_out.payload);
 
-    tolayer3(1, B_out);
+/******************** CHECKSUMS ********************/
 
-    // Packet contains new data
-    if ( packet.seqnum == B_receiver.expected_seqnum ) {
-        printf("\t\tB_INPUT received new data packet. seq: %d, ack: %d, checksum: %d, payload: %s\n", packet.seqnum, packet.acknum, packet.checksum, packet.payload);
+/* A checksum goes over the used part of the payload first, which the sender
+   does while it copies the payload into the packet, and then over the
+   header fields, which are only final when the packet goes out. sum() and
+   sum_copy() continue from the value passed in, starting from 0; finish()
+   turns the result into what the packet carries. */
+struct checksum_algorithm {
+    char *name;
+    unsigned (*sum)(const void *data, int len, unsigned sum);
+    unsigned (*sum_copy)(void *dst, const void *src, int len, unsigned sum);
+    unsigned (*finish)(unsigned sum);
+};
 
-        tolayer5(packet.payload);
+/* The original checksum, a plain sum of the bytes. It misses reordered
+   bytes and many multi-bit errors. */
+unsigned byte_sum(const void *data, int len, unsigned sum)
+{
+    const char *p = data;
 
-        B_receiver.expected_seqnum++;
+    for (int i = 0; i < len; i++) {
+        sum += (unsigned) (int) p[i];
     }
+    return sum;
 }
 
+unsigned byte_sum_copy(void *dst, const void *src, int len, unsigned sum)
+{
+    memmove(dst, src, len);
+    return byte_sum(dst, len, sum);
+}
 
-// called when B's timer goes off
-void B_timerinterrupt()
+unsigned as_is(unsigned sum)
 {
+    return sum;
 }
 
+// The Internet checksum carries the complement of the one's complement sum.
+unsigned inet_finish(unsigned sum)
+{
+    return ~sum & 0xffff;
+}
 
-/* the following routine will be called once (only) before any other
-   entity B routines are called. You can use it to do any initialization */
-void B_init()
+unsigned crc32c_sum(const void *data, int len, unsigned sum)
 {
-    B_receiver.expected_seqnum = 1;
+    return crc32c(sum, data, len);
 }
 
+unsigned crc32c_sum_copy(void *dst, const void *src, int len, unsigned sum)
+{
+    return crc32c_copy(sum, dst, src, len);
+}
 
-/*****************************************************************
-***************** NETWORK EMULATION CODE STARTS BELOW ***********
-The code below emulates the layer 3 and below network environment:
-  - emulates the transmission and delivery (possibly with bit-level corruption
-    and packet loss) of packets across the layer 3/4 interface
-  - handles the starting/stopping of a timer, and generates timer
-    interrupts (resulting in calling students timer handler).
-  - generates message to be sent (passed from later 5 to 4)
+struct checksum_algorithm checksum_algorithms[] = {
+    { "sum",    byte_sum,   byte_sum_copy,   as_is },
+    { "inet",   inet_sum,   inet_sum_copy,   inet_finish },
+    { "crc32c", crc32c_sum, crc32c_sum_copy, as_is },
+};
 
-THERE IS NOT REASON THAT ANY STUDENT SHOULD HAVE TO READ OR UNDERSTAND
-THE CODE BELOW.  YOU SHOULD NOT TOUCH, OR REFERENCE (in your code) ANY
-OF THE DATA STRUCTURES BELOW.  If you're interested in how I designed
-the emulator, you're welcome to look at the code - but again, you should have
-to, and you definitely should not have to modify
-******************************************************************/
+struct checksum_algorithm *checksum_algo;
 
+struct checksum_algorithm *checksum_lookup(char *name)
+{
+    for (size_t i = 0; i < sizeof(checksum_algorithms) / sizeof(checksum_algorithms[0]); i++) {
+        if (strcmp(checksum_algorithms[i].name, name) == 0) {
+            return &checksum_algorithms[i];
+        }
+    }
+    return NULL;
+}
 
-struct event *evlist = NULL;  // the event list
+// Finishes the checksum of a packet whose payload sums to payload_sum.
+int packet_checksum(struct pkt *packet, unsigned payload_sum)
+{
+    int header[] = { packet->seqnum, packet->acknum, packet->fec, packet->rwnd, packet->length, packet->fec_length };
 
+    return (int) checksum_algo->finish(checksum_algo->sum(header, sizeof(header), payload_sum));
+}
 
-// possible events
-#define  TIMER_INTERRUPT     0
-#define  FROM_LAYER5         1
-#define  FROM_LAYER3         2
-#define  OFF                 0
-#define  ON                  1
-#define  A                   0
-#define  B                   1
+// Checksum of a packet's header fields and the used part of its payload
+int checksum(struct pkt *packet)
+{
+    int length = packet->length < 0 ? 0 : packet->length < MAX_PAYLOAD ? packet->length : MAX_PAYLOAD;
 
+    return packet_checksum(packet, checksum_algo->sum(packet->payload, length, 0));
+}
 
-int     TRACE       = 3;         // debugging level
-int     nsim        = 0;         // number of messages from 5 to 4 so far
-int     nsimmax     = 50;        // number of msgs to generate, then stop
-float   lossprob    = 0.2;       // probability that a packet is dropped
-float   corruptprob = 0.1;       // probability that one bit is packet is flipped
-float   lambda      = 25.00;     // arrival rate of messages from layer 5
-float   time;                    // event time
-int     ntolayer3;               // number sent into layer 3
-int     nlost;                   // number lost in media
-int     ncorrupt;                // number corrupted by media
 
+// Packets kept by the receiver share one power-of-two ring, like the sender's window.
+struct pkt *receive_slot(struct receiver *receiver, int seqnum, int state)
+{
+    unsigned slot = (unsigned) seqnum & receiver->ring_mask;
+
+    if ( receiver->rcv_state[slot] == state && receiver->rcv_buffer[slot].seqnum == seqnum ) {
+        return &receiver->rcv_buffer[slot];
+    }
+    return NULL;
+}
 
-int main()
+// Whether the application buffer has room for nmsgs more messages.
+int app_room(struct receiver *receiver, int nmsgs)
 {
-    struct event *eventptr;
-    struct msg  msg2give;
-    struct pkt  pkt2give;
+    return app_rate <= 0 || receiver->app_count + nmsgs <= app_buffer_size;
+}
 
-    int i,j;
-    int terminate = 0;
+/* Free room in the application buffer, which the ACKs advertise. Without an
+   application consumption rate layer 5 takes everything at once, so the
+   receiver never limits the sender. Once the window closed it stays closed
+   until half the buffer is free, so the sender is not invited to send one
+   packet per message the application takes (silly window avoidance). */
+int receive_window(struct receiver *receiver)
+{
+    int room = app_buffer_size - receiver->app_count;
 
-    init();
-    A_init();
-    B_init();
+    if (app_rate <= 0) {
+        return window_size * msgs_per_pkt();
+    }
+    if (receiver->zero_window && room < (app_buffer_size + 1) / 2) {
+        return 0;
+    }
+    return room;
+}
 
-    while (1) {
-        // get next event to simulate
-        eventptr = evlist;
+/* Keeps a packet in the receive ring, sharing its payload. FEC codes whole
+   max_payload sized payloads; the sender zeroed the unused part. */
+void store_packet(struct receiver *receiver, struct pkt *packet, int state)
+{
+    unsigned slot = (unsigned) packet->seqnum & receiver->ring_mask;
 
-        // all done with simulation
-        if ( nsim == ( nsimmax )) {
-            printf("\n-----------------------------------------------------------\n\n");
-            terminate = 1;
-            break;
-        }
+    pkt_hold(&receiver->rcv_buffer[slot], packet);
+    receiver->rcv_state[slot] = state;
+}
 
-        if (eventptr==NULL) {
-            printf("Event pointer is null.\n");
-            terminate = 1;
-            break;
-        }
+// Appends len bytes to the sender's byte ring; the caller made sure they fit.
+void send_buffer_put(struct sender *sender, char *data, int len)
+{
+    int tail = (sender->send_head + sender->send_count) % sender->send_buffer_size;
+    int first = len < sender->send_buffer_size - tail ? len : sender->send_buffer_size - tail;
 
-        // remove this event from event list
-        evlist = evlist->next;
+    memcpy(sender->send_buffer + tail, data, first);
+    memcpy(sender->send_buffer, data + first, len - first);
+    sender->send_count += len;
+}
 
-        if (evlist!=NULL) {
-           evlist->prev=NULL;
-        }
+/* Takes the oldest len bytes out of the sender's byte ring and returns their
+   checksum sum, taken on the way. Where the ring wraps the bytes are summed
+   after the copy, since the Internet checksum cannot go on after an odd
+   length. */
+unsigned send_buffer_get(struct sender *sender, char *data, int len)
+{
+    int first = len < sender->send_buffer_size - sender->send_head ? len : sender->send_buffer_size - sender->send_head;
+    unsigned sum;
 
-        if (TRACE>=2) {
-           printf("\nEVENT time: %f,",eventptr->evtime);
-           printf("  type: %d",eventptr->evtype);
-            if (eventptr->evtype==0) {
-                printf(", timerinterrupt\n");
-            }
-            else if (eventptr->evtype==1) {
-                printf(", fromlayer5\n");
-            }
-            else {
-                printf(", fromlayer3 ");
-                printf(" entity: %d\n",eventptr->eventity);
-            }
-        }
+    if ( first == len ) {
+        sum = checksum_algo->sum_copy(data, sender->send_buffer + sender->send_head, len, 0);
+    }
+    else {
+        memcpy(data, sender->send_buffer + sender->send_head, first);
+        memcpy(data + first, sender->send_buffer, len - first);
+        sum = checksum_algo->sum(data, len, 0);
+    }
+    sender->send_head = (sender->send_head + len) % sender->send_buffer_size;
+    sender->send_count -= len;
 
-        // update time to next event time
-        time = eventptr->evtime;
+    return sum;
+}
 
-        if (eventptr->evtype == FROM_LAYER5 ) {
+// Out-of-order packets are kept when the sender will not resend them anyway.
+int keep_out_of_order()
+{
+    return dupack_threshold > 0 || fec_k > 0;
+}
 
-            // set up future arrival
-            generate_next_arrival();
 
-            // fill in msg to give with string of same letter
-            j = nsim % 26;
+void entity_starttimer(int AorB)
+{
+    struct sender *sender = &entities[AorB].sender;
 
-            for (i=0; i<20; i++) {
-                msg2give.data[i] = 97 + j;
-            }
+    if (!sender->timer_running) {
+        starttimer(AorB, rtx_timeout);
+        sender->timer_running = 1;
+    }
+}
 
-            if (TRACE>2) {
-                printf("\tMAINLOOP: data given to student: ");
-                for (i=0; i<20; i++) {
-                    printf("%c", msg2give.data[i]);
-                }
-               printf("\n");
-            }
+void entity_stoptimer(int AorB)
+{
+    struct sender *sender = &entities[AorB].sender;
 
-            nsim++;
-            if (eventptr->eventity == A) {
-                A_output(msg2give);
-            }
-            else {
-                B_output(msg2give);
-            }
-        }
-        else if (eventptr->evtype ==  FROM_LAYER3) {
-            pkt2give.seqnum = eventptr->pktptr->seqnum;
-            pkt2give.acknum = eventptr->pktptr->acknum;
-            pkt2give.checksum = eventptr->pktptr->checksum;
+    if (sender->timer_running) {
+        stoptimer(AorB);
+        sender->timer_running = 0;
+    }
+}
 
-            for (i=0; i<20; i++) {
-                pkt2give.payload[i] = eventptr->pktptr->payload[i];
-            }
 
-            if (eventptr->eventity ==A) {  // deliver packet by calling
-                A_input(pkt2give);         // appropriate entity
-            }
-            else {
-                B_input(pkt2give);
-                free(eventptr->pktptr);    // free the memory for packet
-            }
-        }
-        else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-            if (eventptr->eventity == A) {
-                A_timerinterrupt();
-            }
-            else {
-                B_timerinterrupt();
+/* Stamps the ACK (or NACK) we owe the other side onto an outgoing packet and
+   sends it. Every packet carries one, so an ACK owed when data goes out rides
+   along for free. payload_sum is the checksum sum over its payload. */
+void send_packet(int AorB, struct pkt *packet, unsigned payload_sum)
+{
+    struct receiver *receiver = &entities[AorB].receiver;
+
+    packet->acknum = receiver->nack_pending ? nack_encode(receiver->expected_seqnum) : receiver->expected_seqnum;
+    packet->rwnd = receive_window(receiver);
+    packet->checksum = packet_checksum(packet, payload_sum);
+    receiver->zero_window = packet->rwnd == 0;
+
+    packet->ecn = 0;
+    if (ecn) {
+        struct sender *sender = &entities[AorB].sender;
+
+        if (packet->seqnum != NO_DATA) {
+            packet->ecn |= ECN_ECT;
+            if (sender->cwr_pending) {
+                packet->ecn |= ECN_CWR;
+                sender->cwr_pending = 0;
             }
         }
-        else {
-            printf("INTERNAL PANIC: unknown event type \n");
+        if (receiver->ece) {
+            packet->ecn |= ECN_ECE;
         }
+    }
 
-        free(eventptr);
-    }  // End of while loop
-
-    if (terminate == 1) {
-        printf("Simulator terminated at time %f after sending %d msgs from layer5.\n\n", time, nsim);
+    if (receiver->nack_pending) {
+        nnack++;
+    }
+    if (packet->seqnum == NO_DATA) {
+        npureack++;
+    }
+    else if (receiver->ack_pending) {
+        npiggyback++;
+    }
+    receiver->ack_pending = 0;
+    receiver->nack_pending = 0;
+    receiver->ack_now = 0;
+    receiver->unacked = 0;
+
+    if (receiver->ack_timer_running) {
+        stop_timer(AorB, ACK_TIMER);
+        receiver->ack_timer_running = 0;
     }
 
-    exit(0);
+    tolayer3(AorB, packet);
 }
 
+// Sends a packet that only carries the ACK or NACK we owe.
+void send_ack(int AorB)
+{
+    struct pkt ack;
 
-// initialize the simulator
-void init() {
-    int i;
+    ack.seqnum = NO_DATA;
+    ack.fec = 0;
+    ack.length = 0;
+    ack.fec_length = 0;
+    ack.payload = no_payload;
+    ack.buf = NULL;
+
+    // Without a payload every checksum sum is still at its start, 0.
+    send_packet(AorB, &ack, 0);
+
+    trace_printf("\t\t%s_INPUT sending %s. seq: %d, ack: %d, checksum: %d\n", entity_name(AorB), ack.acknum < 0 ? "NACK" : "ACK", ack.seqnum, ack.acknum, ack.checksum);
+}
+
+
+/* Sends the fec_m parity packets of the block that just filled up. Its data
+   packets are all still in the window ring, since fec_k <= window_size.
+   Payloads are coded zero-padded to max_payload, and their lengths are
+   coded alongside as two bytes each, so rebuilt packets get theirs back. */
+void entity_send_parity(int AorB)
+{
+    struct sender *sender = &entities[AorB].sender;
+    unsigned char *data[FEC_MAX_K], *parity[FEC_MAX_M];
+    unsigned char data_length[FEC_MAX_K][2], parity_length[FEC_MAX_M][2];
+    unsigned char *data_len[FEC_MAX_K], *parity_len[FEC_MAX_M];
+    struct pkt parity_pkt[FEC_MAX_M];
+
+    for (int i = 0; i < fec_k; i++) {
+        struct pkt *p = window_slot(sender, seqnum_add(sender->fec_start, i));
+
+        data[i] = (unsigned char *) p->payload;
+        data_length[i][0] = p->length & 0xff;
+        data_length[i][1] = p->length >> 8;
+        data_len[i] = data_length[i];
+    }
+    for (int j = 0; j < fec_m; j++) {
+        parity_pkt[j].buf = NULL;
+        pkt_alloc_payload(&parity_pkt[j], AorB >> 1);
+        parity[j] = (unsigned char *) parity_pkt[j].payload;
+        parity_len[j] = parity_length[j];
+    }
+
+    fec_encode(fec_k, fec_m, data, parity, max_payload);
+    fec_encode(fec_k, fec_m, data_len, parity_len, 2);
+
+    for (int j = 0; j < fec_m; j++) {
+        parity_pkt[j].seqnum = sender->fec_start;
+        parity_pkt[j].fec = j + 1;
+        parity_pkt[j].length = max_payload;
+        parity_pkt[j].fec_length = parity_length[j][0] | parity_length[j][1] << 8;
+        send_packet(AorB, &parity_pkt[j], checksum_algo->sum(parity_pkt[j].payload, max_payload, 0));
+        nparity++;
+
+        trace_printf("\t\t%s_SEND parity %d of block %d, checksum: %d\n", entity_name(AorB), j, parity_pkt[j].seqnum, parity_pkt[j].checksum);
+        pkt_release(&parity_pkt[j]);
+    }
+}
+
+
+/* Puts packets on the wire while the window allows: first packets that have
+   to be sent again after going back to the window base, then new packets
+   made from the bytes waiting in send_buffer. */
+void entity_send_window(int AorB)
+{
+    struct sender *sender = &entities[AorB].sender;
+    int window = send_window(sender);
+
+    // The receiver's advertised window caps the congestion window, a probe goes one packet past it.
+    if ( rwnd_packets(sender) < window ) {
+        window = rwnd_packets(sender);
+    }
+    if ( sender->probe ) {
+        window = seqnum_dist(sender->send_seqnum, sender->window_base_seqnum) + 1;
+    }
+
+    while ( seqnum_dist(sender->send_seqnum, sender->window_base_seqnum) < window ) {
+        struct pkt *pkt_ptr = window_slot(sender, sender->send_seqnum);
+        unsigned slot = (unsigned) sender->send_seqnum & sender->ring_mask;
+        float rate = pacing_rate(sender);
+
+        int new_data = sender->send_seqnum == sender->next_seqnum;
+
+        if ( new_data && sender->send_count == 0 ) {
+            break;
+        }
+
+        /* Nagle: while earlier packets are unacknowledged, messages wait up to
+           coalesce_delay for enough others to fill a packet. */
+        if ( new_data && sender->send_count < segment_size() && coalesce_delay > 0 && !sender->flush && !sender->probe
+                && sender->window_base_seqnum != sender->next_seqnum ) {
+            if ( !sender->coalesce_timer_running ) {
+                start_timer(AorB, COALESCE_TIMER, coalesce_delay);
+                sender->coalesce_timer_running = 1;
+            }
+            break;
+        }
+
+        // The pacer spaces packets 1/rate apart, PACE_TIMER lets the next one out.
+        if ( rate > 0 && simtime() < sender->next_send_at ) {
+            if ( !sender->pace_timer_running ) {
+                start_timer(AorB, PACE_TIMER, sender->next_send_at - simtime());
+                sender->pace_timer_running = 1;
+            }
+            break;
+        }
+
+        if ( !new_data ) {
+            nretransmit++;
+        }
+        else {
+            /* Create a packet with the next seq number and as many bytes as fit, the ACK is added when it is sent.
+               The packet that had the slot before may still be on the wire, so it gets a buffer of its own. */
+            pkt_alloc_payload(pkt_ptr, AorB >> 1);
+            pkt_ptr->seqnum = sender->next_seqnum;
+            pkt_ptr->fec = 0;
+            pkt_ptr->fec_length = 0;
+            pkt_ptr->length = sender->send_count < segment_size() ? sender->send_count : segment_size();
+
+            sender->payload_sum[slot] = send_buffer_get(sender, pkt_ptr->payload, pkt_ptr->length);
+            memset(pkt_ptr->payload + pkt_ptr->length, 0, max_payload - pkt_ptr->length);
+
+            // Nothing is left waiting to be coalesced.
+            if ( sender->send_count == 0 && sender->coalesce_timer_running ) {
+                stop_timer(AorB, COALESCE_TIMER);
+                sender->coalesce_timer_running = 0;
+            }
+
+            // Increment seq number, wrapping inside the sequence space
+            sender->next_seqnum = seqnum_add(sender->next_seqnum, 1);
+        }
+
+        // Send packet to the other side. Only packets sent once give RTT samples (Karn).
+        send_packet(AorB, pkt_ptr, sender->payload_sum[slot]);
+        sender->sent_at[slot] = new_data ? simtime() : -1;
+
+        if ( rate > 0 ) {
+            sender->next_send_at = (sender->next_send_at > simtime() ? sender->next_send_at : simtime()) + 1 / rate;
+        }
+
+        trace_printf("\t\t%s_SEND seq: %d, ack: %d, checksum: %d, length: %d, payload: %.*s, ring slot: %u, window: %d\n", entity_name(AorB), pkt_ptr->seqnum, pkt_ptr->acknum, pkt_ptr->checksum, pkt_ptr->length, print_length(pkt_ptr), pkt_ptr->payload, (unsigned) sender->send_seqnum & sender->ring_mask, window);
+
+        // Every fec_k new packets, protect them with fec_m parity packets.
+        if ( fec_k > 0 && new_data ) {
+            if ( sender->fec_count == 0 ) {
+                sender->fec_start = sender->send_seqnum;
+            }
+            if ( ++sender->fec_count == fec_k ) {
+                entity_send_parity(AorB);
+                sender->fec_count = 0;
+            }
+        }
+
+        sender->send_seqnum = seqnum_add(sender->send_seqnum, 1);
+
+        if ( sender->probe ) {
+            trace_printf("\t\t%s_SEND zero-window probe seq: %d\n", entity_name(AorB), pkt_ptr->seqnum);
+            sender->probe = 0;
+            nprobe++;
+        }
+
+        // The timer runs whenever there are unacknowledged packets.
+        entity_starttimer(AorB);
+    }
+
+    /* A zero window with nothing on the wire: nothing would ever tell us it
+       opened if the window update got lost, so probe from time to time. */
+    int waiting = sender->send_seqnum != sender->next_seqnum || sender->send_count > 0;
+
+    if ( rwnd_packets(sender) == 0 && waiting && !sender->timer_running && !sender->persist_timer_running ) {
+        start_timer(AorB, PERSIST_TIMER, rtx_timeout * sender->persist_backoff);
+        sender->persist_timer_running = 1;
+    }
+}
+
+
+// passed the data from layer 5 to be sent to the other side
+void entity_output(int AorB, struct msg message)
+{
+    struct sender *sender = &entities[AorB].sender;
+
+    trace_printf("\t\t--------------------\n");
+    trace_printf("\t\t%s_OUTPUT begin\n", entity_name(AorB));
+    trace_printf("\t\t--------------------\n");
+
+    if ( sender->send_buffer_size - sender->send_count < MSG_SIZE ) {
+        trace_printf("\t\t %s_OUTPUT Buffer full. Dropping message: %.20s\n", entity_name(AorB), message.data);
+        msg_refused(AorB >> 1);
+        return;
+    }
+
+    send_buffer_put(sender, message.data, MSG_SIZE);
+
+    entity_send_window(AorB);
+
+    trace_printf("\t\tEND %s_OUTPUT\n", entity_name(AorB));
+    trace_printf("\t\t--------------------\n");
+}
+
+/* The byte-stream API: takes as much of data as the send buffer has room
+   for, like a non-blocking write(), and returns how many bytes that was.
+   The stream is cut into packets without regard to the calls' boundaries. */
+int entity_send(int AorB, char *data, int len)
+{
+    struct sender *sender = &entities[AorB].sender;
+    int room = sender->send_buffer_size - sender->send_count;
+    int n = len < room ? len : room;
+
+    if ( n == 0 ) {
+        return 0;
+    }
+
+    send_buffer_put(sender, data, n);
+    entity_send_window(AorB);
+
+    return n;
+}
+
+
+// Sends the packet at seqnum once more, on its own.
+void entity_retransmit(int AorB, int seqnum)
+{
+    struct sender *sender = &entities[AorB].sender;
+    struct pkt *pkt_ptr = window_slot(sender, seqnum);
+
+    send_packet(AorB, pkt_ptr, sender->payload_sum[(unsigned) seqnum & sender->ring_mask]);
+    sender->sent_at[(unsigned) seqnum & sender->ring_mask] = -1;
+    nretransmit++;
+
+    trace_printf("\t\t%s_RETRANSMIT seq: %d, ack: %d, checksum: %d, length: %d, payload: %.*s\n", entity_name(AorB), pkt_ptr->seqnum, pkt_ptr->acknum, pkt_ptr->checksum, pkt_ptr->length, print_length(pkt_ptr), pkt_ptr->payload);
+
+    entity_stoptimer(AorB);
+    entity_starttimer(AorB);
+}
+
+
+/* Deals with the ACK or NACK carried by an incoming packet. acknum is the
+   next seqnum the other side expects, so everything before it has been
+   delivered and leaves the window. A NACK additionally says that the packet
+   at acknum was lost or corrupted.
+
+   With fast retransmit (dupack_threshold > 0) a NACK is just a duplicate ACK,
+   like a pure ACK that does not move the window. After dupack_threshold of
+   them only the missing packet is sent again, further duplicates are ignored
+   until the loss is recovered, and an ACK that covers only part of the
+   window sent before the loss retransmits the next missing packet. Without
+   it, every NACK goes back to the window base and resends the window. */
+void entity_ack(int AorB, struct pkt *packet)
+{
+    struct sender *sender = &entities[AorB].sender;
+    int nack = packet->acknum < 0;
+    int acknum = nack ? nack_decode(packet->acknum) : packet->acknum;
+    int acked = seqnum_dist(acknum, sender->window_base_seqnum);
+    int in_flight = seqnum_dist(sender->next_seqnum, sender->window_base_seqnum);
+
+    if ( acked > in_flight ) {
+        trace_printf("\t\t%s_INPUT ignoring ACK %d outside of window [%d, %d)\n", entity_name(AorB), acknum, sender->window_base_seqnum, sender->next_seqnum);
+        return;
+    }
+
+    /* The advertised window counts from acknum, which becomes the window
+       base. An ACK that only changes it is a window update, not a duplicate. */
+    int window_update = acked == 0 && packet->rwnd != sender->peer_rwnd;
+    int was_open = rwnd_packets(sender) > 0;
+    int now_open = packet->rwnd / msgs_per_pkt() > 0;
+
+    if ( !now_open && was_open ) {
+        sender->zero_window_since = simtime();
+    }
+    else if ( now_open && !was_open ) {
+        sender->zero_window_time += simtime() - sender->zero_window_since;
+        sender->persist_backoff = 1;
+        if ( sender->persist_timer_running ) {
+            stop_timer(AorB, PERSIST_TIMER);
+            sender->persist_timer_running = 0;
+        }
+    }
+    sender->peer_rwnd = packet->rwnd;
+
+    /* An ECN-Echo is congestion without a loss: the window is cut as for
+       one, once per window of data, and nothing is sent again. */
+    if ( (packet->ecn & ECN_ECE) && (!sender->ecn_reacted || seqnum_diff(acknum, sender->ecn_recover) > 0) ) {
+        trace_printf("\t\t%s_INPUT ECN-Echo, cutting the window\n", entity_name(AorB));
+
+        sender->ecn_reacted = 1;
+        sender->ecn_recover = sender->next_seqnum;
+        if ( !sender->cc.in_recovery ) {
+            sender->cc_algo->on_loss(&sender->cc);
+            cc_log(AorB, &sender->cc);
+        }
+        sender->cwr_pending = 1;
+        necnreduce++;
+    }
+
+    if ( acked > 0 ) {
+        trace_printf("\t\t%s_INPUT incrementing window_base_seqnum to %d\n", entity_name(AorB), acknum);
+
+        sender->dupacks = 0;
+
+        // The newest packet ACKed gives an RTT sample, unless it was sent more than once.
+        float sent_at = sender->sent_at[(unsigned) seqnum_add(acknum, -1) & sender->ring_mask];
+        if ( sent_at >= 0 ) {
+            float rtt = simtime() - sent_at;
+
+            sender->srtt = sender->srtt > 0 ? (1 - RTT_ALPHA) * sender->srtt + RTT_ALPHA * rtt : rtt;
+        }
+
+        // Recovery ends once everything sent before the loss is ACKed, or on any new ACK for Reno.
+        if ( sender->cc.in_recovery && (sender->cc_algo->partial_ack_ends_recovery
+                || acked >= seqnum_dist(sender->cc.recover, sender->window_base_seqnum)) ) {
+            sender->cc.in_recovery = 0;
+        }
+
+        // Packets we went back for may have been ACKed by their earlier copies.
+        if ( seqnum_dist(sender->send_seqnum, sender->window_base_seqnum) < acked ) {
+            sender->send_seqnum = acknum;
+        }
+        sender->window_base_seqnum = acknum;
+
+        sender->cc_algo->on_ack(&sender->cc, acked);
+        cc_log(AorB, &sender->cc);
+
+        // Restart the timer for the remaining packets, if any.
+        entity_stoptimer(AorB);
+        if ( sender->window_base_seqnum != sender->next_seqnum ) {
+            entity_starttimer(AorB);
+
+            // A partial ACK during recovery: the next packet after it was lost as well.
+            if ( dupack_threshold > 0 && sender->cc.in_recovery ) {
+                entity_retransmit(AorB, sender->window_base_seqnum);
+            }
+        }
+        return;
+    }
+
+    if ( sender->window_base_seqnum == sender->next_seqnum || window_update ) {
+        return;
+    }
+
+    if ( dupack_threshold > 0 ) {
+        // ACKs riding on data do not count as duplicates, the other side may just be sending.
+        if ( !nack && packet->seqnum != NO_DATA ) {
+            return;
+        }
+
+        sender->dupacks++;
+        trace_printf("\t\t%s_INPUT duplicate ACK %d for seq %d\n", entity_name(AorB), sender->dupacks, acknum);
+
+        if ( sender->dupacks == dupack_threshold && !sender->cc.in_recovery ) {
+            sender->cc.in_recovery = 1;
+            sender->cc.recover = sender->next_seqnum;
+            sender->cc_algo->on_loss(&sender->cc);
+            cc_log(AorB, &sender->cc);
+
+            nfastretransmit++;
+            entity_retransmit(AorB, sender->window_base_seqnum);
+        }
+        return;
+    }
+
+    // If we receive a NACK, go back to the window base and resend as much of the window as cwnd allows.
+    if ( nack ) {
+        trace_printf("\t\t%s_INPUT received NACK message for seq %d. Resending from window_base_seqnum %d, next_seqnum is %d\n", entity_name(AorB), acknum, sender->window_base_seqnum, sender->next_seqnum);
+
+        // React to a loss once per window of data.
+        if ( !sender->cc.in_recovery ) {
+            sender->cc.in_recovery = 1;
+            sender->cc.recover = sender->next_seqnum;
+            sender->cc_algo->on_loss(&sender->cc);
+            cc_log(AorB, &sender->cc);
+        }
+
+        entity_stoptimer(AorB);
+        sender->send_seqnum = sender->window_base_seqnum;
+    }
+}
+
+
+/* Hands the packet at expected_seqnum to the application, a byte stream in
+   one piece and msgs one by one. With app_rate they wait in app_buffer until
+   APP_TIMER lets the application take them. */
+void entity_deliver(int AorB, struct pkt *packet)
+{
+    struct receiver *receiver = &entities[AorB].receiver;
+    unsigned slot = (unsigned) packet->seqnum & receiver->ring_mask;
+
+    if ( stream_bytes > 0 ) {
+        tolayer5_bytes(AorB, packet->payload, packet->length);
+    }
+
+    for (int i = 0; stream_bytes == 0 && i < packet->length / MSG_SIZE; i++) {
+        char *message = packet->payload + i * MSG_SIZE;
+
+        if ( app_rate > 0 ) {
+            memcpy(receiver->app_buffer[(receiver->app_head + receiver->app_count) % app_buffer_size], message, MSG_SIZE);
+            receiver->app_count++;
+
+            if ( !receiver->app_timer_running ) {
+                start_timer(AorB, APP_TIMER, 1 / app_rate);
+                receiver->app_timer_running = 1;
+            }
+        }
+        else {
+            tolayer5(AorB, message);
+        }
+    }
+
+    // With FEC, keep it until its block can no longer be needed for decoding.
+    if ( fec_k > 0 ) {
+        store_packet(receiver, packet, RCV_DELIVERED);
+    }
+    else {
+        receiver->rcv_state[slot] = RCV_EMPTY;
+        pkt_release(&receiver->rcv_buffer[slot]);
+    }
+
+    receiver->expected_seqnum = seqnum_add(receiver->expected_seqnum, 1);
+    receiver->delivered++;
+
+    // A finished block needs no parity any more; its seqnum may come round again.
+    if ( fec_k > 0 && receiver->delivered % fec_k == 0 ) {
+        unsigned pslot = (unsigned) seqnum_add(receiver->expected_seqnum, -fec_k) & receiver->ring_mask;
+
+        memset(&receiver->parity_valid[pslot * fec_m], 0, fec_m);
+    }
+}
+
+// Hands up whatever was waiting behind a gap that has just been filled.
+void entity_deliver_waiting(int AorB)
+{
+    struct receiver *receiver = &entities[AorB].receiver;
+    struct pkt *waiting;
+
+    while ( (waiting = receive_slot(receiver, receiver->expected_seqnum, RCV_WAITING)) != NULL && app_room(receiver, waiting->length / MSG_SIZE) ) {
+        trace_printf("\t\t%s_INPUT delivering buffered packet. seq: %d\n", entity_name(AorB), waiting->seqnum);
+
+        // The sender should hear at once that the gap is filled.
+        receiver->ack_now = 1;
+        receiver->ack_pending = 1;
+
+        entity_deliver(AorB, waiting);
+    }
+}
+
+/* Rebuilds lost packets from FEC parity. The sender starts a block every
+   fec_k new packets, so the block holding expected_seqnum starts
+   `delivered % fec_k` packets before it. Packets of the block that were
+   already delivered or are waiting behind the gap take part in decoding;
+   if at least as many parities as missing packets arrived, the missing ones
+   are rebuilt and delivered, and the next block is tried. */
+void entity_fec_recover(int AorB)
+{
+    struct receiver *receiver = &entities[AorB].receiver;
+
+    while ( fec_k > 0 ) {
+        int start = seqnum_add(receiver->expected_seqnum, (int) -(receiver->delivered % fec_k));
+        unsigned pslot = (unsigned) start & receiver->ring_mask;
+        unsigned char *data[FEC_MAX_K], *parity[FEC_MAX_M];
+        unsigned char rebuilt[FEC_MAX_K][MAX_PAYLOAD];
+        unsigned char data_length[FEC_MAX_K][2], parity_length[FEC_MAX_M][2];
+        unsigned char *data_len[FEC_MAX_K], *parity_len[FEC_MAX_M];
+        char have_data[FEC_MAX_K], have_parity[FEC_MAX_M];
+        int nparities = 0;
+
+        for (int j = 0; j < fec_m; j++) {
+            struct pkt *p = &receiver->parity_buffer[pslot * fec_m + j];
+
+            have_parity[j] = receiver->parity_valid[pslot * fec_m + j] && p->seqnum == start;
+            parity[j] = (unsigned char *) p->payload;
+            parity_length[j][0] = p->fec_length & 0xff;
+            parity_length[j][1] = p->fec_length >> 8;
+            parity_len[j] = parity_length[j];
+            nparities += have_parity[j];
+        }
+        if ( nparities == 0 ) {
+            return;
+        }
+
+        // Packets before expected_seqnum were delivered, the rest may be waiting.
+        for (int i = 0; i < fec_k; i++) {
+            int before = i < (int) (receiver->delivered % fec_k);
+            struct pkt *p = receive_slot(receiver, seqnum_add(start, i), before ? RCV_DELIVERED : RCV_WAITING);
+
+            have_data[i] = p != NULL;
+            data[i] = p != NULL ? (unsigned char *) p->payload : rebuilt[i];
+            data_length[i][0] = p != NULL ? p->length & 0xff : 0;
+            data_length[i][1] = p != NULL ? p->length >> 8 : 0;
+            data_len[i] = data_length[i];
+        }
+
+        if ( fec_decode(fec_k, fec_m, data, have_data, parity, have_parity, max_payload) <= 0 ) {
+            return;
+        }
+        fec_decode(fec_k, fec_m, data_len, have_data, parity_len, have_parity, 2);
+
+        for (int i = 0; i < fec_k; i++) {
+            if ( !have_data[i] ) {
+                unsigned slot = (unsigned) seqnum_add(start, i) & receiver->ring_mask;
+
+                receiver->rcv_buffer[slot].seqnum = seqnum_add(start, i);
+                receiver->rcv_buffer[slot].acknum = 0;
+                receiver->rcv_buffer[slot].fec = 0;
+                receiver->rcv_buffer[slot].length = data_length[i][0] | data_length[i][1] << 8;
+                pkt_alloc_payload(&receiver->rcv_buffer[slot], AorB >> 1);
+                memcpy(receiver->rcv_buffer[slot].payload, rebuilt[i], max_payload);
+                receiver->rcv_state[slot] = RCV_WAITING;
+                nfecrecovered++;
+
+                trace_printf("\t\t%s_INPUT rebuilt seq %d from FEC parity\n", entity_name(AorB), seqnum_add(start, i));
+            }
+        }
+
+        entity_deliver_waiting(AorB);
+    }
+}
+
+// Keeps a parity packet until its block is decoded or no longer needed.
+void entity_receive_parity(int AorB, struct pkt *packet)
+{
+    struct receiver *receiver = &entities[AorB].receiver;
+    int ahead = seqnum_diff(packet->seqnum, receiver->expected_seqnum);
+
+    if ( fec_k == 0 || packet->fec > fec_m || ahead <= -fec_k || ahead >= window_size ) {
+        return;
+    }
+
+    unsigned pslot = (unsigned) packet->seqnum & receiver->ring_mask;
+
+    pkt_hold(&receiver->parity_buffer[pslot * fec_m + packet->fec - 1], packet);
+    receiver->parity_valid[pslot * fec_m + packet->fec - 1] = 1;
+
+    entity_fec_recover(AorB);
+}
+
+
+/* Deals with the data carried by an incoming packet: new data in order goes
+   up to layer 5, a gap is NACKed and anything else is ACKed again. Only the
+   ACK for in-order data may be delayed; every ack_every-th one goes at once.
+
+   With fast retransmit or FEC the sender does not resend the whole window,
+   so packets after a gap are kept in rcv_buffer and go up to layer 5 as
+   soon as the gap is filled. Plain Go-Back-N drops them, they will come again. */
+void entity_receive(int AorB, struct pkt *packet)
+{
+    struct receiver *receiver = &entities[AorB].receiver;
+    int ahead = seqnum_diff(packet->seqnum, receiver->expected_seqnum);
+
+    if ( ahead > 0 ) {
+        trace_printf("\t\t%s_INPUT Packet sequence number %d is not the expected %d\n", entity_name(AorB), packet->seqnum, receiver->expected_seqnum);
+        receiver->nack_pending = 1;
+        nahead++;
+
+        if ( keep_out_of_order() && ahead < window_size ) {
+            if ( receive_slot(receiver, packet->seqnum, RCV_WAITING) != NULL ) {
+                nduplicate++;
+            }
+            store_packet(receiver, packet, RCV_WAITING);
+        }
+    }
+    else if ( ahead == 0 && !app_room(receiver, packet->length / MSG_SIZE) ) {
+        // No room until the application catches up; the ACK says so at once.
+        trace_printf("\t\t%s_INPUT application buffer full, dropping seq: %d\n", entity_name(AorB), packet->seqnum);
+        nrwnddrop++;
+        receiver->ack_now = 1;
+    }
+    else if ( ahead == 0 ) {
+        trace_printf("\t\t%s_INPUT received new data packet. seq: %d, ack: %d, checksum: %d, length: %d, payload: %.*s\n", entity_name(AorB), packet->seqnum, packet->acknum, packet->checksum, packet->length, print_length(packet), packet->payload);
+
+        entity_deliver(AorB, packet);
+
+        receiver->unacked++;
+        if ( ack_every > 0 && receiver->unacked >= ack_every ) {
+            receiver->ack_now = 1;
+        }
+
+        entity_deliver_waiting(AorB);
+    }
+    else {
+        // A duplicate: the sender is retransmitting, so tell it where we are straight away.
+        nduplicate++;
+        receiver->ack_now = 1;
+    }
+
+    receiver->ack_pending = 1;
+
+    // The packet may complete enough of the block at the gap to rebuild it.
+    entity_fec_recover(AorB);
+}
+
+
+// called from layer 3, when a packet arrives for layer 4
+void entity_input(int AorB, struct pkt *packet)
+{
+    struct receiver *receiver = &entities[AorB].receiver;
+
+    trace_printf("\t\t%s_INPUT seq: %d, ack: %d, checksum: %d, length: %d, payload: %.*s\n", entity_name(AorB), packet->seqnum, packet->acknum, packet->checksum, packet->length, print_length(packet), packet->payload);
+
+    // Nothing in a corrupt packet can be trusted. NACK it if the other side sends us data.
+    int csum = checksum(packet);
+    if ( csum != packet->checksum ) {
+        trace_printf("\t\t%s_INPUT Packet is CORRUPT! Packet checksum %d differs from %d\n", entity_name(AorB), packet->checksum, csum);
+
+        if ( receiver->active ) {
+            receiver->ack_pending = 1;
+            receiver->nack_pending = 1;
+            send_ack(AorB);
+        }
+        return;
+    }
+
+    // A mark is echoed back until the sender says it cut its window, which it does after the mark.
+    if ( packet->seqnum != NO_DATA && receiver->active ) {
+        if ( packet->ecn & ECN_CWR ) {
+            receiver->ece = 0;
+        }
+        if ( packet->ecn & ECN_CE ) {
+            nce++;
+            receiver->ece = 1;
+        }
+    }
+
+    if ( packet->seqnum != NO_DATA && packet->fec > 0 && receiver->active ) {
+        entity_receive_parity(AorB, packet);
+    }
+    else if ( packet->seqnum != NO_DATA && receiver->active ) {
+        entity_receive(AorB, packet);
+    }
+
+    entity_ack(AorB, packet);
+
+    // Send whatever the window allows now; the ACK we owe rides on the first packet.
+    entity_send_window(AorB);
+
+    /* Otherwise give data from layer 5 up to ack_delay to come along and carry
+       it, and further packets the chance to be covered by the same ACK. A NACK
+       asks for a retransmission and never waits. */
+    if ( receiver->ack_pending ) {
+        if ( receiver->nack_pending || receiver->ack_now || ack_delay <= 0 ) {
+            send_ack(AorB);
+        }
+        else if ( !receiver->ack_timer_running ) {
+            start_timer(AorB, ACK_TIMER, ack_delay);
+            receiver->ack_timer_running = 1;
+        }
+    }
+}
+
+
+// called when one of the other timers of A or B goes off
+void entity_timer(int AorB, int timer)
+{
+    struct sender *sender = &entities[AorB].sender;
+    struct receiver *receiver = &entities[AorB].receiver;
+
+    if ( timer == ACK_TIMER ) {
+        // The ACK delay ran out, send the ACK on its own.
+        receiver->ack_timer_running = 0;
+        send_ack(AorB);
+    }
+    else if ( timer == PACE_TIMER ) {
+        // The next packet is due; the timer decides, in case the float clock falls just short.
+        sender->pace_timer_running = 0;
+        sender->next_send_at = simtime();
+        entity_send_window(AorB);
+    }
+    else if ( timer == COALESCE_TIMER ) {
+        // Messages waited long enough, send them in whatever packet they fill.
+        sender->coalesce_timer_running = 0;
+        sender->flush = 1;
+        entity_send_window(AorB);
+        sender->flush = 0;
+    }
+    else if ( timer == PERSIST_TIMER ) {
+        // Still a zero window: squeeze one packet past it, its ACK carries the current rwnd.
+        sender->persist_timer_running = 0;
+        if ( rwnd_packets(sender) == 0 ) {
+            sender->probe = 1;
+            if ( sender->persist_backoff < PERSIST_MAX_BACKOFF ) {
+                sender->persist_backoff *= 2;
+            }
+        }
+        entity_send_window(AorB);
+        sender->probe = 0;
+    }
+    else if ( timer == APP_TIMER ) {
+        // The application takes the oldest message, which makes room for what waited behind a gap.
+        receiver->app_timer_running = 0;
+        tolayer5(AorB, receiver->app_buffer[receiver->app_head]);
+        receiver->app_head = (receiver->app_head + 1) % app_buffer_size;
+        receiver->app_count--;
+
+        entity_deliver_waiting(AorB);
+        entity_fec_recover(AorB);
+
+        if ( receiver->app_count > 0 && !receiver->app_timer_running ) {
+            start_timer(AorB, APP_TIMER, 1 / app_rate);
+            receiver->app_timer_running = 1;
+        }
+
+        // Announce that the window opened, the sender may be waiting for it.
+        if ( receiver->zero_window && receive_window(receiver) > 0 ) {
+            trace_printf("\t\t%s_APP window update, rwnd: %d\n", entity_name(AorB), receive_window(receiver));
+            receiver->ack_pending = 1;
+            nwindowupdate++;
+            send_ack(AorB);
+        }
+        else if ( receiver->ack_pending && receiver->ack_now ) {
+            send_ack(AorB);
+        }
+    }
+}
+
+
+// called when the timer of A or B goes off
+void entity_timerinterrupt(int AorB)
+{
+    struct sender *sender = &entities[AorB].sender;
+
+    trace_printf("\t\t------------------------------\n");
+    trace_printf("\t\t%s Interrupt loop: going back to seq %d\n", entity_name(AorB), sender->window_base_seqnum);
+    trace_printf("\t\t------------------------------\n");
+
+    sender->timer_running = 0;
+
+    sender->cc.in_recovery = 0;
+    sender->cc_algo->on_timeout(&sender->cc);
+    cc_log(AorB, &sender->cc);
+
+    sender->send_seqnum = sender->window_base_seqnum;
+    entity_send_window(AorB);
+
+    trace_printf("\t\tEND OF INTERRUPT LOOP\n");
+    trace_printf("\t\t------------------------------\n");
+}
+
+
+void entity_init(int AorB)
+{
+    struct sender *sender = &entities[AorB].sender;
+    struct receiver *receiver = &entities[AorB].receiver;
+    unsigned ring_size = 1;
+
+    // Round the window up to a power of two so ring indexing is a mask instead of a modulo.
+    while (ring_size < (unsigned) window_size) {
+        ring_size <<= 1;
+    }
+
+    sender->ring_mask = ring_size - 1;
+    sender->pkt_buffer = (struct pkt *)calloc(ring_size, PKT_SIZE);
+    sender->sent_at = (float *)malloc(ring_size * sizeof(float));
+    sender->payload_sum = (unsigned *)malloc(ring_size * sizeof(unsigned));
+    sender->send_buffer_size = stream_bytes > 0 ? STREAM_BUFFER_SIZE : MSG_BUFFER_SIZE * MSG_SIZE;
+    sender->send_buffer = (char *)malloc(sender->send_buffer_size);
+    if (sender->pkt_buffer == NULL || sender->sent_at == NULL || sender->payload_sum == NULL || sender->send_buffer == NULL) {
+        printf("entity_init: unable to allocate a window of %u packets\n", ring_size);
+        exit(1);
+    }
+
+    sender->next_seqnum = 1;
+    sender->send_seqnum = 1;
+    sender->window_base_seqnum = 1;
+    sender->timer_running = 0;
+    sender->dupacks = 0;
+    sender->fec_count = 0;
+    sender->srtt = 0.0;
+    sender->next_send_at = 0.0;
+    sender->pace_timer_running = 0;
+    sender->coalesce_timer_running = 0;
+    sender->flush = 0;
+    sender->peer_rwnd = window_size * msgs_per_pkt();
+    sender->probe = 0;
+    sender->persist_backoff = 1;
+    sender->persist_timer_running = 0;
+    sender->zero_window_since = 0.0;
+    sender->zero_window_time = 0.0;
+    sender->send_head = 0;
+    sender->send_count = 0;
+    sender->ecn_reacted = 0;
+    sender->ecn_recover = 1;
+    sender->cwr_pending = 0;
+
+    checksum_algo = checksum_lookup(checksum_name);
+
+    sender->cc_algo = cc_lookup(cc_name);
+    sender->cc_algo->init(&sender->cc);
+    sender->cc.in_recovery = 0;
+    cc_log(AorB, &sender->cc);
+
+    // The receiver also keeps the delivered part of the FEC block at the window base.
+    while (ring_size < (unsigned) (window_size + fec_k)) {
+        ring_size <<= 1;
+    }
+
+    receiver->ring_mask = ring_size - 1;
+    receiver->rcv_buffer = (struct pkt *)calloc(ring_size, PKT_SIZE);
+    receiver->rcv_state = (char *)calloc(ring_size, 1);
+    receiver->parity_buffer = (struct pkt *)calloc(ring_size * fec_m, PKT_SIZE);
+    receiver->parity_valid = (char *)calloc(ring_size * fec_m, 1);
+    receiver->app_buffer = (char (*)[MSG_SIZE])malloc(app_buffer_size * MSG_SIZE);
+    if (receiver->rcv_buffer == NULL || receiver->rcv_state == NULL || receiver->parity_buffer == NULL || receiver->parity_valid == NULL || receiver->app_buffer == NULL) {
+        printf("entity_init: unable to allocate a receive window of %u packets\n", ring_size);
+        exit(1);
+    }
+
+    // Only B receives data, unless both sides send.
+    receiver->expected_seqnum = 1;
+    receiver->delivered = 0;
+    receiver->active = (AorB & 1) == 1 || bidirectional;
+    receiver->ack_pending = 0;
+    receiver->nack_pending = 0;
+    receiver->ack_now = 0;
+    receiver->unacked = 0;
+    receiver->ack_timer_running = 0;
+    receiver->app_head = 0;
+    receiver->app_count = 0;
+    receiver->app_timer_running = 0;
+    receiver->zero_window = 0;
+    receiver->ece = 0;
+}
+
+
+/* The routines below take the flow they are called for: A of flow i is
+   entity 2i and B is entity 2i + 1. */
+
+// called from layer 5, passed the data to be sent to other side
+void A_output(int flow, struct msg message)
+{
+    entity_output(2 * flow, message);
+}
+
+// called from layer 5 with bytes of the stream to send, returns how many A took
+int A_send(int flow, char *data, int len)
+{
+    return entity_send(2 * flow, data, len);
+}
+
+// called from layer 3, when a packet arrives for layer 4
+void A_input(int flow, struct pkt *packet)
+{
+    entity_input(2 * flow, packet);
+}
+
+// called when A's timer goes off
+void A_timerinterrupt(int flow)
+{
+    entity_timerinterrupt(2 * flow);
+}
+
+// called when another of A's timers goes off
+void A_timer(int flow, int timer)
+{
+    entity_timer(2 * flow, timer);
+}
+
+/* the following routine will be called once (only) for each flow before any
+   other entity A routines are called. You can use it to do any initialization */
+void A_init(int flow)
+{
+    if (flow == 0) {
+        entities = (struct entity *)calloc(2 * nflows, sizeof(struct entity));
+        if (entities == NULL) {
+            printf("A_init: unable to allocate %d flows\n", nflows);
+            exit(1);
+        }
+    }
+
+    if (flow == 0 && cwnd_log != NULL) {
+        cwnd_file = fopen(cwnd_log, "w");
+        if (cwnd_file == NULL) {
+            printf("A_init: unable to open %s for the cwnd time series\n", cwnd_log);
+            exit(1);
+        }
+        fprintf(cwnd_file, "# time flow cwnd ssthresh\n");
+    }
+
+    entity_init(2 * flow);
+}
+
+// called from layer 5 at B, only when both sides send data (-b)
+void B_output(int flow, struct msg message)
+{
+    entity_output(2 * flow + 1, message);
+}
+
+// called from layer 3, when a packet arrives for layer 4 at B
+void B_input(int flow, struct pkt *packet)
+{
+    entity_input(2 * flow + 1, packet);
+}
+
+// called when B's timer goes off
+void B_timerinterrupt(int flow)
+{
+    entity_timerinterrupt(2 * flow + 1);
+}
+
+// called when another of B's timers goes off
+void B_timer(int flow, int timer)
+{
+    entity_timer(2 * flow + 1, timer);
+}
+
+/* the following routine will be called once (only) for each flow, after
+   A_init(), before any other entity B routines are called. You can use it to
+   do any initialization */
+void B_init(int flow)
+{
+    entity_init(2 * flow + 1);
+}
+
+
+/*****************************************************************
+***************** NETWORK EMULATION CODE STARTS BELOW ***********
+The code below emulates the layer 3 and below network environment:
+  - emulates the transmission and delivery (possibly with bit-level corruption
+    and packet loss) of packets across the layer 3/4 interface
+  - handles the starting/stopping of a timer, and generates timer
+    interrupts (resulting in calling students timer handler).
+  - generates message to be sent (passed from later 5 to 4)
+
+THERE IS NOT REASON THAT ANY STUDENT SHOULD HAVE TO READ OR UNDERSTAND
+THE CODE BELOW.  YOU SHOULD NOT TOUCH, OR REFERENCE (in your code) ANY
+OF THE DATA STRUCTURES BELOW.  If you're interested in how I designed
+the emulator, you're welcome to look at the code - but again, you should have
+to, and you definitely should not have to modify
+******************************************************************/
+
+
+/* The pending events of the flows a queue serves are a binary min-heap on
+   their time, so inserting and removing one takes O(log n) however many
+   flows keep events pending. Events at the same time go by flow, and those
+   of a flow come out newest first, as they did from the sorted list the heap
+   replaced. There is one queue, or one for each worker thread (-j). */
+struct evqueue {
+    struct event **heap;        // heap[0] is the next event
+    int n;                      // events in heap
+    int size;                   // room in heap
+} *queues;
+int     nqueues = 1;
+
+
+// possible events
+#define  TIMER_INTERRUPT     0
+#define  FROM_LAYER5         1
+#define  FROM_LAYER3         2
+#define  OFF                 0
+#define  ON                  1
+#define  A                   0
+#define  B                   1
+#define  BURST_BUCKETS       8       // burst sizes 1, 2, 3-4, ..., 65 and more
+#define  STREAM_CHUNK        4096    // bytes the sending application writes at a time
+#define  MAX_TIMERS          8       // timers per entity, numbered from 0
+#define  FLOW_REPORT_MAX     16      // flows listed one by one in the report, at most
+#define  RED_MAX_P           0.1     // RED's drop probability just below its max threshold
+#define  RED_WEIGHT          0.002   // weight of the current queue length in RED's average
+#define  MAX_HOPS            8       // hops on the path between A and B, with -H
+#define  TRANSIT_STEP        (2 * MAX_HOPS)  // what link_next() returns for a packet reaching the next hop
+#define  WIRE_FIELDS         8       // header fields of a packet on the loopback sockets, seqnum to ecn
+#define  LOOPBACK_IDLE       1000    // milliseconds the loopback runtime waits with no timer running before it gives up
+
+
+int     TRACE       = 3;         // debugging level
+int     nworkers    = 1;         // threads that run the flows, with several flows
+_Atomic int nsim    = 0;         // number of messages from 5 to 4 so far
+int     nsimmax     = 50;        // number of msgs to generate over all flows, then stop
+float   lossprob    = 0.2;       // probability that a packet is dropped
+float   corruptprob = 0.1;       // probability that one bit is packet is flipped
+float   reorderprob = 0.0;       // probability that a packet is held up and overtaken
+float   reorder_mean = 0.0;      // mean time it is held up for, 0 for delay_max
+float   dupprob     = 0.0;       // probability that a packet arrives twice
+float   lambda      = 25.00;     // arrival rate of messages from layer 5, per flow
+float   delay_min   = 1.0;       // least time a packet takes through the channel, after the one in front
+float   delay_max   = 10.0;      // most time it takes, the delays in between are equally likely
+int     seed        = 9999;      // seeds rand() and each flow's random streams
+_Thread_local float now;         // event time, of the event each thread is running
+
+/* Counted from every thread that runs flows. The channel's counts and state
+   are only ever used by the main thread. */
+_Atomic int  ntolayer3;          // number sent into layer 3
+_Atomic int  ntolayer3from[2];   // number sent into layer 3 by the A and by the B entities
+_Atomic long nbytes3;            // bytes sent into layer 3, headers included
+_Atomic long nevents;            // events taken off the event list
+_Atomic int  ntolayer5;          // number delivered to layer 5
+int     nlost;                   // number lost in media
+int     ncorrupt;                // number corrupted by media
+struct impair_params impair_params[2];  // how the channel towards the A/B entities loses and corrupts, with -G and -e
+struct impair *impair[2];        // its state then, NULL with -l and -c
+long    nbitflips[2];            // bits flipped on the way to the A/B entities
+int     nmalformed;              // packets dropped for a flipped bit in their length
+int     nreordered;              // packets held up for the ones behind them to overtake
+int     nduplicated;             // packets the channel delivers twice
+float   bottleneck_rate = 0.0;   // packets per time unit the bottleneck forwards, 0 for no bottleneck
+float   link_bandwidth  = 0.0;   // bytes per time unit the link sends, 0 to count packets with bottleneck_rate
+int     queue_capacity  = 20;    // packets the bottleneck can hold, including the one being forwarded
+char    *qdisc_name = "droptail";  // discipline of the bottleneck queues: droptail, red, codel or fq_codel
+float   codel_target = 0.0;      // sojourn time CoDel tolerates, 0 for a twentieth of codel_interval
+float   codel_interval = 0.0;    // for how long, 0 for the longest round trip the channel delays allow
+
+/* The path between A and B: hops one after the other, each a link with the
+   queue in front of it in each direction. Packets towards B go through
+   them from the first, packets towards A from the last. -r or -B make a
+   path of one hop, the bottleneck, with the channel's delays. */
+struct hop {
+    float   rate;                // packets per time unit it forwards, with -r
+    float   bandwidth;           // bytes per time unit it sends, 0 with neither: it does not queue
+    float   delay_min;           // propagation delay once a packet is sent, after the one in front
+    float   delay_max;
+    int     capacity;            // packets it can hold, including the one being sent, 0 for -q
+    char    *qdisc_name;         // NULL for -Q
+    float   lossprob;            // probability it loses a packet
+    struct impair_params impair; // or its Gilbert-Elliott loss
+    /* Each direction has its own, by the link index of the entities it
+       sends towards. */
+    struct qdisc *queue[2];      // NULL if it does not queue
+    struct impair *loss[2];
+    float   free_at[2];          // when it finishes its backlog
+    float   busy[2];             // total time spent sending
+    float   arrive_at[2];        // latest time a packet it sent is due at the next hop
+    long    bytes[2];            // bytes it sent, headers included
+    long    lost[2];
+    int     depth[2];            // packets in its queue, and since when
+    float   depth_since[2];
+    int     max_depth[2];
+    double  depth_area[2];       // the depth added up over time
+    float   *queue_delay[2];     // how long each packet it sent waited in its queue
+    int     nqueue_delay[2];
+    int     queue_delay_size[2];
+} hops[MAX_HOPS];
+int     nhops = 0;               // 0 for no queue anywhere
+int     path_given = 0;          // whether -H made the path
+struct queued **transit;         // packets on their way to the next hop, a heap by arrival
+int     ntransit;
+int     transit_size;
+long    ntransit_sent;
+float   lookahead;               // least time from the channel sending a packet on to its arrival, how long windows are
+char    *channel_trace_path = NULL;  // -X: a delay and loss trace the channel replays instead of -l and -L
+struct chantrace channel_trace;  // it, with n 0 without -X
+int     channel_trace_at[2];     // where the channel towards the A/B entities is in it
+/* Message k of flow i has id i + k * nflows, so each flow numbers its own
+   and shares the arrays below with no other. */
+int     nmsgids;                 // message ids there can be
+float   *msg_sent_at;            // when each message came down from layer 5, by message id
+float   *msg_latency;            // delivery latency of each message delivered to layer 5
+char    *msg_delivered;          // whether each message id has reached layer 5 already
+int     *msg_flow;               // the flow each message id was sent on, -1 before it was
+int     nlatency;                // messages with a latency, counted for the report
+_Atomic int nmisdelivered;       // deliveries of a message that was already delivered, or of no message at all
+float   *burst_at;               // when the latest burst of packets from each entity went out
+int     *burst_len;              // packets in that burst so far
+_Atomic int burst_hist[2][BURST_BUCKETS];  // bursts from the A/B entities by size: 1, 2, 3-4, 5-8, ... packets
+struct event **timer_event;      // the pending event of each timer, MAX_TIMERS per entity, NULL while it is off
+float   *arrival_at;             // latest time a packet is due to arrive at each entity
+_Atomic long stream_delivered;   // bytes of the byte streams delivered to layer 5 so far
+_Atomic long stream_misplaced;   // delivered bytes that differ from the stream at their offset
+_Atomic int nflows_done;         // flows that are through: their whole byte stream arrived, or with -Z every msg
+_Thread_local char stream_chunk[STREAM_CHUNK];  // what a sending application is writing
+char    *flow_log = NULL;        // file to write the per-flow metrics to, if any
+
+// What the emulator keeps for each flow, to report on fairness.
+struct flow {
+    int     delivered;           // messages of the flow delivered to layer 5
+    double  latency;             // their latencies added up
+    int     packets;             // packets its A and B sent into layer 3
+    long    stream_sent;         // bytes of its byte stream A has taken so far
+    long    stream_delivered;    // bytes of its byte stream delivered to layer 5 so far
+    float   done_at;             // when the last byte of its stream arrived, or with -Z its last msg
+    int     done;                // whether it did, then the flow's events are dropped
+    int     chunk_len;           // bytes in the chunk the application is writing
+    int     chunk_off;           // bytes of that chunk A has taken
+    int     nsent;               // msgs that came down from its layer 5
+    int     refused;             // of them dropped by a full send buffer, which -Z does not wait for
+    float   on_left;             // with -W onoff, what is left of its ON period
+    int     arrivals;            // arrivals from its layer 5 scheduled so far
+    struct event *next_arrival;  // the pending one, NULL once the rest are past its share of -n
+    long    nevinserted;         // its events inserted so far, to order those at the same time
+    unsigned short arrival_rand[3];  // its random streams, see flow_rand()
+    unsigned short channel_rand[3];
+} *flows;
+
+/* A workload is how msgs come down from layer 5 of a flow: the time from
+   one to the next, and what each says in front of its id. */
+struct workload {
+    char *name;
+    double (*gap)(int flow);           // time to the flow's next msg, NULL for a source that always has one ready
+    void (*fill)(int id, char *data);  // the 12 bytes msg id starts with
+} *workload;
+float   onoff_on    = 0.0;       // -W onoff: mean ON and OFF periods, 0 for ten times -a
+float   onoff_off   = 0.0;
+float   onoff_alpha = 1.5;       // and the shape of their Pareto distribution, heavy-tailed below 2
+char    *msg_trace_path = NULL;  // -W trace: the msgs it replays
+int     msg_trace_n;
+float   *msg_trace_time;         // when each comes down
+char    (*msg_trace_text)[12];   // and what it says
+float   msg_trace_period;        // time after which the trace starts over
+
+
+void usage(char *progname)
+{
+    printf("usage: %s [-w window_size] [-s seqnum_bits] [-b] [-N flows] [-F flow_log] [-j threads] [-p ack_delay] [-d ack_every] [-k dupacks] [-f k,m] [-P rate|rtt] [-A app_rate] [-R app_buffer] [-M max_payload] [-D delay] [-S bytes] [-K checksum] [-C cc] [-g cwnd_log] [-r rate] [-B bandwidth] [-q queue] [-Q qdisc] [-Y target,interval] [-E] [-H bandwidth,min,max[,queue[,loss[,qdisc]]]] [-n nsimmax] [-l lossprob] [-c corruptprob] [-O reorder[,mean]] [-U dupprob] [-G [ab:|ba:]p,r[,good,bad]] [-e [ab:|ba:]ber] [-X trace] [-a lambda] [-W workload[,params]] [-Z] [-L min,max] [-u unit] [-T timeout] [-x seed] [-t trace]\n", progname);
+    printf("  -w  packets in flight before waiting for ACKs, 1..%d (default %d)\n", MAX_WINDOW_SIZE, window_size);
+    printf("  -s  width of the sequence number field in bits, 2..%d (default %d)\n", MAX_SEQNUM_BITS, seqnum_bits);
+    printf("  -b  send data from B to A as well\n");
+    printf("  -N  independent A to B flows sharing the link, each with its own msgs or byte stream (default %d)\n", nflows);
+    printf("  -F  write each flow's throughput, latency and packets to this file\n");
+    printf("  -j  threads that run the flows, the output is the same for any number (default %d)\n", nworkers);
+    printf("  -p  time an ACK may be delayed to piggyback or cover more packets, 0 to send it at once (default %f)\n", ack_delay);
+    printf("  -d  with -p, ACK at once every this many in-order packets, 0 for no limit (default %d)\n", ack_every);
+    printf("  -k  duplicate ACKs before a fast retransmit, 0 to go back N on every NACK (default %d)\n", dupack_threshold);
+    printf("  -f  protect every k data packets with m FEC parity packets, k <= window size, m <= %d (default off)\n", FEC_MAX_M);
+    printf("  -P  pace the sender at this many packets per time unit, or at %.2f windows per smoothed RTT with rtt (default off)\n", PACING_GAIN);
+    printf("  -A  messages per time unit the receiving application takes, 0 to take them at once (default %f)\n", app_rate);
+    printf("  -R  with -A, messages the receiver buffers for the application (default %d)\n", app_buffer_size);
+    printf("  -M  most payload bytes per packet, msgs are coalesced up to %d..%d bytes (default %d)\n", MSG_SIZE, MAX_PAYLOAD, max_payload);
+    printf("  -D  with -M, time msgs may wait to fill a packet while data is unacknowledged (default %f)\n", coalesce_delay);
+    printf("  -S  send this many bytes (k and M suffixes allowed) from A as one byte stream, in segments of -M bytes, instead of msgs\n");
+    printf("  -K  packet checksum: sum (bytes added up), inet (RFC 1071, %s) or crc32c (%s) (default %s)\n", inet_sum_impl(), crc32c_impl(), checksum_name);
+    printf("  -C  congestion control: none, aimd, reno, newreno or cubic (default %s)\n", cc_name);
+    printf("  -g  write the cwnd time series to this file\n");
+    printf("  -r  bottleneck rate in packets per time unit, 0 for none (default %f)\n", bottleneck_rate);
+    printf("  -B  instead of -r, a link sending this many bytes per time unit, packets then take -L after they are sent (default off)\n");
+    printf("  -q  bottleneck queue capacity in packets (default %d)\n", queue_capacity);
+    printf("  -Q  bottleneck queue discipline: droptail, red, codel or fq_codel (default %s)\n", qdisc_name);
+    printf("  -Y  CoDel target,interval (default a twentieth of the interval, delay_min + delay_max)\n");
+    printf("  -E  ECN: the active disciplines mark packets instead of dropping them, and senders react to the marks\n");
+    printf("  -H  add a hop to the path from A to B, up to %d, in place of -r and -B: a link of this many bytes per time unit\n", MAX_HOPS);
+    printf("      (0 for no queue), its delays, and optionally its queue (0 for -q), loss probability or Gilbert-Elliott\n");
+    printf("      p/r[/good/bad], and discipline (default -Q). -L is then the sum of the hops' delays\n");
+    printf("  -n  number of msgs to generate (default %d)\n", nsimmax);
+    printf("  -l  packet loss probability (default %f)\n", lossprob);
+    printf("  -c  packet corruption probability (default %f)\n", corruptprob);
+    printf("  -O  probability a packet is held up and overtaken, and the mean of the extra delay: prob[,mean] (default 0,delay_max)\n");
+    printf("  -U  probability a packet is duplicated (default %f)\n", dupprob);
+    printf("  -G  Gilbert-Elliott bursty loss instead of -l: p,r[,loss_good,loss_bad] (default 0,1 for the losses)\n");
+    printf("  -e  bit error rate instead of -c, flipping bits anywhere in a packet\n");
+    printf("      -G and -e take ab: or ba: in front to set only the A->B or the B->A direction\n");
+    printf("  -X  replay a delay and loss trace, as pcap_trace writes from a capture, instead of -l and -L\n");
+    printf("  -a  mean time between messages from layer 5 (default %f)\n", lambda);
+    printf("  -W  how messages come down from layer 5: uniform on [0,2*lambda], poisson, onoff[,on,off,alpha] with Pareto ON\n");
+    printf("      and OFF periods (default 10*lambda each, alpha 1.5), saturate to keep the sender's buffer full\n");
+    printf("      (with -Z for peak throughput), or trace,file to replay lines of a time and up to 12 characters the\n");
+    printf("      message says (default %s)\n", workload_name);
+    printf("  -Z  run until every message is delivered instead of until the last one comes down from layer 5\n");
+    printf("  -L  least and most time a packet takes through the channel (default %g,%g)\n", delay_min, delay_max);
+    printf("  -u  run in real time over UDP sockets on loopback instead of the emulated channel, a time unit lasting\n");
+    printf("      this many seconds. -l, -c, -G and -e still lose and corrupt packets, the kernel delays them\n");
+    printf("  -T  time the sender waits for an ACK before going back N (default %f)\n", rtx_timeout);
+    printf("  -x  random seed, 0..65535 (default %d)\n", seed);
+    printf("  -t  debugging level (default %d)\n", TRACE);
+    exit(1);
+}
+
+
+/* Parses a byte count such as 65536, 64k or 4M. Returns -1 if it is not
+   one. */
+long parse_bytes(char *text)
+{
+    char *end;
+    long n = strtol(text, &end, 10);
+
+    if (*end == 'k' || *end == 'K') {
+        n *= 1024;
+        end++;
+    }
+    else if (*end == 'M') {
+        n *= 1024 * 1024;
+        end++;
+    }
+    return end == text || *end != '\0' ? -1 : n;
+}
+
+/* -G and -e are for both directions, or for one with ab: or ba: in front.
+   Returns the links they are for, a bit for each, and the rest of text. */
+char *impair_links(char *text, int *links)
+{
+    if (strncmp(text, "ab:", 3) == 0) {
+        *links = 1 << B;        // the link towards B
+        return text + 3;
+    }
+    if (strncmp(text, "ba:", 3) == 0) {
+        *links = 1 << A;
+        return text + 3;
+    }
+    *links = 1 << A | 1 << B;
+    return text;
+}
+
+// Parses -G p,r[,loss_good,loss_bad]. Returns 0 if it is not that.
+int parse_gilbert(char *text)
+{
+    struct impair_params ge = { 1, 0, 0, 0.0, 1.0, 0 };
+    int links, n, i;
+
+    text = impair_links(text, &links);
+    n = sscanf(text, "%f,%f,%f,%f", &ge.ge_p, &ge.ge_r, &ge.ge_loss_good, &ge.ge_loss_bad);
+    if (n != 2 && n != 4) {
+        return 0;
+    }
+    for (i = 0; i < 2; i++) {
+        if (links & 1 << i) {
+            ge.ber = impair_params[i].ber;
+            impair_params[i] = ge;
+        }
+    }
+    return 1;
+}
+
+// Parses -e ber. Returns 0 if it is not that.
+int parse_ber(char *text)
+{
+    double ber;
+    int links, i;
+
+    text = impair_links(text, &links);
+    if (sscanf(text, "%lf", &ber) != 1) {
+        return 0;
+    }
+    for (i = 0; i < 2; i++) {
+        if (links & 1 << i) {
+            impair_params[i].ber = ber;
+        }
+    }
+    return 1;
+}
+
+/* Parses -H bandwidth,min,max[,queue[,loss[,qdisc]]], the next hop of the
+   path from A. The loss is a probability, or Gilbert-Elliott p/r or
+   p/r/loss_good/loss_bad. Returns 0 if it is not that. */
+int parse_hop(char *text)
+{
+    struct hop *hop = &hops[nhops];
+    char loss[64], name[32];
+    int n, m;
+
+    if (nhops == MAX_HOPS) {
+        return 0;
+    }
+    memset(hop, 0, sizeof(struct hop));
+    n = sscanf(text, "%f,%f,%f,%d,%63[^,],%31s", &hop->bandwidth, &hop->delay_min, &hop->delay_max,
+               &hop->capacity, loss, name);
+    if (n < 3) {
+        return 0;
+    }
+    if (n >= 5 && strchr(loss, '/') != NULL) {
+        hop->impair.ge = 1;
+        hop->impair.ge_loss_bad = 1.0;
+        m = sscanf(loss, "%f/%f/%f/%f", &hop->impair.ge_p, &hop->impair.ge_r, &hop->impair.ge_loss_good, &hop->impair.ge_loss_bad);
+        if (m != 2 && m != 4) {
+            return 0;
+        }
+    }
+    else if (n >= 5 && sscanf(loss, "%f", &hop->lossprob) != 1) {
+        return 0;
+    }
+    if (n == 6) {
+        hop->qdisc_name = strdup(name);
+    }
+    nhops++;
+    path_given = 1;
+    return 1;
+}
+
+
+/* Byte i of the stream. It is not periodic in any packet size, so a
+   segment delivered twice, lost or out of place shows up as wrong bytes. */
+char stream_byte(long i)
+{
+    return 'a' + ((unsigned) i * 2654435761u >> 24) % 26;
+}
+
+
+/* The application sending the byte stream of a flow writes as much as A
+   takes, like a blocking write() loop, and is called again after every event
+   of the flow. What is left of its chunk is written out again each time
+   rather than every flow keeping a chunk buffer of its own. */
+void feed_stream(int flow)
+{
+    struct flow *f = &flows[flow];
+    int i, n;
+
+    while (f->stream_sent < stream_bytes) {
+        if (f->chunk_off == f->chunk_len) {
+            f->chunk_len = stream_bytes - f->stream_sent < STREAM_CHUNK ? (int) (stream_bytes - f->stream_sent) : STREAM_CHUNK;
+            f->chunk_off = 0;
+        }
+        for (i = 0; i < f->chunk_len - f->chunk_off; i++) {
+            stream_chunk[i] = stream_byte(f->stream_sent + i);
+        }
+
+        n = A_send(flow, stream_chunk, f->chunk_len - f->chunk_off);
+        if (n == 0) {
+            return;
+        }
+        f->chunk_off += n;
+        f->stream_sent += n;
+    }
+}
+
+
+// Jain's fairness index of n throughputs: 1 when all are equal, 1/n when one flow has it all.
+double jain_index(float *x, int n)
+{
+    double sum = 0.0, squares = 0.0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum += x[i];
+        squares += (double) x[i] * x[i];
+    }
+    return squares > 0 ? sum * sum / (n * squares) : 1.0;
+}
+
+
+// Whether the run is over: all msgs sent, or every byte stream or with -Z every msg delivered.
+int all_done()
+{
+    return (stream_bytes == 0 && !drain && nsim == nsimmax) || ((stream_bytes > 0 || drain) && nflows_done == nflows);
+}
+
+
+// Msgs flow i sends, its share of the nsimmax.
+int flow_msgs(int flow)
+{
+    return nsimmax / nflows + (flow < nsimmax % nflows);
+}
+
+
+/* With -Z a flow is through once its share of the msgs came down from
+   layer 5 and each was delivered, or dropped by a full send buffer. */
+void check_drained(int flow)
+{
+    struct flow *f = &flows[flow];
+
+    if (drain && stream_bytes == 0 && !f->done && f->nsent == flow_msgs(flow) && f->delivered + f->refused == f->nsent) {
+        f->done_at = now;
+        f->done = 1;
+        nflows_done++;
+    }
+}
+
+// A msg of the flow its sender dropped for a full send buffer.
+void msg_refused(int flow)
+{
+    flows[flow].refused++;
+    check_drained(flow);
+}
+
+
+/* Drops an event of a flow that is through: its byte stream or with -Z its
+   msgs arrived, or the event is an arrival past the flow's share of the
+   msgs. Returns whether it did. */
+int event_dropped(struct event *eventptr)
+{
+    struct flow *f = &flows[eventptr->eventity >> 1];
+
+    if (!f->done && !(eventptr->evtype == FROM_LAYER5 && f->nsent >= flow_msgs(eventptr->eventity >> 1))) {
+        return 0;
+    }
+
+    if (eventptr->evtype == FROM_LAYER3) {
+        pkt_release(eventptr->pktptr);
+        free(eventptr->pktptr);
+    }
+    else if (eventptr->evtype == TIMER_INTERRUPT) {
+        timer_event[eventptr->eventity * MAX_TIMERS + eventptr->timer] = NULL;
+    }
+    free(eventptr);
+    return 1;
+}
+
+
+/* Hands the next msg of its flow down from layer 5 to entity AorB: what
+   the workload says, ending in the message id so that layer 5 can tell how
+   long it took. */
+void give_msg(int AorB)
+{
+    struct msg  msg2give;
+    int flow = AorB >> 1;
+    int id = flow + nflows * flows[flow].nsent++;
+    char idtext[16];
+
+    workload->fill(id, msg2give.data);
+    snprintf(idtext, sizeof(idtext), "%08d", id);
+    memcpy(msg2give.data + 12, idtext, 8);
+    msg_sent_at[id] = now;
+    msg_flow[id] = flow;
+
+    if (TRACE>2) {
+        trace_printf("\tMAINLOOP: data given to student: %.20s\n", msg2give.data);
+    }
+
+    nsim++;
+    if ((AorB & 1) == A) {
+        A_output(flow, msg2give);
+    }
+    else {
+        B_output(flow, msg2give);
+    }
+}
+
+
+/* A saturating source always has the next msg ready. Like the application
+   writing a byte stream it gives A, and with -b A and B by turns, as many
+   msgs as the send buffer has room for, and is called again after every
+   event of the flow until its share of the msgs came down. */
+void feed_msgs(int flow)
+{
+    struct flow *f = &flows[flow];
+    struct sender *sender;
+    int AorB;
+
+    while (f->nsent < flow_msgs(flow)) {
+        AorB = 2 * flow + (bidirectional && f->nsent % 2 == 1 ? B : A);
+        sender = &entities[AorB].sender;
+        if (sender->send_buffer_size - sender->send_count < MSG_SIZE) {
+            return;
+        }
+        give_msg(AorB);
+    }
+}
+
+
+// Runs an event taken off the event list and frees it.
+void run_event(struct event *eventptr)
+{
+    int flow = eventptr->eventity >> 1;
+
+    nevents++;
+
+    if (TRACE>=2) {
+       trace_printf("\nEVENT time: %f,",eventptr->evtime);
+       trace_printf("  type: %d",eventptr->evtype);
+        if (eventptr->evtype==0) {
+            trace_printf(", timerinterrupt\n");
+        }
+        else if (eventptr->evtype==1) {
+            trace_printf(", fromlayer5\n");
+        }
+        else {
+            trace_printf(", fromlayer3 ");
+            trace_printf(" entity: %d\n",eventptr->eventity);
+        }
+    }
+
+    // update time to next event time
+    now = eventptr->evtime;
+
+    if (eventptr->evtype == FROM_LAYER5 ) {
+
+        // set up future arrival
+        generate_next_arrival(flow);
+        give_msg(eventptr->eventity);
+    }
+    else if (eventptr->evtype ==  FROM_LAYER3) {
+        if ((eventptr->eventity & 1) == A) {  // deliver packet by calling
+            A_input(flow, eventptr->pktptr);  // appropriate entity
+        }
+        else {
+            B_input(flow, eventptr->pktptr);
+        }
+        pkt_release(eventptr->pktptr); // whoever kept the packet holds its payload
+        free(eventptr->pktptr);        // free the memory for packet
+    }
+    else if (eventptr->evtype ==  TIMER_INTERRUPT) {
+        timer_event[eventptr->eventity * MAX_TIMERS + eventptr->timer] = NULL;
+
+        if ((eventptr->eventity & 1) == A) {
+            if (eventptr->timer == 0) {
+                A_timerinterrupt(flow);
+            }
+            else {
+                A_timer(flow, eventptr->timer);
+            }
+        }
+        else {
+            if (eventptr->timer == 0) {
+                B_timerinterrupt(flow);
+            }
+            else {
+                B_timer(flow, eventptr->timer);
+            }
+        }
+    }
+    else {
+        printf("INTERNAL PANIC: unknown event type \n");
+    }
+
+    free(eventptr);
+
+    // the event may have made room in the send buffer of the flow's A
+    if (stream_bytes > 0) {
+        feed_stream(flow);
+    }
+    else if (workload->gap == NULL) {
+        feed_msgs(flow);
+    }
+}
+
+
+// Runs the events one at a time until the run is over. Returns 1 then.
+int run_events()
+{
+    struct event *eventptr;
+    float when;
+    int step;
+
+    while (1) {
+        // get next event to simulate
+        eventptr = queues[0].n > 0 ? queues[0].heap[0] : NULL;
+
+        // all done with simulation, byte streams once all of every one arrived
+        if (all_done()) {
+            printf("\n-----------------------------------------------------------\n\n");
+            return 1;
+        }
+
+        // the path sends on what it has before the event first
+        step = link_next(&when);
+        if (step >= 0 && (eventptr == NULL || when <= eventptr->evtime)) {
+            link_step(step);
+            continue;
+        }
+
+        if (eventptr==NULL) {
+            printf("Event pointer is null.\n");
+            return 1;
+        }
+
+        // remove this event from event list
+        removeevent(eventptr);
+        if (!event_dropped(eventptr)) {
+            run_event(eventptr);
+        }
+    }
+}
+
+
+/******************** PARALLEL FLOWS ********************/
+
+/* With several flows the events run in windows lookahead time units long.
+   Nothing a flow does reaches another one sooner: flows only meet in the
+   channel, and a packet takes at least delay_min to get through it, or at
+   least the last hop's delay on a path of hops. So in a window each worker
+   thread runs the events of its flows on its own, and then the main thread
+   puts the packets they handed to layer 3 through the channel, which
+   schedules their arrivals in later windows. The packets go through in
+   event order, and what the events print is collected and written in
+   event order too, so runs with any number of threads are the same: -j 1
+   runs the same windows on one worker. The hops send their queued packets
+   on to the next hop or the other end on the main thread as well, in time
+   order with the packets coming in. */
+
+// Part of what a worker did in a window: text it printed, or a packet it handed to layer 3.
+struct piece {
+    float evtime;               // the event it came from
+    int flow;
+    long seq;
+    FILE *out;                  // where the text goes, NULL for a packet
+    size_t start;               // the text, in the worker's buffer
+    size_t len;
+    int AorB;                   // who handed the packet to layer 3
+    struct pkt *packet;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;                     // it runs the flows whose number is id modulo nworkers
+    float evtime;               // the event it is running
+    int flow;
+    long seq;
+    float last_time;            // time of the latest event it ran
+    char *text;                 // what its events printed in this window
+    size_t ntext;
+    size_t text_size;
+    struct piece *pieces;       // its pieces in this window, in event order
+    int npieces;
+    int pieces_size;
+    int next;                   // the first piece not yet written out
+} *workers;
+
+_Thread_local struct worker *self = NULL;  // the worker this thread is, NULL on the main thread
+pthread_barrier_t window_open;      // workers wait here for the next window
+pthread_barrier_t window_closed;    // and here for the others to finish it
+float   window_end;                 // the window runs the events before this time
+int     window_bounded;             // and none after window_bound
+struct event window_bound;
+int     windows_over;               // set once the run is over
+
+
+// Whether piece a is from an event that comes before the event of piece b.
+int piece_before(struct piece *a, struct piece *b)
+{
+    return a->evtime < b->evtime || (a->evtime == b->evtime && (a->flow < b->flow || (a->flow == b->flow && a->seq > b->seq)));
+}
+
+// Adds a piece for the event the worker is running.
+struct piece *new_piece(struct worker *w, FILE *out)
+{
+    struct piece *piece;
+
+    if (w->npieces == w->pieces_size) {
+        w->pieces_size *= 2;
+        w->pieces = (struct piece *)realloc(w->pieces, w->pieces_size * sizeof(struct piece));
+        if (w->pieces == NULL) {
+            printf("new_piece: unable to allocate room for %d pieces of output\n", w->pieces_size);
+            exit(1);
+        }
+    }
+
+    piece = &w->pieces[w->npieces++];
+    piece->evtime = w->evtime;
+    piece->flow = w->flow;
+    piece->seq = w->seq;
+    piece->out = out;
+    piece->start = w->ntext;
+    piece->len = 0;
+    return piece;
+}
+
+
+void *worker_run(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    struct evqueue *queue = &queues[w->id];
+    struct event *eventptr;
+
+    self = w;
+
+    while (1) {
+        pthread_barrier_wait(&window_open);
+        if (windows_over) {
+            return NULL;
+        }
+
+        while (queue->n > 0) {
+            eventptr = queue->heap[0];
+            if (eventptr->evtime >= window_end || (window_bounded && event_before(&window_bound, eventptr))) {
+                break;
+            }
+
+            removeevent(eventptr);
+            if (event_dropped(eventptr)) {
+                continue;
+            }
+
+            w->evtime = eventptr->evtime;
+            w->flow = eventptr->eventity >> 1;
+            w->seq = eventptr->seq;
+            w->last_time = eventptr->evtime;
+            run_event(eventptr);
+        }
+
+        pthread_barrier_wait(&window_closed);
+    }
+}
+
+
+/* Writes out what the workers printed in the window and puts the packets
+   they handed to layer 3 through the channel, all in event order. The
+   pieces of an event are all from one worker and one after the other. */
+void merge_window()
+{
+    struct worker *first;
+    struct piece *piece;
+    float last;
+    int i;
+
+    while (1) {
+        first = NULL;
+        for (i = 0; i < nworkers; i++) {
+            if (workers[i].next < workers[i].npieces
+                    && (first == NULL || piece_before(&workers[i].pieces[workers[i].next], &first->pieces[first->next]))) {
+                first = &workers[i];
+            }
+        }
+        if (first == NULL) {
+            break;
+        }
+
+        link_run(first->pieces[first->next].evtime, 0);
+        do {
+            piece = &first->pieces[first->next++];
+            if (piece->out != NULL) {
+                fwrite(first->text + piece->start, 1, piece->len, piece->out);
+            }
+            else {
+                now = piece->evtime;
+                forward_packet(piece->AorB, piece->packet);
+            }
+        } while (first->next < first->npieces && first->pieces[first->next].flow == piece->flow
+                 && first->pieces[first->next].seq == piece->seq);
+    }
+
+    /* what the links send later on waits for the next window, where packets
+       that come in before it still can go ahead of it */
+    last = now;
+    link_run(window_bounded && window_bound.evtime < window_end ? window_bound.evtime : window_end, 1);
+    now = last;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].ntext = 0;
+        workers[i].npieces = 0;
+        workers[i].next = 0;
+    }
+}
+
+
+/* The latest arrival from layer 5 still to come within the flows' shares of
+   the msgs. The run does not end before it, so no window needs to go past
+   it to find out where the run ends. Returns 0 if there is none. */
+int latest_arrival(struct event *bound)
+{
+    struct event *latest = NULL;
+    int flow;
+
+    for (flow = 0; flow < nflows; flow++) {
+        if (flows[flow].next_arrival != NULL && (latest == NULL || event_before(latest, flows[flow].next_arrival))) {
+            latest = flows[flow].next_arrival;
+        }
+    }
+    if (latest != NULL) {
+        *bound = *latest;
+    }
+    return latest != NULL;
+}
+
+
+// Runs the events window by window until the run is over. Returns 1 then.
+int run_windows()
+{
+    float next;
+    int i;
+
+    workers = (struct worker *)calloc(nworkers, sizeof(struct worker));
+    if (workers == NULL) {
+        printf("run_windows: unable to allocate %d workers\n", nworkers);
+        exit(1);
+    }
+    pthread_barrier_init(&window_open, NULL, nworkers + 1);
+    pthread_barrier_init(&window_closed, NULL, nworkers + 1);
+    windows_over = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        workers[i].text_size = 65536;
+        workers[i].text = (char *)malloc(workers[i].text_size);
+        workers[i].pieces_size = 256;
+        workers[i].pieces = (struct piece *)malloc(workers[i].pieces_size * sizeof(struct piece));
+        if (workers[i].text == NULL || workers[i].pieces == NULL || pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            printf("run_windows: unable to start worker %d\n", i);
+            exit(1);
+        }
+    }
+
+    while (1) {
+        if (all_done()) {
+            printf("\n-----------------------------------------------------------\n\n");
+            break;
+        }
+
+        if (link_next(&next) < 0) {
+            next = -1;
+        }
+        for (i = 0; i < nqueues; i++) {
+            if (queues[i].n > 0 && (next < 0 || queues[i].heap[0]->evtime < next)) {
+                next = queues[i].heap[0]->evtime;
+            }
+        }
+        if (next < 0) {
+            printf("Event pointer is null.\n");
+            break;
+        }
+
+        window_end = next + lookahead;
+        window_bounded = stream_bytes == 0 && !drain && latest_arrival(&window_bound);
+
+        pthread_barrier_wait(&window_open);
+        pthread_barrier_wait(&window_closed);
+        merge_window();
+    }
+
+    windows_over = 1;
+    pthread_barrier_wait(&window_open);
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].last_time > now) {
+            now = workers[i].last_time;
+        }
+    }
+    return 1;
+}
+
+
+/******************** LOOPBACK RUNTIME ********************/
+
+/* With -u the entities run in real time over UDP sockets on loopback, see
+   loopback.h, instead of over the emulated channel: a time unit lasts
+   loopback_unit seconds and now is the time since the run started. The
+   timers and the arrivals from layer 5 are events on the event list as
+   always, which the main thread runs once they are due, waking up on a
+   timerfd armed for the first of them; a datagram that arrives is run as
+   the packet the channel delivers. Packets are still lost and corrupted as
+   -l, -c, -G and -e say before they are sent, so the ARQ has something to
+   do on a kernel that loses nothing. Every flow runs on the main thread. */
+
+float   loopback_unit = 0.0;     // -u: seconds a time unit lasts, 0 for the emulated channel
+struct loopback *loopback = NULL;
+double  loopback_start;          // loopback_clock() when the run started
+double  loopback_wall;           // and how long it took
+
+
+// Time units since the loopback run started.
+float loopback_now()
+{
+    return (loopback_clock() - loopback_start) / loopback_unit;
+}
+
+// Sends a packet the channel let through to the other entity of its flow.
+void loopback_forward(int AorB, struct pkt *mypktptr)
+{
+    uint32_t wire[WIRE_FIELDS + MAX_PAYLOAD / sizeof(uint32_t)];
+    int length = mypktptr->length;
+
+    if (corrupt_packet(AorB ^ 1, mypktptr, flows[AorB >> 1].channel_rand)) {
+        pkt_release(mypktptr);
+        free(mypktptr);
+        return;
+    }
+
+    wire[0] = htonl(mypktptr->seqnum);
+    wire[1] = htonl(mypktptr->acknum);
+    wire[2] = htonl(mypktptr->checksum);
+    wire[3] = htonl(mypktptr->fec);
+    wire[4] = htonl(mypktptr->rwnd);
+    wire[5] = htonl(mypktptr->length);
+    wire[6] = htonl(mypktptr->fec_length);
+    wire[7] = htonl(mypktptr->ecn);
+    length = length < 0 ? 0 : length < MAX_PAYLOAD ? length : MAX_PAYLOAD;
+    memcpy(wire + WIRE_FIELDS, mypktptr->payload, length);
+    loopback_send(loopback, AorB, (char *) wire, WIRE_FIELDS * sizeof(uint32_t) + length);
+
+    pkt_release(mypktptr);
+    free(mypktptr);
+}
+
+// A datagram arrived at entity AorB: the packet in it is run as an arrival from layer 3 now.
+void loopback_receive(void *arg, int AorB, char *data, int length)
+{
+    uint32_t wire[WIRE_FIELDS];
+    struct pkt *packet;
+    struct event *evptr;
+    int n = length - (int) sizeof(wire);
+
+    (void) arg;
+    if (n >= 0) {
+        memcpy(wire, data, sizeof(wire));
+    }
+    if (n < 0 || (int) ntohl(wire[5]) != n) {
+        nmalformed++;
+        return;
+    }
+
+    packet = (struct pkt *)malloc(sizeof(struct pkt));
+    evptr = (struct event *)malloc(sizeof(struct event));
+    if (packet == NULL || evptr == NULL) {
+        printf("loopback_receive: unable to allocate a packet\n");
+        exit(1);
+    }
+    packet->seqnum = ntohl(wire[0]);
+    packet->acknum = ntohl(wire[1]);
+    packet->checksum = ntohl(wire[2]);
+    packet->fec = ntohl(wire[3]);
+    packet->rwnd = ntohl(wire[4]);
+    packet->length = n;
+    packet->fec_length = ntohl(wire[6]);
+    packet->ecn = ntohl(wire[7]);
+    packet->buf = NULL;
+    packet->payload = no_payload;
+    if (n > 0) {
+        pkt_alloc_payload(packet, AorB >> 1);
+        memcpy(packet->payload, data + sizeof(wire), n);
+    }
+
+    now = loopback_now();
+    evptr->evtime = now;
+    evptr->evtype = FROM_LAYER3;
+    evptr->eventity = AorB;
+    evptr->pktptr = packet;
+    if (!event_dropped(evptr)) {
+        run_event(evptr);
+    }
+}
+
+/* Runs the events as they come due and the packets as they arrive until
+   the run is over, or nothing is left to wait for. Returns 1 then. */
+int run_loopback()
+{
+    struct event *eventptr;
+    struct evqueue *queue = &queues[0];
+
+    loopback = loopback_create(2 * nflows, WIRE_FIELDS * sizeof(uint32_t) + MAX_PAYLOAD);
+    if (loopback == NULL) {
+        exit(1);
+    }
+    loopback_start = loopback_clock();
+
+    while (1) {
+        // the timers and arrivals that are due, at the time they run rather than the one they were set for
+        now = loopback_now();
+        while (!all_done() && queue->n > 0 && queue->heap[0]->evtime <= now) {
+            eventptr = queue->heap[0];
+            removeevent(eventptr);
+            if (!event_dropped(eventptr)) {
+                eventptr->evtime = now;
+                run_event(eventptr);
+            }
+        }
+
+        if (all_done()) {
+            loopback_flush(loopback);
+            printf("\n-----------------------------------------------------------\n\n");
+            break;
+        }
+
+        loopback_arm(loopback, queue->n > 0 ? loopback_start + queue->heap[0]->evtime * loopback_unit : -1.0);
+        if (loopback_wait(loopback, queue->n > 0 ? -1 : LOOPBACK_IDLE, loopback_receive, NULL) < 0) {
+            printf("Event pointer is null.\n");
+            break;
+        }
+    }
+
+    now = loopback_now();
+    loopback_wall = loopback_clock() - loopback_start;
+    return 1;
+}
+
+// What the loopback run did in real time.
+void report_loopback()
+{
+    struct loopback_stats *stats = loopback_stats(loopback);
+
+    printf("Loopback wall-clock time (seconds):          %f\n", loopback_wall);
+    printf("Packets per second sent into layer 3:        %f\n", loopback_wall > 0 ? ntolayer3 / loopback_wall : 0.0);
+    printf("Messages per second delivered to layer 5:    %f\n", loopback_wall > 0 ? ntolayer5 / loopback_wall : 0.0);
+    printf("Datagrams sent / received / dropped:         %ld / %ld / %ld\n", stats->sent, stats->received, stats->dropped);
+    printf("Datagrams per sendmmsg / per recvmmsg:       %f / %f\n",
+           stats->sendmmsg_calls > 0 ? (double) stats->sent / stats->sendmmsg_calls : 0.0,
+           stats->recvmmsg_calls > 0 ? (double) stats->received / stats->recvmmsg_calls : 0.0);
+    printf("Wakeups from epoll:                          %ld\n", stats->wakeups);
+}
+
+
+// Final cwnd of the A or the B senders, averaged over the flows.
+double mean_cwnd(int AorB)
+{
+    double sum = 0.0;
+    int flow;
+
+    for (flow = 0; flow < nflows; flow++) {
+        sum += entities[2 * flow + AorB].sender.cc.cwnd;
+    }
+    return sum / nflows;
+}
+
+// Smoothed RTT at the A or the B senders, averaged over the flows.
+double mean_srtt(int AorB)
+{
+    double sum = 0.0;
+    int flow;
+
+    for (flow = 0; flow < nflows; flow++) {
+        sum += entities[2 * flow + AorB].sender.srtt;
+    }
+    return sum / nflows;
+}
+
+
+// Share of the time hop h was sending towards the A or B entities, not counting what it still has to send.
+double link_utilization(int h, int link)
+{
+    struct hop *hop = &hops[h];
+    float unsent = hop->free_at[link] > now ? hop->free_at[link] - now : 0;
+
+    return now > 0 ? (hop->busy[link] - unsent) / now : 0.0;
+}
+
+
+// How long the packets hop h sent towards the A or B entities waited in its queue.
+void report_queue_delay(char *label, int h, int link)
+{
+    float *delay = hops[h].queue_delay[link];
+    int n = hops[h].nqueue_delay[link];
+    double sum = 0.0;
+
+    if (n == 0) {
+        return;
+    }
+    qsort(delay, n, sizeof(float), compare_float);
+    for (int i = 0; i < n; i++) {
+        sum += delay[i];
+    }
+    printf("Queue delay %s mean / p50 / p99 / max:%*s%f / %f / %f / %f\n", label, (int) (9 - strlen(label)), "",
+           sum / n, delay[n / 2], delay[n * 99 / 100], delay[n - 1]);
+}
+
+/* What each hop of a path given with -H did in each direction: how busy
+   its link was, how deep its queue got, averaged over time, and what it
+   lost, dropped or marked. The busiest hop is the bottleneck. */
+void report_hops()
+{
+    char label[32];
+    int busiest[2] = { -1, -1 };
+    int h, i;
+
+    for (h = 0; h < nhops; h++) {
+        struct hop *hop = &hops[h];
+
+        for (i = B; i >= A; i--) {
+            char *direction = i == B ? "A->B" : "B->A";
+
+            struct qdisc_stats *stats;
+            double area;
+
+            if (hop->queue[i] == NULL) {
+                printf("Hop %-2d %s packets lost:                    %ld\n", h + 1, direction, hop->lost[i]);
+                continue;
+            }
+            stats = qdisc_stats(hop->queue[i]);
+            area = hop->depth_area[i] + hop->depth[i] * (double) (now > hop->depth_since[i] ? now - hop->depth_since[i] : 0);
+
+            printf("Hop %-2d %s utilization / throughput:        %f / %f\n", h + 1, direction, link_utilization(h, i),
+                   now > 0 ? hop->bytes[i] / now : 0.0);
+            printf("Hop %-2d %s queue depth mean / max:          %f / %d\n", h + 1, direction, now > 0 ? area / now : 0.0,
+                   hop->max_depth[i]);
+            printf("Hop %-2d %s lost / full / dropped / marked:  %ld / %ld / %ld / %ld\n", h + 1, direction,
+                   hop->lost[i], stats->overflow, stats->dropped, stats->marked);
+            snprintf(label, sizeof(label), "%d %s", h + 1, direction);
+            report_queue_delay(label, h, i);
+            if (busiest[i] < 0 || link_utilization(h, i) > link_utilization(busiest[i], i)) {
+                busiest[i] = h;
+            }
+        }
+    }
+    if (busiest[B] >= 0) {
+        printf("Busiest hop A->B / B->A:                     %d / %d\n", busiest[B] + 1, busiest[A] + 1);
+    }
+}
+
+
+/* Throughput of each flow and how evenly the link was shared: stream bytes
+   per time unit until the stream was through, or msgs per time unit. The
+   aggregate is the throughput or goodput reported before. */
+void report_flows()
+{
+    float *throughput = (float *)malloc(nflows * sizeof(float));
+    float *sorted = (float *)malloc(nflows * sizeof(float));
+    FILE *file = NULL;
+    int flow;
+
+    if (throughput == NULL || sorted == NULL) {
+        printf("report_flows: unable to allocate %d flows\n", nflows);
+        exit(1);
+    }
+
+    for (flow = 0; flow < nflows; flow++) {
+        struct flow *f = &flows[flow];
+        float until = (stream_bytes > 0 || drain) && f->done_at > 0 ? f->done_at : now;
+
+        if (stream_bytes > 0) {
+            throughput[flow] = until > 0 ? f->stream_delivered / until : 0.0;
+        }
+        else {
+            throughput[flow] = until > 0 ? f->delivered / until : 0.0;
+        }
+        sorted[flow] = throughput[flow];
+    }
+    qsort(sorted, nflows, sizeof(float), compare_float);
+
+    printf("Flows:                                       %d\n", nflows);
+    printf("Flow throughput min / median / max:          %f / %f / %f\n", sorted[0], sorted[nflows / 2], sorted[nflows - 1]);
+    printf("Jain's fairness index of flow throughput:    %f\n", jain_index(throughput, nflows));
+
+    if (flow_log != NULL) {
+        file = fopen(flow_log, "w");
+        if (file == NULL) {
+            printf("report_flows: unable to open %s for the per-flow metrics\n", flow_log);
+            exit(1);
+        }
+        fprintf(file, "# flow throughput delivered packets mean_latency\n");
+    }
+    for (flow = 0; flow < nflows; flow++) {
+        struct flow *f = &flows[flow];
+        long delivered = stream_bytes > 0 ? f->stream_delivered : f->delivered;
+        double latency = f->delivered > 0 ? f->latency / f->delivered : 0.0;
+
+        if (nflows <= FLOW_REPORT_MAX) {
+            printf("Flow %-4d throughput / delivered / packets:  %f / %ld / %d\n", flow, throughput[flow], delivered, f->packets);
+        }
+        if (file != NULL) {
+            fprintf(file, "%d %f %ld %d %f\n", flow, throughput[flow], delivered, f->packets, latency);
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    free(throughput);
+    free(sorted);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int i,j;
+    int opt;
+    int terminate = 0;
+    int flow;
+    char *workload_args;
+
+    while ((opt = getopt(argc, argv, "w:s:bN:F:j:p:d:k:f:P:A:R:M:D:S:K:C:g:r:B:q:Q:Y:EH:n:l:c:O:U:G:e:X:a:W:ZL:u:T:x:t:")) != -1) {
+        switch (opt) {
+            case 'w': window_size = atoi(optarg); break;
+            case 's': seqnum_bits = atoi(optarg); break;
+            case 'b': bidirectional = 1; break;
+            case 'N': nflows = atoi(optarg); break;
+            case 'F': flow_log = optarg; break;
+            case 'j': nworkers = atoi(optarg); break;
+            case 'p': ack_delay = atof(optarg); break;
+            case 'd': ack_every = atoi(optarg); break;
+            case 'k': dupack_threshold = atoi(optarg); break;
+            case 'f': if (sscanf(optarg, "%d,%d", &fec_k, &fec_m) != 2) usage(argv[0]); break;
+            case 'P': if (strcmp(optarg, "rtt") == 0) pace_rtt = 1; else pace_rate = atof(optarg); break;
+            case 'A': app_rate = atof(optarg); break;
+            case 'R': app_buffer_size = atoi(optarg); break;
+            case 'M': max_payload = atoi(optarg); break;
+            case 'D': coalesce_delay = atof(optarg); break;
+            case 'S': if ((stream_bytes = parse_bytes(optarg)) < 0) usage(argv[0]); break;
+            case 'K': checksum_name = optarg; break;
+            case 'C': cc_name = optarg; break;
+            case 'g': cwnd_log = optarg; break;
+            case 'r': bottleneck_rate = atof(optarg); break;
+            case 'B': link_bandwidth = atof(optarg); break;
+            case 'q': queue_capacity = atoi(optarg); break;
+            case 'Q': qdisc_name = optarg; break;
+            case 'Y': if (sscanf(optarg, "%f,%f", &codel_target, &codel_interval) != 2) usage(argv[0]); break;
+            case 'E': ecn = 1; break;
+            case 'H': if (!parse_hop(optarg)) usage(argv[0]); break;
+            case 'n': nsimmax = atoi(optarg); break;
+            case 'l': lossprob = atof(optarg); break;
+            case 'c': corruptprob = atof(optarg); break;
+            case 'O': if (sscanf(optarg, "%f,%f", &reorderprob, &reorder_mean) < 1) usage(argv[0]); break;
+            case 'U': dupprob = atof(optarg); break;
+            case 'G': if (!parse_gilbert(optarg)) usage(argv[0]); break;
+            case 'e': if (!parse_ber(optarg)) usage(argv[0]); break;
+            case 'X': channel_trace_path = optarg; break;
+            case 'a': lambda = atof(optarg); break;
+            case 'W': workload_name = optarg; break;
+            case 'Z': drain = 1; break;
+            case 'L': if (sscanf(optarg, "%f,%f", &delay_min, &delay_max) != 2) usage(argv[0]); break;
+            case 'u': loopback_unit = atof(optarg); break;
+            case 'T': rtx_timeout = atof(optarg); break;
+            case 'x': seed = atoi(optarg); break;
+            case 't': TRACE = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (nflows < 1) {
+        printf("There must be at least one flow\n");
+        usage(argv[0]);
+    }
+
+    if (nworkers < 1) {
+        printf("There must be at least one worker thread\n");
+        usage(argv[0]);
+    }
+    if (nworkers > nflows) {
+        nworkers = nflows;      // a worker with no flow would only wait at the barriers
+    }
+
+    if (seqnum_bits < 2 || seqnum_bits > MAX_SEQNUM_BITS) {
+        printf("Sequence number bits must be between 2 and %d\n", MAX_SEQNUM_BITS);
+        usage(argv[0]);
+    }
+
+    /* With serial number arithmetic the window may cover at most half of the
+       sequence space, otherwise old and new packets become indistinguishable. */
+    if (window_size < 1 || window_size > MAX_WINDOW_SIZE || window_size > (1 << (seqnum_bits - 1))) {
+        printf("Window size must be between 1 and min(%d, 2^(seqnum_bits-1) = %d)\n", MAX_WINDOW_SIZE, 1 << (seqnum_bits - 1));
+        usage(argv[0]);
+    }
+
+    if (cc_lookup(cc_name) == NULL) {
+        printf("Unknown congestion control algorithm %s\n", cc_name);
+        usage(argv[0]);
+    }
+
+    if (checksum_lookup(checksum_name) == NULL) {
+        printf("Unknown checksum %s\n", checksum_name);
+        usage(argv[0]);
+    }
+
+    if (bottleneck_rate < 0 || link_bandwidth < 0 || queue_capacity < 1) {
+        printf("Bottleneck rate and bandwidth must not be negative and queue capacity must be at least 1\n");
+        usage(argv[0]);
+    }
+
+    if (bottleneck_rate > 0 && link_bandwidth > 0) {
+        printf("The bottleneck counts either packets with -r or bytes with -B\n");
+        usage(argv[0]);
+    }
+
+    if (!qdisc_known(qdisc_name)) {
+        printf("Unknown queue discipline %s\n", qdisc_name);
+        usage(argv[0]);
+    }
+
+    if (strcmp(qdisc_name, "droptail") != 0 && bottleneck_rate == 0 && link_bandwidth == 0 && !path_given) {
+        printf("A queue discipline needs a bottleneck, -r, -B or -H\n");
+        usage(argv[0]);
+    }
+
+    if (path_given && (bottleneck_rate > 0 || link_bandwidth > 0)) {
+        printf("A path of hops takes the place of -r and -B\n");
+        usage(argv[0]);
+    }
+
+    for (i = 0; i < nhops; i++) {
+        struct hop *hop = &hops[i];
+        struct impair_params *m = &hop->impair;
+
+        if (hop->bandwidth < 0 || hop->delay_min <= 0 || hop->delay_max < hop->delay_min || hop->capacity < 0
+                || hop->lossprob < 0 || hop->lossprob > 1
+                || (m->ge && (m->ge_p < 0 || m->ge_p > 1 || m->ge_r <= 0 || m->ge_r > 1 || m->ge_loss_good < 0
+                              || m->ge_loss_good > 1 || m->ge_loss_bad < 0 || m->ge_loss_bad > 1))) {
+            printf("Hop %d needs a bandwidth not negative, positive delays with min <= max, and probabilities between 0 and 1\n", i + 1);
+            usage(argv[0]);
+        }
+        if (hop->qdisc_name != NULL && !qdisc_known(hop->qdisc_name)) {
+            printf("Unknown queue discipline %s\n", hop->qdisc_name);
+            usage(argv[0]);
+        }
+    }
+
+    if (codel_target < 0 || codel_interval < 0) {
+        printf("CoDel target and interval must not be negative\n");
+        usage(argv[0]);
+    }
+
+    if (max_payload < MSG_SIZE || max_payload > MAX_PAYLOAD || coalesce_delay < 0) {
+        printf("Packets carry %d to %d payload bytes and the coalescing delay must not be negative\n", MSG_SIZE, MAX_PAYLOAD);
+        usage(argv[0]);
+    }
+
+    if (app_rate < 0 || (app_rate > 0 && app_buffer_size < max_payload / MSG_SIZE)) {
+        printf("Application rate must not be negative and its buffer must hold at least a packet's worth of messages\n");
+        usage(argv[0]);
+    }
+
+    // The application buffer and B's sender count msgs, a byte stream only goes from A to B.
+    if (stream_bytes > 0 && (app_rate > 0 || bidirectional)) {
+        printf("A byte stream cannot be combined with -A or -b\n");
+        usage(argv[0]);
+    }
+
+    if (pace_rate < 0) {
+        printf("Pacing rate must not be negative\n");
+        usage(argv[0]);
+    }
+
+    // -W name[,params]: onoff takes its periods and shape, trace the file to replay
+    workload_args = strchr(workload_name, ',');
+    if (workload_args != NULL) {
+        *workload_args++ = '\0';
+    }
+    workload = workload_lookup(workload_name);
+    if (workload == NULL) {
+        printf("Unknown workload %s\n", workload_name);
+        usage(argv[0]);
+    }
+    if (stream_bytes > 0 && strcmp(workload->name, "uniform") != 0) {
+        printf("A byte stream cannot be combined with -W\n");
+        usage(argv[0]);
+    }
+    if (strcmp(workload->name, "onoff") == 0) {
+        if (workload_args != NULL && sscanf(workload_args, "%f,%f,%f", &onoff_on, &onoff_off, &onoff_alpha) < 1) {
+            usage(argv[0]);
+        }
+        onoff_on = onoff_on > 0 ? onoff_on : 10 * lambda;
+        onoff_off = onoff_off > 0 ? onoff_off : 10 * lambda;
+        if (onoff_alpha <= 1) {
+            printf("The Pareto shape must be above 1 for the periods to have a mean\n");
+            usage(argv[0]);
+        }
+    }
+    else if (strcmp(workload->name, "trace") == 0) {
+        if (workload_args == NULL) {
+            printf("The trace workload needs the file to replay\n");
+            usage(argv[0]);
+        }
+        msg_trace_path = workload_args;
+        if (read_msg_trace(msg_trace_path) != 0) {
+            exit(1);
+        }
+    }
+    else if (workload_args != NULL) {
+        printf("The %s workload takes no parameters\n", workload->name);
+        usage(argv[0]);
+    }
+    if (lambda <= 0 && workload->gap != NULL && strcmp(workload->name, "trace") != 0) {
+        printf("The mean time between messages must be positive\n");
+        usage(argv[0]);
+    }
+
+    /* A trace is the channel's losses and delays, in place of the other
+       ways of drawing them; -l and -L then only report on it. */
+    if (channel_trace_path != NULL) {
+        if (chantrace_read(channel_trace_path, &channel_trace) != 0) {
+            exit(1);
+        }
+        if (bottleneck_rate > 0 || link_bandwidth > 0 || path_given || reorderprob > 0 || impair_params[A].ge || impair_params[B].ge) {
+            printf("A channel trace cannot be combined with -r, -B, -H, -O or -G\n");
+            usage(argv[0]);
+        }
+        lossprob = channel_trace.loss_rate;
+        delay_min = channel_trace.delay_min;
+        delay_max = channel_trace.delay_max;
+    }
+
+    // the kernel is the whole channel but for its losses and corruptions
+    if (loopback_unit < 0 || (loopback_unit > 0 && (bottleneck_rate > 0 || link_bandwidth > 0 || path_given
+            || reorderprob > 0 || dupprob > 0 || channel_trace_path != NULL || nworkers > 1))) {
+        printf("The loopback time unit must not be negative, and the loopback runtime cannot be combined with -r, -B, -H, -O, -U, -X or -j\n");
+        usage(argv[0]);
+    }
+
+    // the flows' windows are delay_min long, so it must not be 0
+    if (delay_min <= 0 || delay_max < delay_min || rtx_timeout <= 0) {
+        printf("Channel delays must be positive with min <= max, and the timeout positive\n");
+        usage(argv[0]);
+    }
+
+    if (reorderprob < 0 || reorderprob > 1 || reorder_mean < 0 || dupprob < 0 || dupprob > 1) {
+        printf("Reorder and duplication probabilities must be between 0 and 1, and the reorder delay not negative\n");
+        usage(argv[0]);
+    }
+
+    for (i = 0; i < 2; i++) {
+        struct impair_params *m = &impair_params[i];
+
+        if ((m->ge && (m->ge_p < 0 || m->ge_p > 1 || m->ge_r <= 0 || m->ge_r > 1 || m->ge_loss_good < 0
+                       || m->ge_loss_good > 1 || m->ge_loss_bad < 0 || m->ge_loss_bad > 1))
+                || m->ber < 0 || m->ber >= 1) {
+            printf("Gilbert-Elliott probabilities must be between 0 and 1 with r > 0, and the bit error rate below 1\n");
+            usage(argv[0]);
+        }
+    }
+
+    if (seed < 0 || seed > 0xffff) {
+        printf("The random seed must be between 0 and 65535\n");
+        usage(argv[0]);
+    }
+
+    if (fec_k != 0 && (fec_k < 1 || fec_k > FEC_MAX_K || fec_k > window_size || fec_m < 1 || fec_m > FEC_MAX_M)) {
+        printf("FEC needs 1 <= k <= min(%d, window size) and 1 <= m <= %d\n", FEC_MAX_K, FEC_MAX_M);
+        usage(argv[0]);
+    }
+
+    fec_init();
+    checksum_init();
+    init();
+    for (flow = 0; flow < nflows; flow++) {
+        A_init(flow);
+        B_init(flow);
+    }
+    for (flow = 0; flow < nflows; flow++) {
+        if (stream_bytes > 0) {
+            feed_stream(flow);
+        }
+        else if (workload->gap == NULL) {
+            feed_msgs(flow);
+        }
+    }
+
+    // one flow runs event by event, several in windows on worker threads
+    terminate = loopback_unit > 0 ? run_loopback() : nflows > 1 ? run_windows() : run_events();
+
+    if (terminate == 1 && stream_bytes > 0) {
+        printf("Simulator terminated at time %f after delivering %ld stream bytes to layer5.\n\n", now, stream_delivered);
+    }
+    else if (terminate == 1 && drain) {
+        printf("Simulator terminated at time %f after delivering %d of %d msgs from layer5.\n\n", now, ntolayer5 - nmisdelivered, nsim);
+    }
+    else if (terminate == 1) {
+        printf("Simulator terminated at time %f after sending %d msgs from layer5.\n\n", now, nsim);
+    }
+
+    printf("Packets sent into layer 3:                   %d\n", ntolayer3);
+    printf("Packets sent into layer 3 by A / by B:       %d / %d\n", ntolayer3from[A], ntolayer3from[B]);
+    printf("Messages delivered to layer 5:               %d\n", ntolayer5);
+    printf("Throughput (messages per time unit):         %f\n", now > 0 ? ntolayer5 / now : 0.0);
+    printf("Events per message delivered:                %f\n", ntolayer5 > 0 ? (double) nevents / ntolayer5 : 0.0);
+    if (loopback != NULL) {
+        report_loopback();
+    }
+    if (drain && stream_bytes == 0) {
+        float completion = 0.0;
+        int refused = 0;
+
+        for (flow = 0; flow < nflows; flow++) {
+            if (flows[flow].done_at > completion) {
+                completion = flows[flow].done_at;
+            }
+            refused += flows[flow].refused;
+        }
+        printf("Completion time (last message delivered):    %f\n", completion);
+        printf("Goodput until then (messages per time unit): %f\n", completion > 0 ? (nsim - refused) / completion : 0.0);
+        printf("Messages dropped by a full send buffer:      %d\n", refused);
+    }
+    if (stream_bytes > 0) {
+        printf("Stream bytes delivered to layer 5:           %ld of %ld\n", stream_delivered, stream_bytes * nflows);
+        printf("Goodput (stream bytes per time unit):        %f\n", now > 0 ? stream_delivered / now : 0.0);
+        printf("Events per 1000 stream bytes delivered:      %f\n", stream_delivered > 0 ? 1000.0 * nevents / stream_delivered : 0.0);
+        printf("Stream bytes delivered out of place:         %ld\n", stream_misplaced);
+    }
+    printf("Bytes sent into layer 3:                     %ld\n", nbytes3);
+    printf("Share of those bytes that were headers:      %f%%\n", nbytes3 > 0 ? 100.0 * ntolayer3 * PKT_HEADER_SIZE / nbytes3 : 0.0);
+    printf("Packet buffers allocated:                    %d\n", nbufalloc);
+    printf("Payload bytes copied on corruption:          %ld\n", nbufcopied);
+    printf("Packets lost in media:                       %d\n", nlost);
+    printf("Packets corrupted by media:                  %d\n", ncorrupt);
+    if (reorderprob > 0 || dupprob > 0) {
+        printf("Packets reordered / duplicated by media:     %d / %d\n", nreordered, nduplicated);
+    }
+    for (i = B; i >= A; i--) {
+        if (impair_params[i].ge) {
+            struct impair_stats *ge = impair_stats(impair[i]);
+
+            printf("Gilbert-Elliott %s packets / bad / lost:   %ld / %ld / %ld\n", i == B ? "A->B" : "B->A", ge->packets, ge->bad, ge->lost);
+        }
+        if (impair_params[i].ber > 0) {
+            printf("Bits flipped %s:                           %ld\n", i == B ? "A->B" : "B->A", nbitflips[i]);
+        }
+    }
+    if (impair_params[A].ber > 0 || impair_params[B].ber > 0) {
+        printf("Packets dropped for a flipped length bit:    %d\n", nmalformed);
+    }
+    if (path_given) {
+        report_hops();
+    }
+    else if (nhops > 0) {
+        struct qdisc_stats *to_b = qdisc_stats(hops[0].queue[B]), *to_a = qdisc_stats(hops[0].queue[A]);
+
+        printf("Packets dropped at the bottleneck queue:     %ld\n", to_b->overflow + to_a->overflow);
+        printf("Packets dropped / marked by %-9s A->B:  %ld / %ld\n", qdisc_name, to_b->dropped, to_b->marked);
+        printf("Packets dropped / marked by %-9s B->A:  %ld / %ld\n", qdisc_name, to_a->dropped, to_a->marked);
+        report_queue_delay("A->B", 0, B);
+        report_queue_delay("B->A", 0, A);
+        printf("Link throughput A->B / B->A (bytes / time):  %f / %f\n", now > 0 ? hops[0].bytes[B] / now : 0.0,
+               now > 0 ? hops[0].bytes[A] / now : 0.0);
+        printf("Bottleneck utilization A->B:                 %f\n", link_utilization(0, B));
+        printf("Bottleneck utilization B->A:                 %f\n", link_utilization(0, A));
+    }
+    if (ecn) {
+        printf("Packets arrived marked congestion experienced: %d\n", nce);
+        printf("Windows cut for an ECN-Echo:                 %d\n", necnreduce);
+    }
+    // with several flows, the mean over them
+    printf("Congestion control %s final cwnd A->B:    %f\n", entities[A].sender.cc_algo->name, mean_cwnd(A));
+    if (bidirectional) {
+        printf("Congestion control %s final cwnd B->A:    %f\n", entities[B].sender.cc_algo->name, mean_cwnd(B));
+    }
+
+    /* Without piggybacking every ACK that rode on a data packet would have
+       needed a packet of its own. */
+    printf("Data packets retransmitted:                  %d\n", nretransmit);
+    printf("Fast retransmits:                            %d\n", nfastretransmit);
+    printf("Retransmissions the receiver already had:    %d\n", nduplicate);
+    printf("Data packets that arrived past a gap:        %d\n", nahead);
+    printf("NACKs sent:                                  %d\n", nnack);
+    printf("ACKs piggybacked on data packets:            %d\n", npiggyback);
+    printf("Packets sent only to carry an ACK or NACK:   %d\n", npureack);
+    if (ntolayer3 > 0) {
+        printf("Channel packets saved by piggybacking:       %f%%\n", 100.0 * npiggyback / (ntolayer3 + npiggyback));
+        printf("Channel bytes saved by piggybacking:         %lu of %lu\n",
+               (unsigned long) npiggyback * PKT_HEADER_SIZE, (unsigned long) (nbytes3 + npiggyback * PKT_HEADER_SIZE));
+    }
+
+    /* Packets an entity hands to layer 3 at the same instant arrive at the
+       link back to back; without pacing a timeout sends the whole window. */
+    for (i = 0; i < 2 * nflows; i++) {
+        record_burst(i);
+    }
+    for (i = A; i <= B; i++) {
+        int nbursts = 0;
+
+        for (j = 0; j < BURST_BUCKETS; j++) {
+            nbursts += burst_hist[i][j];
+        }
+        if (nbursts == 0) {
+            continue;
+        }
+        printf("Bursts from %c by size 1/2/3-4/5-8/../65+:    ", 'A' + i);
+        for (j = 0; j < BURST_BUCKETS; j++) {
+            printf("%d%s", burst_hist[i][j], j < BURST_BUCKETS - 1 ? " / " : "\n");
+        }
+        printf("Mean burst from %c (packets):                 %f\n", 'A' + i, (double) ntolayer3from[i] / nbursts);
+    }
+    if (pace_rate > 0 || pace_rtt) {
+        printf("Smoothed RTT at A / at B:                    %f / %f\n", mean_srtt(A), mean_srtt(B));
+    }
+
+    if (app_rate > 0) {
+        float zero_window_time = 0.0;
+
+        for (i = 0; i < 2 * nflows; i++) {
+            if (rwnd_packets(&entities[i].sender) == 0) {
+                entities[i].sender.zero_window_time += now - entities[i].sender.zero_window_since;
+            }
+            zero_window_time += entities[i].sender.zero_window_time;
+        }
+        printf("Packets dropped at the full app buffer:      %d\n", nrwnddrop);
+        printf("Zero-window probes sent:                     %d\n", nprobe);
+        printf("Window updates sent:                         %d\n", nwindowupdate);
+        printf("Time senders were stopped by a zero window:  %f\n", zero_window_time);
+    }
+
+    if (fec_k > 0) {
+        printf("FEC parity packets sent:                     %d\n", nparity);
+        printf("Lost data packets rebuilt from FEC parity:   %d\n", nfecrecovered);
+        int ndata = ntolayer3 - npureack - nparity;
+
+        printf("FEC overhead (parity / data packets sent):   %f%%\n", ndata > 0 ? 100.0 * nparity / ndata : 0.0);
+    }
+
+    // Latency from layer 5 down at the sender to layer 5 up at the receiver.
+    nlatency = 0;
+    for (i = 0; i < nmsgids; i++) {
+        if (msg_delivered[i]) {
+            msg_latency[nlatency++] = msg_latency[i];
+        }
+    }
+    if (nlatency > 0) {
+        double sum = 0.0;
+
+        qsort(msg_latency, nlatency, sizeof(float), compare_float);
+        for (i = 0; i < nlatency; i++) {
+            sum += msg_latency[i];
+        }
+        printf("Message latency mean:                        %f\n", sum / nlatency);
+        printf("Message latency p50 / p90 / p99:             %f / %f / %f\n",
+               msg_latency[nlatency / 2], msg_latency[nlatency * 9 / 10], msg_latency[nlatency * 99 / 100]);
+        printf("Message latency max:                         %f\n", msg_latency[nlatency - 1]);
+        if (loopback != NULL) {
+            printf("Message latency mean / p99 (microseconds):   %f / %f\n", 1e6 * loopback_unit * sum / nlatency,
+                   1e6 * loopback_unit * msg_latency[nlatency * 99 / 100]);
+        }
+    }
+    printf("Messages delivered twice or garbled:         %d\n", nmisdelivered);
+
+    if (nflows > 1 || flow_log != NULL) {
+        report_flows();
+    }
+
+    if (cwnd_file != NULL) {
+        fclose(cwnd_file);
+    }
+
+    exit(0);
+}
+
+
+// initialize the simulator
+void init() {
+    int i;
     float sum, avg;
     float jimsrand();
+    struct qdisc_params qdisc;
+    int h, codel = 0;
+
+    /* -r or -B make a path of one hop with the channel's delays. Through a
+       path given with -H the channel's delays are the hops' added up, and
+       the windows of several flows only as long as the shorter of the last
+       hops' towards A and towards B. */
+    if (!path_given && (bottleneck_rate > 0 || link_bandwidth > 0)) {
+        hops[0].rate = bottleneck_rate;
+        hops[0].bandwidth = link_bandwidth;
+        hops[0].delay_min = delay_min;
+        hops[0].delay_max = delay_max;
+        nhops = 1;
+    }
+    if (path_given) {
+        delay_min = delay_max = 0.0;
+        for (h = 0; h < nhops; h++) {
+            delay_min += hops[h].delay_min;
+            delay_max += hops[h].delay_max;
+        }
+    }
+    lookahead = path_given && hops[0].delay_min < hops[nhops - 1].delay_min ? hops[0].delay_min
+              : path_given ? hops[nhops - 1].delay_min : delay_min;
+    for (h = 0; h < nhops; h++) {
+        if (hops[h].capacity == 0) {
+            hops[h].capacity = queue_capacity;
+        }
+        if (hops[h].qdisc_name == NULL) {
+            hops[h].qdisc_name = qdisc_name;
+        }
+        if (hops[h].bandwidth > 0 || hops[h].rate > 0) {
+            codel |= strcmp(hops[h].qdisc_name, "codel") == 0 || strcmp(hops[h].qdisc_name, "fq_codel") == 0;
+        }
+    }
+
+    // CoDel's interval is about the longest round trip, its target a few percent of it (RFC 8289)
+    if (codel_interval == 0) {
+        codel_interval = delay_min + delay_max;
+    }
+    if (codel_target == 0) {
+        codel_target = codel_interval / 20;
+    }
+    if (reorder_mean == 0) {
+        reorder_mean = delay_max;
+    }
 
     printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
     printf("Messages to simulate:                        %d\n", nsimmax);
     printf("Packet loss probability:                     %f\n", lossprob);
     printf("Packet corruption probability:               %f\n", corruptprob);
+    if (channel_trace.n > 0) {
+        printf("Channel trace:                               %s\n", channel_trace_path);
+        printf("Channel trace packets / loss rate:           %d / %f\n", channel_trace.n, channel_trace.loss_rate);
+    }
+    for (i = B; i >= A; i--) {
+        struct impair_params *m = &impair_params[i];
+
+        if (m->ge) {
+            printf("Gilbert-Elliott %s p / r / good / bad:     %f / %f / %f / %f\n", i == B ? "A->B" : "B->A",
+                   m->ge_p, m->ge_r, m->ge_loss_good, m->ge_loss_bad);
+        }
+        if (m->ber > 0) {
+            printf("Bit error rate %s:                         %g\n", i == B ? "A->B" : "B->A", m->ber);
+        }
+    }
+    if (reorderprob > 0) {
+        printf("Reorder probability / mean delay:            %f / %f\n", reorderprob, reorder_mean);
+    }
+    if (dupprob > 0) {
+        printf("Duplication probability:                     %f\n", dupprob);
+    }
     printf("Time between messages from sender's layer5:  %f\n", lambda);
+    if (strcmp(workload->name, "uniform") != 0) {
+        printf("Workload:                                    %s\n", workload->name);
+    }
+    if (strcmp(workload->name, "onoff") == 0) {
+        printf("ON / OFF mean period / Pareto shape:         %f / %f / %f\n", onoff_on, onoff_off, onoff_alpha);
+    }
+    if (msg_trace_n > 0) {
+        printf("Message trace / messages in it:              %s / %d\n", msg_trace_path, msg_trace_n);
+    }
+    if (drain) {
+        printf("Run until every message is delivered:        %d\n", drain);
+    }
+    if (loopback_unit > 0) {
+        printf("Loopback runtime time unit (seconds):        %g\n", loopback_unit);
+    }
+    else {
+        printf("Channel delay min / max:                     %f / %f\n", delay_min, delay_max);
+    }
+    printf("Retransmission timeout:                      %f\n", rtx_timeout);
+    printf("Random seed:                                 %d\n", seed);
+    printf("Window size:                                 %d\n", window_size);
+    printf("Sequence number bits:                        %d\n", seqnum_bits);
+    printf("Congestion control:                          %s\n", cc_name);
+    printf("Checksum:                                    %s\n", checksum_name);
+    printf("Bidirectional:                               %d\n", bidirectional);
+    if (nflows > 1) {
+        printf("Flows sharing the link:                      %d\n", nflows);
+        printf("Worker threads running the flows:            %d\n", nworkers);
+    }
+    printf("ACK delay:                                   %f\n", ack_delay);
+    printf("ACK every in-order packets:                  %d\n", ack_every);
+    printf("Duplicate ACKs for fast retransmit:          %d\n", dupack_threshold);
+    if (fec_k > 0) {
+        printf("FEC data / parity packets per block:         %d / %d\n", fec_k, fec_m);
+    }
+    if (max_payload > MSG_SIZE || stream_bytes > 0) {
+        printf("Most payload bytes per packet:               %d\n", max_payload);
+        printf("Coalescing delay:                            %f\n", coalesce_delay);
+    }
+    if (stream_bytes > 0) {
+        printf("Byte stream from A (bytes):                  %ld\n", stream_bytes);
+    }
+    if (app_rate > 0) {
+        printf("Application rate (messages per time unit):   %f\n", app_rate);
+        printf("Application buffer (messages):               %d\n", app_buffer_size);
+    }
+    if (pace_rtt) {
+        printf("Pacing rate:                                 %.2f windows per smoothed RTT\n", PACING_GAIN);
+    }
+    else if (pace_rate > 0) {
+        printf("Pacing rate (packets per time unit):         %f\n", pace_rate);
+    }
+    if (bottleneck_rate > 0) {
+        printf("Bottleneck rate (packets per time unit):     %f\n", bottleneck_rate);
+        printf("Bottleneck queue capacity (packets):         %d\n", queue_capacity);
+    }
+    if (link_bandwidth > 0) {
+        /* What A must have in flight to keep the link busy: a full data
+           packet's round trip, sent, propagated and answered by an ACK. */
+        float rtt = (PKT_HEADER_SIZE + max_payload + PKT_HEADER_SIZE) / link_bandwidth + delay_min + delay_max;
+
+        printf("Link bandwidth (bytes per time unit):        %f\n", link_bandwidth);
+        printf("Link queue capacity (packets):               %d\n", queue_capacity);
+        printf("Bandwidth-delay product (bytes / packets):   %.0f / %f\n", link_bandwidth * rtt,
+               link_bandwidth * rtt / (PKT_HEADER_SIZE + max_payload));
+    }
+    if (bottleneck_rate > 0 || link_bandwidth > 0) {
+        printf("Queue discipline:                            %s\n", qdisc_name);
+    }
+    for (h = 0; h < nhops && path_given; h++) {
+        struct hop *hop = &hops[h];
+
+        printf("Hop %-2d bandwidth / delay min / max:          %f / %f / %f\n", h + 1, hop->bandwidth, hop->delay_min, hop->delay_max);
+        if (hop->bandwidth > 0) {
+            printf("Hop %-2d queue capacity / discipline:          %d / %s\n", h + 1, hop->capacity, hop->qdisc_name);
+        }
+        if (hop->impair.ge) {
+            printf("Hop %-2d Gilbert-Elliott p / r / good / bad:   %f / %f / %f / %f\n", h + 1,
+                   hop->impair.ge_p, hop->impair.ge_r, hop->impair.ge_loss_good, hop->impair.ge_loss_bad);
+        }
+        else if (hop->lossprob > 0) {
+            printf("Hop %-2d loss probability:                     %f\n", h + 1, hop->lossprob);
+        }
+    }
+    if (codel || strcmp(qdisc_name, "codel") == 0 || strcmp(qdisc_name, "fq_codel") == 0) {
+        printf("CoDel target / interval:                     %f / %f\n", codel_target, codel_interval);
+    }
+    if (ecn) {
+        printf("ECN:                                         on\n");
+    }
     printf("Debug level:                                 %d\n\n", TRACE);
     printf("-----------------------------------------------------------\n\n");
     printf("Press enter key to continue. ");
     getchar();
     printf("\n-----------------------------------------------------------\n\n");
 
-    srand(9999);               // init random number generator
+    srand(seed);               // init random number generator
     sum = (float)0.0;          // test random number generator for students
     for (i=0; i<1000; i++) {
         sum=sum+jimsrand();    // jimsrand() should be uniform in [0,1]
@@ -493,11 +3666,110 @@ void init() {
     }
 
     ntolayer3 = 0;
+    ntolayer3from[A] = ntolayer3from[B] = 0;
+    nbytes3 = 0;
+    nevents = 0;
+    ntolayer5 = 0;
     nlost = 0;
     ncorrupt = 0;
+    nmalformed = 0;
+    nreordered = 0;
+    nduplicated = 0;
+    // the seed picks where the replay starts, the two directions half the trace apart
+    if (channel_trace.n > 0) {
+        channel_trace_at[B] = seed % channel_trace.n;
+        channel_trace_at[A] = (seed + channel_trace.n / 2) % channel_trace.n;
+    }
+    for (i = 0; i < 2; i++) {
+        nbitflips[i] = 0;
+        if (impair_params[i].ge || impair_params[i].ber > 0) {
+            impair[i] = impair_create(&impair_params[i], (uint32_t) seed << 1 | i);
+        }
+    }
+
+    /* A hop's queue holds one packet less than its capacity, the one being
+       sent is off it. RED starts dropping at a quarter of the queue and
+       drops everything from three quarters. */
+    for (h = 0; h < nhops; h++) {
+        struct hop *hop = &hops[h];
+
+        qdisc.limit = hop->capacity - 1;
+        qdisc.nflows = nflows;
+        qdisc.mtu = PKT_HEADER_SIZE + max_payload;
+        qdisc.mtu_time = hop->bandwidth > 0 ? qdisc.mtu / hop->bandwidth : hop->rate > 0 ? 1 / hop->rate : 1;
+        qdisc.ecn = ecn;
+        qdisc.red_min = qdisc.limit / 4.0 > 1 ? qdisc.limit / 4.0 : 1;
+        qdisc.red_max = 3 * qdisc.limit / 4.0 > qdisc.red_min + 1 ? 3 * qdisc.limit / 4.0 : qdisc.red_min + 1;
+        qdisc.red_max_p = RED_MAX_P;
+        qdisc.red_weight = RED_WEIGHT;
+        qdisc.codel_target = codel_target;
+        qdisc.codel_interval = codel_interval;
+        qdisc.seed[0] = seed;
+        qdisc.seed[1] = 0x5245;
+        for (i = 0; i < 2; i++) {
+            qdisc.seed[2] = 2 * h + i;     // each hop and direction draws its own random numbers
+            if (hop->bandwidth > 0 || hop->rate > 0) {
+                hop->queue[i] = qdisc_create(hop->qdisc_name, &qdisc, link_drop, hop);
+            }
+            if (hop->impair.ge) {
+                hop->loss[i] = impair_create(&hop->impair, (uint32_t) seed << 5 | (h + 1) << 1 | i);
+            }
+        }
+    }
 
-    time=(float)0.0;         // initialize time to 0.0
-    generate_next_arrival(); // initialize event list
+    nmsgids = nflows * ((nsimmax + nflows - 1) / nflows);
+    msg_sent_at = (float *)malloc(nmsgids * sizeof(float));
+    msg_latency = (float *)malloc(nmsgids * sizeof(float));
+    msg_delivered = (char *)calloc(nmsgids, 1);
+    msg_flow = (int *)malloc(nmsgids * sizeof(int));
+    if (msg_sent_at == NULL || msg_latency == NULL || msg_delivered == NULL || msg_flow == NULL) {
+        printf("init: unable to allocate latency records for %d msgs\n", nsimmax);
+        exit(1);
+    }
+    for (i = 0; i < nmsgids; i++) {
+        msg_flow[i] = -1;
+    }
+    nmisdelivered = 0;
+
+    burst_at = (float *)malloc(2 * nflows * sizeof(float));
+    burst_len = (int *)calloc(2 * nflows, sizeof(int));
+    timer_event = (struct event **)calloc(2 * nflows * MAX_TIMERS, sizeof(struct event *));
+    arrival_at = (float *)calloc(2 * nflows, sizeof(float));
+    flows = (struct flow *)calloc(nflows, sizeof(struct flow));
+    pools = (struct pkt_pool *)calloc(nflows, sizeof(struct pkt_pool));
+    nqueues = nflows > 1 ? nworkers : 1;
+    queues = (struct evqueue *)calloc(nqueues, sizeof(struct evqueue));
+    if (burst_at == NULL || burst_len == NULL || timer_event == NULL || arrival_at == NULL || flows == NULL
+            || pools == NULL || queues == NULL) {
+        printf("init: unable to allocate %d flows\n", nflows);
+        exit(1);
+    }
+    for (i = 0; i < 2 * nflows; i++) {
+        burst_at[i] = -1.0;
+    }
+    for (i = 0; i < nflows; i++) {
+        flows[i].arrival_rand[0] = seed;
+        flows[i].arrival_rand[1] = i & 0xffff;
+        flows[i].arrival_rand[2] = i >> 16;
+        flows[i].channel_rand[0] = seed;
+        flows[i].channel_rand[1] = i & 0xffff;
+        flows[i].channel_rand[2] = (i >> 16) | 0x8000;
+    }
+    stream_delivered = stream_misplaced = 0;
+    nflows_done = 0;
+
+    now=(float)0.0;         // initialize time to 0.0
+
+    /* a byte stream is written by feed_stream() and a saturating source's
+       msgs by feed_msgs() instead of arriving */
+    if (stream_bytes == 0 && workload->gap != NULL) {
+        for (i = 0; i < nflows; i++) {
+            generate_next_arrival(i); // initialize event list
+        }
+    }
+    for (i = 0; i < nflows; i++) {
+        check_drained(i);       // a flow with no msgs at all
+    }
 }
 
 
@@ -515,224 +3787,679 @@ float jimsrand()
     return(x);
 }
 
+/* With several flows each draws from streams of its own, one for its
+   arrivals from layer 5 and one for what the channel does to its packets,
+   so what happens to a flow does not depend on which thread runs it. One
+   flow draws from jimsrand() as always. */
+float flow_rand(unsigned short stream[3])
+{
+    return nflows == 1 ? jimsrand() : (float) erand48(stream);
+}
+
+
+// A draw from the flow's arrival stream in (0,1], to take the log or a power of.
+double arrival_rand_open(int flow)
+{
+    double u = 1.0 - flow_rand(flows[flow].arrival_rand);
+
+    return u > 0 ? u : 1.0 / RAND_MAX;     // jimsrand() may give 1
+}
+
+// A Pareto distributed period with this mean, of the shape -W onoff gives.
+double pareto(int flow, float mean)
+{
+    double scale = mean * (onoff_alpha - 1) / onoff_alpha;
+
+    return scale / pow(arrival_rand_open(flow), 1.0 / onoff_alpha);
+}
+
+// The classic workload, uniform on [0,2*lambda] having mean of lambda.
+double uniform_gap(int flow)
+{
+    return lambda * flow_rand(flows[flow].arrival_rand)*2;
+}
+
+// Poisson arrivals, exponential gaps with mean lambda.
+double poisson_gap(int flow)
+{
+    return -lambda * log(arrival_rand_open(flow));
+}
+
+/* An on/off source: msgs come lambda * on / (on + off) apart during ON
+   periods and not at all during OFF periods, both Pareto distributed, so
+   on average lambda apart but in bursts with a heavy tail of long ones.
+   The first ON period starts with the first msg. */
+double onoff_gap(int flow)
+{
+    struct flow *f = &flows[flow];
+    double peak = lambda * onoff_on / (onoff_on + onoff_off);
+    double gap;
+
+    if (f->arrivals == 0) {
+        f->on_left = pareto(flow, onoff_on);
+    }
+    if (f->on_left >= peak) {
+        f->on_left -= peak;
+        return peak;
+    }
+    gap = f->on_left + pareto(flow, onoff_off);
+    f->on_left = pareto(flow, onoff_on);
+    return gap;
+}
+
+/* Replays the msg trace, every flow the same one, starting it over each
+   msg_trace_period once it is through. */
+double trace_gap(int flow)
+{
+    int k = flows[flow].arrivals;
+    double at = msg_trace_time[k % msg_trace_n] + (double) (k / msg_trace_n) * msg_trace_period;
+
+    return at > now ? at - now : 0.0;
+}
+
+// The same letter over and over, a different one for each msg.
+void letter_fill(int id, char *data)
+{
+    memset(data, 97 + id % 26, 12);
+}
+
+// Letters that differ from msg to msg and within one, from a xorshift of the id.
+void mixed_fill(int id, char *data)
+{
+    unsigned int x = (unsigned int) id * 2654435761u + 1;
+    int i;
+
+    for (i = 0; i < 12; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = 97 + x % 26;
+    }
+}
+
+// What the msg trace says for msg id, the flow's kth.
+void trace_fill(int id, char *data)
+{
+    memcpy(data, msg_trace_text[id / nflows % msg_trace_n], 12);
+}
+
+struct workload workloads[] = {
+    {"uniform",  uniform_gap, letter_fill},
+    {"poisson",  poisson_gap, mixed_fill},
+    {"onoff",    onoff_gap,   mixed_fill},
+    {"saturate", NULL,        mixed_fill},
+    {"trace",    trace_gap,   trace_fill},
+};
+
+struct workload *workload_lookup(char *name)
+{
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (strcmp(workloads[i].name, name) == 0) {
+            return &workloads[i];
+        }
+    }
+    return NULL;
+}
+
+/* Reads the msgs -W trace replays, a line for each: the time it comes down
+   from layer 5 and optionally what it says, up to 12 characters. The times
+   must not go back. '#' starts a comment. Returns 0, or -1 with a message
+   printed. */
+int read_msg_trace(char *path)
+{
+    char line[256];
+    FILE *file = fopen(path, "r");
+    int size = 0, lineno = 0, n, len;
+    float at;
+
+    if (file == NULL) {
+        printf("read_msg_trace: unable to open %s\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *hash = strchr(line, '#'), *text;
+        char rest;
+
+        lineno++;
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        if (sscanf(line, " %c", &rest) != 1) {
+            continue;
+        }
+        if (sscanf(line, "%f%n", &at, &n) != 1 || at < 0 || (msg_trace_n > 0 && at < msg_trace_time[msg_trace_n - 1])) {
+            printf("read_msg_trace: %s:%d: expected a time not negative and not before the one above\n", path, lineno);
+            fclose(file);
+            return -1;
+        }
+
+        if (msg_trace_n == size) {
+            size = size > 0 ? 2 * size : 1024;
+            msg_trace_time = (float *)realloc(msg_trace_time, size * sizeof(float));
+            msg_trace_text = (char (*)[12])realloc(msg_trace_text, size * sizeof(msg_trace_text[0]));
+            if (msg_trace_time == NULL || msg_trace_text == NULL) {
+                printf("read_msg_trace: unable to allocate %d msgs\n", size);
+                exit(1);
+            }
+        }
+        text = line + n + strspn(line + n, " \t");
+        len = strcspn(text, "\r\n");
+        while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t')) {
+            len--;
+        }
+        memset(msg_trace_text[msg_trace_n], ' ', 12);
+        memcpy(msg_trace_text[msg_trace_n], text, len < 12 ? len : 12);
+        msg_trace_time[msg_trace_n] = at;
+        msg_trace_n++;
+    }
+    fclose(file);
+
+    if (msg_trace_n == 0) {
+        printf("read_msg_trace: %s has no msgs\n", path);
+        return -1;
+    }
+    // one more of the mean gaps after the last msg before it starts over
+    msg_trace_period = msg_trace_time[msg_trace_n - 1]
+        + (msg_trace_n > 1 ? (msg_trace_time[msg_trace_n - 1] - msg_trace_time[0]) / (msg_trace_n - 1) : lambda);
+    return 0;
+}
+
 
 /********************* EVENT HANDLING ROUTINES *******
   The next set of routines handle the event list
  *****************************************************/
 
 
-void generate_next_arrival()
+// Schedules the next message from layer 5 of the flow.
+void generate_next_arrival(int flow)
 {
     double x;
     struct event *evptr;
 
     if (TRACE>2) {
-        printf("\tGENERATE NEXT ARRIVAL: creating new arrival\n");
+        trace_printf("\tGENERATE NEXT ARRIVAL: creating new arrival\n");
     }
 
-    x = lambda * jimsrand()*2;    /* x is uniform on [0,2*lambda]
-                                   having mean of lambda */
+    x = workload->gap(flow);
 
     evptr = (struct event *)malloc(sizeof(struct event));
-    evptr->evtime = time + x;
+    evptr->evtime = now + x;
     evptr->evtype = FROM_LAYER5;
 
-    if (BIDIRECTIONAL && (jimsrand() > 0.5)) {
-        evptr->eventity = B;
+    if (bidirectional && (flow_rand(flows[flow].arrival_rand) > 0.5)) {
+        evptr->eventity = 2 * flow + B;
     }
     else {
-        evptr->eventity = A;
+        evptr->eventity = 2 * flow + A;
+    }
+
+    insertevent(evptr);
+    flows[flow].next_arrival = flows[flow].arrivals++ < flow_msgs(flow) ? evptr : NULL;
+}
+
+
+// Whether event a is due before event b: the earlier one, the one of the lower flow, or the newer one.
+int event_before(struct event *a, struct event *b)
+{
+    return a->evtime < b->evtime || (a->evtime == b->evtime && ((a->eventity >> 1) < (b->eventity >> 1)
+           || ((a->eventity >> 1) == (b->eventity >> 1) && a->seq > b->seq)));
+}
+
+// The queue that holds the events of an entity.
+struct evqueue *queue_of(int AorB)
+{
+    return &queues[(AorB >> 1) % nqueues];
+}
+
+void evqueue_place(struct evqueue *queue, struct event *p, int i)
+{
+    queue->heap[i] = p;
+    p->heap_index = i;
+}
+
+// Moves the event at index i up or down the heap until it is in order again.
+void evqueue_fix(struct evqueue *queue, int i)
+{
+    struct event *p = queue->heap[i];
+    int parent, child;
+
+    while (i > 0 && event_before(p, queue->heap[parent = (i - 1) / 2])) {
+        evqueue_place(queue, queue->heap[parent], i);
+        i = parent;
+    }
+    while ((child = 2 * i + 1) < queue->n) {
+        if (child + 1 < queue->n && event_before(queue->heap[child + 1], queue->heap[child])) {
+            child++;
+        }
+        if (!event_before(queue->heap[child], p)) {
+            break;
+        }
+        evqueue_place(queue, queue->heap[child], i);
+        i = child;
+    }
+    evqueue_place(queue, p, i);
+}
+
+
+void insertevent(struct event *p)
+{
+    struct evqueue *queue = queue_of(p->eventity);
+
+    if (TRACE>2) {
+        trace_printf("\tINSERTEVENT: time is %lf\n",now);
+        trace_printf("\tINSERTEVENT: future time will be %lf\n",p->evtime);
+    }
+
+    if (queue->n == queue->size) {
+        queue->size = queue->size > 0 ? 2 * queue->size : 64;
+        queue->heap = (struct event **)realloc(queue->heap, queue->size * sizeof(struct event *));
+        if (queue->heap == NULL) {
+            printf("insertevent: unable to allocate room for %d events\n", queue->size);
+            exit(1);
+        }
+    }
+
+    p->seq = flows[p->eventity >> 1].nevinserted++;
+    evqueue_place(queue, p, queue->n++);
+    evqueue_fix(queue, p->heap_index);
+}
+
+
+// Takes event p off the event list, wherever it is.
+void removeevent(struct event *p)
+{
+    struct evqueue *queue = queue_of(p->eventity);
+    int i = p->heap_index;
+
+    queue->n--;
+    if (i < queue->n) {
+        evqueue_place(queue, queue->heap[queue->n], i);
+        evqueue_fix(queue, i);
+    }
+}
+
+
+// Prints the pending events, in heap order rather than by time.
+void printevlist()
+{
+    struct event *q;
+    int i, j;
+
+    printf("--------------\nEvent List Follows:\n");
+
+    for (i = 0; i < nqueues; i++) {
+        for (j = 0; j < queues[i].n; j++) {
+            q = queues[i].heap[j];
+            printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+        }
     }
 
-    insertevent(evptr);
+    printf("--------------\n");
+}
+
+
+//********************** STUDENT-CALLABLE ROUTINES ***********************
+
+
+// current simulated time, for protocols that need a clock
+float simtime()
+{
+    return now;
 }
 
 
-void insertevent(struct event *p)
+/* Prints to out, stdout for trace_printf(). On a worker thread the text is
+   kept with the event being run until the end of the window. */
+void trace_vfprintf(FILE *out, const char *format, va_list args)
 {
-    struct event *q,*qold;
+    struct worker *w = self;
+    struct piece *piece;
+    va_list again;
+    int len;
 
-    if (TRACE>2) {
-        printf("\tINSERTEVENT: time is %lf\n",time);
-        printf("\tINSERTEVENT: future time will be %lf\n",p->evtime);
+    if (w == NULL) {
+        vfprintf(out, format, args);
+        return;
     }
 
-    q = evlist;     // q points to header of list in which p struct inserted
-    if (q==NULL) {  // list is empty
-        evlist=p;
-        p->next=NULL;
-        p->prev=NULL;
-    }
-    else {
-        for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next) {
-            qold=q;
+    va_copy(again, args);
+    len = vsnprintf(w->text + w->ntext, w->text_size - w->ntext, format, args);
+    if (len >= 0 && (size_t) len >= w->text_size - w->ntext) {
+        while ((size_t) len >= w->text_size - w->ntext) {
+            w->text_size *= 2;
         }
-        if (q==NULL) {          // end of list
-            qold->next = p;
-            p->prev = qold;
-            p->next = NULL;
-        }
-        else if (q==evlist) {   // front of list
-            p->next=evlist;
-            p->prev=NULL;
-            p->next->prev=p;
-            evlist = p;
-        }
-        else {                  // middle of list
-            p->next=q;
-            p->prev=q->prev;
-            q->prev->next=p;
-            q->prev=p;
+        w->text = (char *)realloc(w->text, w->text_size);
+        if (w->text == NULL) {
+            printf("trace_vfprintf: unable to allocate %lu bytes of output\n", (unsigned long) w->text_size);
+            exit(1);
         }
+        vsnprintf(w->text + w->ntext, w->text_size - w->ntext, format, again);
+    }
+    va_end(again);
+    if (len <= 0) {
+        return;
     }
-}
 
+    piece = w->npieces > 0 ? &w->pieces[w->npieces - 1] : NULL;
+    if (piece == NULL || piece->out != out || piece->flow != w->flow || piece->seq != w->seq) {
+        piece = new_piece(w, out);
+    }
+    piece->len += len;
+    w->ntext += len;
+}
 
-void printevlist()
+void trace_printf(const char *format, ...)
 {
-    struct event *q;
-
-    printf("--------------\nEvent List Follows:\n");
-
-    for(q = evlist; q!=NULL; q=q->next) {
-        printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
-    }
+    va_list args;
 
-    printf("--------------\n");
+    va_start(args, format);
+    trace_vfprintf(stdout, format, args);
+    va_end(args);
 }
 
+void trace_fprintf(FILE *out, const char *format, ...)
+{
+    va_list args;
 
-//********************** STUDENT-CALLABLE ROUTINES ***********************
+    va_start(args, format);
+    trace_vfprintf(out, format, args);
+    va_end(args);
+}
 
 
 // called by students routine to cancel a previously-started timer
 void stoptimer(int AorB)  // A or B is trying to stop timer
 {
-    struct event *q;
+    stop_timer(AorB, 0);
+}
+
+void starttimer(int AorB, float increment)  // A or B is trying to start timer
+{
+    start_timer(AorB, 0, increment);
+}
+
+/* Each entity has several independent timers. Timer 0 is the one
+   starttimer()/stoptimer() use and goes off in A/B_timerinterrupt(), the
+   others go off in A/B_timer(). */
+void stop_timer(int AorB, int timer)
+{
+    struct event **q;
 
     if (TRACE>2) {
-        printf("\tSTOP TIMER: stopping timer at %f\n",time);
+        trace_printf("\tSTOP TIMER: stopping timer %d at %f\n",timer,now);
     }
 
-    for (q=evlist; q!=NULL; q = q->next) {
-        if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) {
-            // remove this event
-            if (q->next==NULL && q->prev==NULL) {   // remove first and only event on list
-                evlist=NULL;
-            }
-            else if (q->next==NULL) {               // end of list - there is one in front
-                q->prev->next = NULL;
-            }
-            else if (q==evlist) {                   // front of list - there must be event after
-                q->next->prev=NULL;
-                evlist = q->next;
-            }
-            else {                                  // middle of list
-                q->next->prev = q->prev;
-                q->prev->next = q->next;
-            }
-
-        free(q);
+    if (timer < 0 || timer >= MAX_TIMERS || *(q = &timer_event[AorB * MAX_TIMERS + timer]) == NULL) {
+        trace_printf("Warning: unable to cancel your timer. It wasn't running.\n");
         return;
-        }
     }
-    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+
+    removeevent(*q);
+    free(*q);
+    *q = NULL;
 }
 
-void starttimer(int AorB, float increment)  // A or B is trying to start timer
+void start_timer(int AorB, int timer, float increment)
 {
-    struct event *q;
     struct event *evptr;
 
     if (TRACE>2) {
-        printf("\tSTART TIMER: starting timer at %f\n",time);
+        trace_printf("\tSTART TIMER: starting timer %d at %f\n",timer,now);
+    }
+
+    if (timer < 0 || timer >= MAX_TIMERS) {
+        trace_printf("Warning: there is no timer %d, only %d per entity\n", timer, MAX_TIMERS);
+        return;
     }
 
     // be nice: check to see if timer is already started, if so, then warn
-    for (q=evlist; q!=NULL; q = q->next) {
-        if ( (q->evtype==TIMER_INTERRUPT && q->eventity==AorB) ) {
-            printf("Warning: attempt to start a timer that is already started\n");
-            return;
-        }
+    if (timer_event[AorB * MAX_TIMERS + timer] != NULL) {
+        trace_printf("Warning: attempt to start a timer that is already started\n");
+        return;
     }
 
     // create future event for when timer goes off
     evptr = (struct event *)malloc(sizeof(struct event));
-    evptr->evtime = time + increment;
+    evptr->evtime = now + increment;
     evptr->evtype = TIMER_INTERRUPT;
     evptr->eventity = AorB;
+    evptr->timer = timer;
     insertevent(evptr);
+    timer_event[AorB * MAX_TIMERS + timer] = evptr;
 }
 
 /************************** TOLAYER3 ***************/
 
 
-void tolayer3(int AorB, struct pkt packet)  // A or B is trying to stop timer
+// Files the burst of packets entity AorB has been sending under its size.
+void record_burst(int AorB)
+{
+    int bucket = 0;
+
+    if (burst_len[AorB] == 0) {
+        return;
+    }
+    while (bucket < BURST_BUCKETS - 1 && (1 << bucket) < burst_len[AorB]) {
+        bucket++;
+    }
+    burst_hist[AorB & 1][bucket]++;
+    burst_len[AorB] = 0;
+}
+
+
+void tolayer3(int AorB, struct pkt *packet)
 {
     struct pkt *mypktptr;
-    struct event *evptr,*q;
-    float lastime, x, jimsrand();
-    int i;
+    struct piece *piece;
 
     ntolayer3++;
+    ntolayer3from[AorB & 1]++;
+    flows[AorB >> 1].packets++;
+    nbytes3 += PKT_HEADER_SIZE + packet->length;
+
+    if (now != burst_at[AorB]) {
+        record_burst(AorB);
+        burst_at[AorB] = now;
+    }
+    burst_len[AorB]++;
+
+    /* make a copy of the packet student just gave me since they may decide
+       to do something with the packet after we return back to them. Only
+       the header is copied, the payload is shared until someone writes it */
+    mypktptr = (struct pkt *)malloc(sizeof(struct pkt));
+    mypktptr->buf = NULL;
+    pkt_hold(mypktptr, packet);
+
+    // a worker leaves the channel to the main thread, at the end of the window
+    if (self != NULL) {
+        piece = new_piece(self, NULL);
+        piece->AorB = AorB;
+        piece->packet = mypktptr;
+        return;
+    }
+
+    forward_packet(AorB, mypktptr);
+}
+
+
+/* The channel: loses, queues at the hops of the path, delays and corrupts the
+   copy of a packet entity AorB handed to layer 3 at the current time. */
+void forward_packet(int AorB, struct pkt *mypktptr)
+{
+    struct event *evptr;
+    float lastime, x, late, delay = 0;
+    int i, reorder;
+    int dest = AorB ^ 1;        // the other end of the same flow
+    unsigned short *channel_rand = flows[AorB >> 1].channel_rand;
 
     // simulate losses
-    if (jimsrand() < lossprob)  {
+    if (channel_trace.n > 0 ? replay_channel(dest & 1, &delay)
+        : impair_params[dest & 1].ge ? impair_lose(impair[dest & 1]) : flow_rand(channel_rand) < lossprob)  {
         nlost++;
 
         if (TRACE>0) {
             printf("\tTOLAYER3: packet being lost\n");
         }
+        pkt_release(mypktptr);
+        free(mypktptr);
         return;
     }
 
-    /* make a copy of the packet student just gave me since they may decide
-       to do something with the packet after we return back to them */
-    mypktptr = (struct pkt *)malloc(sizeof(struct pkt));
-    mypktptr->seqnum = packet.seqnum;
-    mypktptr->acknum = packet.acknum;
-    mypktptr->checksum = packet.checksum;
-
-    for (i=0; i<20; i++) {
-        mypktptr->payload[i] = packet.payload[i];
-    }
-
     if (TRACE>2) {
         printf("\tTOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
         mypktptr->acknum,  mypktptr->checksum);
 
-        for (i=0; i<20; i++) {
+        for (i=0; i<mypktptr->length && i<MSG_SIZE; i++) {
             printf("%c",mypktptr->payload[i]);
         }
         printf("\n");
     }
 
+    // the loopback runtime's channel is the kernel's, which takes the time it takes
+    if (loopback != NULL) {
+        loopback_forward(AorB, mypktptr);
+        return;
+    }
+
+    // on a path of hops the packet waits in their queues, the wire has it once it is sent
+    if (nhops > 0) {
+        link_enqueue(AorB, mypktptr);
+        return;
+    }
+
     // create future event for arrival of packet at the other side
     evptr = (struct event *)malloc(sizeof(struct event));
     evptr->evtype =  FROM_LAYER3;       // packet will pop out from layer3
-    evptr->eventity = (AorB+1) % 2;     // event occurs at other entity
+    evptr->eventity = dest;             // event occurs at other entity
     evptr->pktptr = mypktptr;           // save ptr to my copy of packet
 
     /* finally, compute the arrival time of packet at the other end.
-       medium can not reorder, so make sure packet arrives between 1 and 10
-       time units after the latest arrival time of packets
-       currently in the medium on their way to the destination */
-    lastime = time;
+       medium does not reorder unless told to, so make sure packet arrives
+       between delay_min and delay_max time units after the latest arrival
+       time of packets currently in the medium on their way to the
+       destination. Arrivals already past are before now anyway, so the
+       latest one scheduled will do. A packet that is reordered does not
+       wait for them, and the ones after it do not wait for it. A replayed
+       delay is the whole time the packet took in the capture, so it only
+       waits for the packets in front to arrive first */
+    x = flow_rand(channel_rand);
+    reorder = reordered(channel_rand, &late);
+    if (reorder) {
+        evptr->evtime = now + delay_min + (delay_max - delay_min)*x + late;
+    }
+    else if (channel_trace.n > 0) {
+        evptr->evtime = now + delay > arrival_at[dest] ? now + delay : arrival_at[dest];
+    }
+    else {
+        lastime = arrival_at[dest] > now ? arrival_at[dest] : now;
+        evptr->evtime =  lastime + delay_min + (delay_max - delay_min)*x;
+    }
 
-    for (q=evlist; q!=NULL ; q = q->next) {
-        if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) {
-            lastime = q->evtime;
-        }
+    if (dupprob > 0 && flow_rand(channel_rand) < dupprob) {
+        duplicate_packet(dest, mypktptr, now, delay_min, delay_max, channel_rand);
+    }
+
+    if (corrupt_packet(dest, mypktptr, channel_rand)) {
+        pkt_release(mypktptr);
+        free(mypktptr);
+        free(evptr);
+        return;
+    }
+    if (!reorder) {
+        arrival_at[dest] = evptr->evtime;
+    }
+
+    if (TRACE>2) {
+        printf("\tTOLAYER3: scheduling arrival on other side\n");
+    }
+
+    insertevent(evptr);
+}
+
+
+/* With -X each packet towards the A or B entities takes the fate of the
+   next packet of the trace in turn, from where the seed started that
+   direction: lost, or its delay. Returns whether it is lost. */
+int replay_channel(int link, float *delay)
+{
+    int i = channel_trace_at[link];
+
+    channel_trace_at[link] = (i + 1) % channel_trace.n;
+    *delay = channel_trace.delay[i];
+    return channel_trace.lost[i];
+}
+
+/* With -O a packet is held up on the way, by an extra delay exponential
+   with mean reorder_mean, and the packets behind it overtake it. Returns
+   whether this one is, with the extra delay in late. */
+int reordered(unsigned short *channel_rand, float *late)
+{
+    float x;
+
+    if (reorderprob <= 0 || flow_rand(channel_rand) >= reorderprob) {
+        return 0;
+    }
+    x = 1 - flow_rand(channel_rand);   // in (0, 1] unless jimsrand() gave 1
+    *late = -reorder_mean * log(x > 0 ? x : 1e-7);
+    nreordered++;
+
+    if (TRACE>0) {
+        printf("\tTOLAYER3: packet being held up by %f\n", *late);
+    }
+    return 1;
+}
+
+/* Sends a copy of the packet on to dest as well, leaving at time at. The
+   copy takes a way of its own through the channel: its own delay between
+   min and max, with no regard for the packets around it, and its own
+   corruption. */
+void duplicate_packet(int dest, struct pkt *mypktptr, float at, float min, float max, unsigned short *channel_rand)
+{
+    struct event *evptr = (struct event *)malloc(sizeof(struct event));
+    struct pkt *copy = (struct pkt *)malloc(sizeof(struct pkt));
+
+    copy->buf = NULL;
+    pkt_hold(copy, mypktptr);
+    nduplicated++;
+
+    if (TRACE>0) {
+        printf("\tTOLAYER3: packet being duplicated\n");
+    }
+
+    evptr->evtype = FROM_LAYER3;
+    evptr->eventity = dest;
+    evptr->pktptr = copy;
+    evptr->evtime = at + min + (max - min)*flow_rand(channel_rand);
+
+    if (corrupt_packet(dest, copy, channel_rand)) {
+        pkt_release(copy);
+        free(copy);
+        free(evptr);
+        return;
     }
+    insertevent(evptr);
+}
 
-    evptr->evtime =  lastime + 1 + 9*jimsrand();
+/* Damages the packet on its way to entity dest: with probability
+   corruptprob in its payload if it has one, or bit by bit with -e. Returns
+   1 if it is too damaged to arrive at all. */
+int corrupt_packet(int dest, struct pkt *mypktptr, unsigned short *channel_rand)
+{
+    float x;
+
+    if (impair_params[dest & 1].ber > 0) {
+        return flip_bits(dest & 1, mypktptr);
+    }
 
-    // simulate corruption
-    if (jimsrand() < corruptprob) {
+    if (flow_rand(channel_rand) < corruptprob) {
         ncorrupt++;
-        if ((x = jimsrand()) < .75) {
+        if ((x = flow_rand(channel_rand)) < .75 && mypktptr->length > 0) {
+            pkt_unshare(mypktptr);     // the sender's copy stays intact
             mypktptr->payload[0]='Z';  // corrupt payload
         }
+        else if (x < .75) {
+            mypktptr->acknum = 999999; // no payload to corrupt
+        }
         else if (x < .875) {
             mypktptr->seqnum = 999999;
         }
@@ -744,6 +4471,197 @@ void tolayer3(int AorB, struct pkt packet)  // A or B is trying to stop timer
             printf("\tTOLAYER3: packet being corrupted\n");
         }
     }
+    return 0;
+}
+
+/* Flips the bits the bit errors hit in the packet as it is on the wire,
+   its header fields and then its payload. A packet whose length no longer
+   matches what was sent cannot be taken apart and is dropped: returns 1. */
+int flip_bits(int link, struct pkt *mypktptr)
+{
+    unsigned header[] = { mypktptr->seqnum, mypktptr->acknum, mypktptr->checksum, mypktptr->fec,
+                          mypktptr->rwnd, mypktptr->length, mypktptr->fec_length };
+    long header_bits = 8 * sizeof(header);
+    long nbits = header_bits + 8L * mypktptr->length;
+    long bit = impair_skip(impair[link]);
+    int flips = 0;
+
+    for (; bit < nbits; bit += 1 + impair_skip(impair[link])) {
+        if (bit < header_bits) {
+            header[bit / 32] ^= 1u << (bit % 32);
+        }
+        else {
+            pkt_unshare(mypktptr);     // the sender's copy stays intact
+            mypktptr->payload[(bit - header_bits) / 8] ^= 1 << ((bit - header_bits) % 8);
+        }
+        flips++;
+    }
+    if (flips == 0) {
+        return 0;
+    }
+
+    ncorrupt++;
+    nbitflips[link] += flips;
+    if (TRACE>0) {
+        printf("\tTOLAYER3: packet being corrupted, %d bits flipped\n", flips);
+    }
+
+    if ((int) header[5] != mypktptr->length) {
+        nmalformed++;
+        if (TRACE>0) {
+            printf("\tTOLAYER3: length damaged, packet being dropped\n");
+        }
+        return 1;
+    }
+    mypktptr->seqnum = header[0];
+    mypktptr->acknum = header[1];
+    mypktptr->checksum = header[2];
+    mypktptr->fec = header[3];
+    mypktptr->rwnd = header[4];
+    mypktptr->fec_length = header[6];
+    return 0;
+}
+
+
+/* Hands a packet from entity AorB to the first hop of the path towards the
+   other end. */
+void link_enqueue(int AorB, struct pkt *mypktptr)
+{
+    struct queued *qp = (struct queued *)malloc(sizeof(struct queued));
+
+    qp->q.flow = AorB >> 1;
+    qp->AorB = AorB;
+    qp->packet = mypktptr;
+    hop_arrive(((AorB ^ 1) & 1) == B ? 0 : nhops - 1, qp);
+}
+
+/* The packet comes to hop h, which may lose it. Otherwise it is sent after
+   the packets the hop's discipline puts in front of it. An idle link, or a
+   hop that does not queue, sends it at once. */
+void hop_arrive(int h, struct queued *qp)
+{
+    struct hop *hop = &hops[h];
+    int link = (qp->AorB ^ 1) & 1;  // all flows share the hop in each direction
+    unsigned short *channel_rand = flows[qp->AorB >> 1].channel_rand;
+
+    if (hop->impair.ge ? impair_lose(hop->loss[link]) : hop->lossprob > 0 && flow_rand(channel_rand) < hop->lossprob) {
+        nlost++;
+        hop->lost[link]++;
+
+        if (TRACE>0) {
+            printf("\tTOLAYER3: packet being lost at hop %d\n", h + 1);
+        }
+        pkt_release(qp->packet);
+        free(qp->packet);
+        free(qp);
+        return;
+    }
+
+    qp->q.size = PKT_HEADER_SIZE + qp->packet->length;
+    qp->q.ect = (qp->packet->ecn & ECN_ECT) != 0;
+    qp->q.ce = (qp->packet->ecn & ECN_CE) != 0;
+    qp->hop = h;
+
+    if (hop->queue[link] == NULL || (hop->free_at[link] <= now && qdisc_length(hop->queue[link]) == 0)) {
+        qp->q.enqueued_at = now;
+        link_send(h, qp);
+        return;
+    }
+    qdisc_enqueue(hop->queue[link], &qp->q, now);
+    queue_depth(h, link);
+}
+
+/* Puts a packet taken from the queue of hop h on the wire, now. It
+   forwards rate packets per time unit, or bandwidth bytes so a packet
+   takes as long as its size to send, or at once if it does not queue. On
+   the way to the next hop it is delayed by propagation, behind the packets
+   it sent before. After the last hop it arrives at the other end, delayed
+   and corrupted as without a path. */
+void link_send(int h, struct queued *qp)
+{
+    struct hop *hop = &hops[h];
+    struct event *evptr;
+    float service = hop->bandwidth > 0 ? qp->q.size / hop->bandwidth : hop->rate > 0 ? 1 / hop->rate : 0;
+    float departure = now + service;
+    float lastime, delay, late;
+    int reorder, next;
+    int link = (qp->AorB ^ 1) & 1;
+    int dest = qp->AorB ^ 1;
+    unsigned short *channel_rand = flows[qp->AorB >> 1].channel_rand;
+
+    hop->free_at[link] = departure;
+    hop->busy[link] += service;
+    hop->bytes[link] += qp->q.size;
+    if (hop->queue[link] != NULL) {
+        if (hop->nqueue_delay[link] == hop->queue_delay_size[link]) {
+            hop->queue_delay_size[link] = hop->queue_delay_size[link] > 0 ? 2 * hop->queue_delay_size[link] : 1024;
+            hop->queue_delay[link] = (float *)realloc(hop->queue_delay[link], hop->queue_delay_size[link] * sizeof(float));
+            if (hop->queue_delay[link] == NULL) {
+                printf("link_send: unable to record %d queue delays\n", hop->queue_delay_size[link]);
+                exit(1);
+            }
+        }
+        hop->queue_delay[link][hop->nqueue_delay[link]++] = now - qp->q.enqueued_at;
+    }
+
+    if (qp->q.ce && !(qp->packet->ecn & ECN_CE)) {
+        qp->packet->ecn |= ECN_CE;
+        if (TRACE>0) {
+            printf("\tTOLAYER3: packet marked congestion experienced\n");
+        }
+    }
+
+    delay = hop->delay_min + (hop->delay_max - hop->delay_min)*flow_rand(channel_rand);
+
+    // links do not reorder, the packet reaches the next hop after the ones it sent before
+    next = link == B ? h + 1 : h - 1;
+    if (next >= 0 && next < nhops) {
+        qp->at = departure + delay > hop->arrive_at[link] ? departure + delay : hop->arrive_at[link];
+        hop->arrive_at[link] = qp->at;
+        qp->hop = next;
+        transit_push(qp);
+        return;
+    }
+
+    evptr = (struct event *)malloc(sizeof(struct event));
+    evptr->evtype =  FROM_LAYER3;
+    evptr->eventity = dest;
+    evptr->pktptr = qp->packet;
+
+    /* A link only delays a packet by propagation once it is sent, the
+       packets in front hold it up at the sender's end of the link. It
+       still arrives after them. A bottleneck by rate keeps the medium's
+       spacing of arrivals instead. */
+    reorder = reordered(channel_rand, &late);
+    if (reorder) {
+        evptr->evtime = departure + delay + late;
+    }
+    else if (hop->rate == 0) {
+        evptr->evtime = departure + delay;
+        if (evptr->evtime < arrival_at[dest]) {
+            evptr->evtime = arrival_at[dest];
+        }
+    }
+    else {
+        lastime = arrival_at[dest] > departure ? arrival_at[dest] : departure;
+        evptr->evtime = lastime + delay;
+    }
+    free(qp);
+
+    // a copy made past the last hop, it takes no time on the link
+    if (dupprob > 0 && flow_rand(channel_rand) < dupprob) {
+        duplicate_packet(dest, evptr->pktptr, departure, hop->delay_min, hop->delay_max, channel_rand);
+    }
+
+    if (corrupt_packet(dest, evptr->pktptr, channel_rand)) {
+        pkt_release(evptr->pktptr);
+        free(evptr->pktptr);
+        free(evptr);
+        return;
+    }
+    if (!reorder) {
+        arrival_at[dest] = evptr->evtime;
+    }
 
     if (TRACE>2) {
         printf("\tTOLAYER3: scheduling arrival on other side\n");
@@ -752,18 +4670,202 @@ void tolayer3(int AorB, struct pkt packet)  // A or B is trying to stop timer
     insertevent(evptr);
 }
 
+// The discipline of a hop gives up a packet, by dropping it or because its queue is full.
+void link_drop(struct qpkt *q, void *arg)
+{
+    struct queued *qp = (struct queued *)q;
+
+    if (TRACE>0) {
+        if (path_given) {
+            printf("\tTOLAYER3: packet being dropped at hop %d\n", (int) ((struct hop *)arg - hops) + 1);
+        }
+        else {
+            printf("\tTOLAYER3: packet being dropped at the bottleneck\n");
+        }
+    }
+    pkt_release(qp->packet);
+    free(qp->packet);
+    free(qp);
+}
+
+// The queue of hop h towards link changed: adds up its depth until now and takes the new one.
+void queue_depth(int h, int link)
+{
+    struct hop *hop = &hops[h];
+
+    if (now > hop->depth_since[link]) {
+        hop->depth_area[link] += hop->depth[link] * (double) (now - hop->depth_since[link]);
+        hop->depth_since[link] = now;
+    }
+    hop->depth[link] = qdisc_length(hop->queue[link]);
+    if (hop->depth[link] > hop->max_depth[link]) {
+        hop->max_depth[link] = hop->depth[link];
+    }
+}
+
+int transit_before(struct queued *a, struct queued *b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+// Puts a packet sent by a hop on its way to the next one, due at qp->at.
+void transit_push(struct queued *qp)
+{
+    int i, parent;
+
+    if (ntransit == transit_size) {
+        transit_size = transit_size > 0 ? 2 * transit_size : 64;
+        transit = (struct queued **)realloc(transit, transit_size * sizeof(struct queued *));
+        if (transit == NULL) {
+            printf("transit_push: unable to allocate room for %d packets\n", transit_size);
+            exit(1);
+        }
+    }
+    qp->seq = ntransit_sent++;
+    for (i = ntransit++; i > 0 && transit_before(qp, transit[parent = (i - 1) / 2]); i = parent) {
+        transit[i] = transit[parent];
+    }
+    transit[i] = qp;
+}
+
+// Takes the packet that reaches its next hop first off its way there.
+struct queued *transit_pop()
+{
+    struct queued *first = transit[0], *last = transit[--ntransit];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < ntransit) {
+        if (child + 1 < ntransit && transit_before(transit[child + 1], transit[child])) {
+            child++;
+        }
+        if (!transit_before(transit[child], last)) {
+            break;
+        }
+        transit[i] = transit[child];
+        i = child;
+    }
+    transit[i] = last;
+    return first;
+}
+
+/* What the path does first, and when, -1 if nothing is waiting: a hop with
+   a packet waiting is done sending, 2 * hop + link, or a packet reaches its
+   next hop, TRANSIT_STEP. */
+int link_next(float *when)
+{
+    int step = -1;
+
+    for (int h = 0; h < nhops; h++) {
+        for (int i = 0; i < 2; i++) {
+            if (hops[h].queue[i] != NULL && qdisc_length(hops[h].queue[i]) > 0 && (step < 0 || hops[h].free_at[i] < *when)) {
+                step = 2 * h + i;
+                *when = hops[h].free_at[i];
+            }
+        }
+    }
+    if (ntransit > 0 && (step < 0 || transit[0]->at <= *when)) {
+        step = TRANSIT_STEP;
+        *when = transit[0]->at;
+    }
+    return step;
+}
+
+/* Takes the step: a packet comes to its next hop, or a hop is done
+   sending and takes the next packet its discipline gives it. */
+void link_step(int step)
+{
+    struct hop *hop;
+    struct queued *qp;
+    int link = step & 1;
+
+    if (step == TRANSIT_STEP) {
+        qp = transit_pop();
+        now = qp->at;
+        hop_arrive(qp->hop, qp);
+        return;
+    }
+    hop = &hops[step >> 1];
+    now = hop->free_at[link];
+    qp = (struct queued *)qdisc_dequeue(hop->queue[link], now);
+    queue_depth(step >> 1, link);
+    if (qp != NULL) {
+        link_send(step >> 1, qp);
+    }
+}
+
+/* Lets the path send the packets it has waiting up to time until, or only
+   before it, in time order. */
+void link_run(float until, int before)
+{
+    float when;
+    int step;
+
+    while ((step = link_next(&when)) >= 0 && (before ? when < until : when <= until)) {
+        link_step(step);
+    }
+}
+
+
+int compare_float(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+
+    return (x > y) - (x < y);
+}
+
 
-void tolayer5(char datasent[20])
+// Called by entity AorB with a message of its flow.
+void tolayer5(int AorB, char datasent[20])
 {
     int i;
+    int id = 0;
+    int flow = AorB >> 1;
+
+    ntolayer5++;
+
+    // the last 8 characters of each message are its id, see run_event()
+    for (i=12; i<20 && datasent[i] >= '0' && datasent[i] <= '9'; i++) {
+        id = id * 10 + (datasent[i] - '0');
+    }
+    if (i < 20 || id >= nmsgids || msg_flow[id] != flow || msg_delivered[id]) {
+        nmisdelivered++;
+    }
+    else {
+        msg_delivered[id] = 1;
+        msg_latency[id] = now - msg_sent_at[id];
+        flows[flow].delivered++;
+        flows[flow].latency += now - msg_sent_at[id];
+        check_drained(flow);
+    }
 
     if (TRACE>2) {
-        printf("\tTOLAYER5: data received: ");
+        trace_printf("\tTOLAYER5: data received: ");
     }
 
-    for (i=0; i<20; i++) {
-        printf("%c",datasent[i]);
+    trace_printf("%.20s\n", datasent);
+}
+
+
+// Called by entity AorB with the next piece of its flow's byte stream, checks it against the stream at its offset.
+void tolayer5_bytes(int AorB, char *data, int length)
+{
+    struct flow *f = &flows[AorB >> 1];
+    int i;
+
+    for (i=0; i<length; i++) {
+        if (data[i] != stream_byte(f->stream_delivered + i)) {
+            stream_misplaced++;
+        }
+    }
+    stream_delivered += length;
+    f->stream_delivered += length;
+    if (f->stream_delivered >= stream_bytes && !f->done) {
+        f->done_at = now;
+        f->done = 1;
+        nflows_done++;
     }
 
-    printf("\n");
+    if (TRACE>2) {
+        trace_printf("\tTOLAYER5: %d stream bytes received, %ld so far\n", length, f->stream_delivered);
+    }
 }
@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h> // for malloc, qsort
+#include <string.h>
+#include <math.h>   // for pow, sqrt
+#include <pthread.h>
+#include <unistd.h> // for getopt, sysconf
+
+#include "chantrace.h"
+
+/* Tunes gbn.c's window size, retransmission timeout and ACK policy for a
+   channel profile: loss and corruption probability, the range of channel
+   delays and the time between msgs from layer 5.
+
+   Every configuration is run as several replicas of ./gbn with different
+   seeds, in parallel, and its throughput and latency are their means. The
+   search starts on a grid: windows in powers of two, timeouts evenly
+   spaced on a log scale, every ACK policy. Each round of refinement then
+   runs the neighbours of the configurations on the Pareto frontier, half
+   as far away as in the round before. No configuration on the frontier
+   has another one that is at least as fast and at least as quick to
+   deliver, and better in one of the two. */
+
+#define MAX_CONFIGS     4096    // configurations tried, at most
+#define MAX_REPLICAS    64
+#define MAX_COMMAND     512
+#define MAX_LINE        256
+
+// How B acknowledges and what A does about duplicate ACKs, as gbn options.
+struct ack_policy {
+    char *name;
+    char *args;                 // %g is the time a delayed ACK may wait
+};
+
+struct ack_policy ack_policies[] = {
+    { "immediate", "-k 3" },            // ACK every packet, fast retransmit after 3 duplicates
+    { "delayed",   "-k 3 -p %g -d 2" }, // ACK every other packet or after a wait
+    { "nack",      "-k 0" },            // go back N on the first NACK
+};
+
+#define NPOLICIES   ((int) (sizeof(ack_policies) / sizeof(ack_policies[0])))
+
+// What one run of gbn came to.
+struct run {
+    double throughput;          // msgs delivered per time unit
+    double latency_mean;
+    double latency_p99;
+    double packets;             // packets sent into layer 3
+    double delivered;           // msgs delivered to layer 5
+};
+
+struct config {
+    int window;
+    float timeout;
+    int policy;                 // into ack_policies
+    int round;                  // the round it was first run in
+    struct run mean;            // over the replicas
+    double throughput_sd;       // standard deviation of the throughput over the replicas
+    int frontier;
+};
+
+// Channel profile
+float   lossprob    = 0.2;
+float   corruptprob = 0.1;
+float   delay_min   = 1.0;
+float   delay_max   = 10.0;
+float   lambda      = 25.0;
+char    *trace_path = NULL;     // a delay and loss trace gbn replays instead, with -X
+
+// The search
+char    *gbn_path   = "./gbn";
+int     nsimmax     = 1000;     // msgs each replica sends
+int     nreplicas   = 4;
+int     nthreads    = 0;        // replicas run at once, 0 for one per core
+int     max_window  = 64;
+float   timeout_min = 0;        // 0 to derive the range from the channel delays
+float   timeout_max = 0;
+int     ntimeouts   = 5;        // timeouts on the first grid
+int     nrounds     = 3;        // rounds of refinement after the grid
+float   ack_wait    = 0;        // time a delayed ACK may wait, 0 for delay_min
+int     use_p99     = 0;        // trade throughput off against p99 rather than mean latency
+char    *points_log = NULL;     // file to write every configuration to
+
+struct config configs[MAX_CONFIGS];
+int     nconfigs;
+struct run runs[MAX_CONFIGS][MAX_REPLICAS];  // by where a configuration was while its replicas ran, mark_frontier() moves it after
+
+// The replicas still to run, numbered config * nreplicas + replica, handed out under the lock.
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+int     next_job, last_job;
+int     nfailed;
+
+
+/****************************************************************************
+  Running gbn.
+ ***************************************************************************/
+
+// Reads the report of a gbn run; returns 0 if its numbers were all there.
+int read_report(FILE *out, struct run *run)
+{
+    char line[MAX_LINE];
+    int found = 0;
+    double p50, p90;
+
+    memset(run, 0, sizeof(*run));
+    while (fgets(line, sizeof(line), out) != NULL) {
+        found += sscanf(line, "Packets sent into layer 3: %lf", &run->packets) == 1;
+        found += sscanf(line, "Messages delivered to layer 5: %lf", &run->delivered) == 1;
+        found += sscanf(line, "Throughput (messages per time unit): %lf", &run->throughput) == 1;
+        found += sscanf(line, "Message latency mean: %lf", &run->latency_mean) == 1;
+        found += sscanf(line, "Message latency p50 / p90 / p99: %lf / %lf / %lf", &p50, &p90, &run->latency_p99) == 3;
+    }
+    // with nothing delivered there are no latencies, and nothing to be had from the configuration
+    if (found == 3 && run->delivered == 0) {
+        return 0;
+    }
+    return found == 5 ? 0 : -1;
+}
+
+// Runs replica r of configuration c, with seed r + 1.
+int run_replica(struct config *c, int r, struct run *run)
+{
+    char command[MAX_COMMAND], policy[64], trace[MAX_LINE] = "";
+    FILE *out;
+    int n;
+
+    snprintf(policy, sizeof(policy), ack_policies[c->policy].args, ack_wait);
+    if (trace_path != NULL) {
+        snprintf(trace, sizeof(trace), "-X %s", trace_path);
+    }
+    n = snprintf(command, sizeof(command),
+                 "%s -n %d -l %g -c %g -L %g,%g %s -a %g -w %d -T %g %s -x %d -t 0 < /dev/null",
+                 gbn_path, nsimmax, lossprob, corruptprob, delay_min, delay_max, trace, lambda,
+                 c->window, c->timeout, policy, r + 1);
+    if (n >= (int) sizeof(command)) {
+        return -1;
+    }
+
+    out = popen(command, "r");
+    if (out == NULL) {
+        return -1;
+    }
+    if (read_report(out, run) != 0) {
+        pclose(out);
+        return -1;
+    }
+    return pclose(out) == 0 ? 0 : -1;
+}
+
+void *run_jobs(void *arg)
+{
+    (void) arg;
+
+    for (;;) {
+        int job;
+
+        pthread_mutex_lock(&job_lock);
+        job = next_job < last_job ? next_job++ : -1;
+        pthread_mutex_unlock(&job_lock);
+        if (job < 0) {
+            return NULL;
+        }
+
+        int c = job / nreplicas, r = job % nreplicas;
+
+        if (run_replica(&configs[c], r, &runs[c][r]) != 0) {
+            pthread_mutex_lock(&job_lock);
+            if (nfailed++ == 0) {
+                printf("run_jobs: %s failed on window %d, timeout %g, ACKs %s\n", gbn_path,
+                       configs[c].window, configs[c].timeout, ack_policies[configs[c].policy].name);
+            }
+            pthread_mutex_unlock(&job_lock);
+        }
+    }
+}
+
+// Runs every replica of configurations first.. on the threads, then takes the means.
+void run_configs(int first)
+{
+    pthread_t threads[nthreads];
+
+    next_job = first * nreplicas;
+    last_job = nconfigs * nreplicas;
+    for (int t = 0; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, run_jobs, NULL) != 0) {
+            printf("run_configs: unable to start thread %d\n", t);
+            exit(1);
+        }
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if (nfailed > 0) {
+        exit(1);
+    }
+
+    for (int c = first; c < nconfigs; c++) {
+        struct run *mean = &configs[c].mean;
+        double sq = 0.0;
+
+        memset(mean, 0, sizeof(*mean));
+        for (int r = 0; r < nreplicas; r++) {
+            mean->throughput += runs[c][r].throughput / nreplicas;
+            mean->latency_mean += runs[c][r].latency_mean / nreplicas;
+            mean->latency_p99 += runs[c][r].latency_p99 / nreplicas;
+            mean->packets += runs[c][r].packets / nreplicas;
+            mean->delivered += runs[c][r].delivered / nreplicas;
+        }
+        for (int r = 0; r < nreplicas; r++) {
+            sq += (runs[c][r].throughput - mean->throughput) * (runs[c][r].throughput - mean->throughput);
+        }
+        configs[c].throughput_sd = nreplicas > 1 ? sqrt(sq / (nreplicas - 1)) : 0.0;
+    }
+}
+
+
+/****************************************************************************
+  The search.
+ ***************************************************************************/
+
+// Adds a configuration to run, unless it is out of range or there already.
+void add_config(int window, float timeout, int policy, int round)
+{
+    if (window < 1 || window > max_window || timeout < timeout_min * 0.999 || timeout > timeout_max * 1.001) {
+        return;
+    }
+    for (int c = 0; c < nconfigs; c++) {
+        if (configs[c].window == window && configs[c].policy == policy
+                && fabsf(configs[c].timeout - timeout) <= 1e-3 * timeout) {
+            return;
+        }
+    }
+    if (nconfigs == MAX_CONFIGS) {
+        return;
+    }
+    configs[nconfigs].window = window;
+    configs[nconfigs].timeout = timeout;
+    configs[nconfigs].policy = policy;
+    configs[nconfigs].round = round;
+    nconfigs++;
+}
+
+double latency(struct config *c)
+{
+    return use_p99 ? c->mean.latency_p99 : c->mean.latency_mean;
+}
+
+// Fastest first, of equally fast the quickest.
+int compare_configs(const void *a, const void *b)
+{
+    const struct config *x = a, *y = b;
+
+    if (x->mean.throughput != y->mean.throughput) {
+        return x->mean.throughput < y->mean.throughput ? 1 : -1;
+    }
+    return (latency((struct config *) x) > latency((struct config *) y)) - (latency((struct config *) x) < latency((struct config *) y));
+}
+
+/* Marks the frontier, sorting configs: going from the fastest down, a
+   configuration is on it if it delivers quicker than every faster one.
+   Returns how many are. */
+int mark_frontier()
+{
+    double best = INFINITY;
+    int n = 0;
+
+    qsort(configs, nconfigs, sizeof(struct config), compare_configs);
+    for (int c = 0; c < nconfigs; c++) {
+        configs[c].frontier = configs[c].mean.delivered > 0 && latency(&configs[c]) < best;
+        if (configs[c].frontier) {
+            best = latency(&configs[c]);
+            n++;
+        }
+    }
+    return n;
+}
+
+/* The neighbours of each configuration on the frontier, step apart on the
+   log scale of windows and of timeouts; the other ACK policies are tried
+   at the same window and timeout. */
+void refine(int round, double window_step, double timeout_step)
+{
+    int n = nconfigs;
+
+    for (int c = 0; c < n; c++) {
+        struct config *k = &configs[c];
+        int up = (int) lround(k->window * window_step), down = (int) lround(k->window / window_step);
+
+        if (!k->frontier) {
+            continue;
+        }
+        add_config(up > k->window ? up : k->window + 1, k->timeout, k->policy, round);
+        add_config(down < k->window ? down : k->window - 1, k->timeout, k->policy, round);
+        add_config(k->window, k->timeout * timeout_step, k->policy, round);
+        add_config(k->window, k->timeout / timeout_step, k->policy, round);
+        for (int p = 0; p < NPOLICIES; p++) {
+            add_config(k->window, k->timeout, p, round);
+        }
+    }
+}
+
+void write_points(FILE *log)
+{
+    fprintf(log, "# window timeout acks throughput throughput_sd latency_mean latency_p99 packets_per_msg round frontier\n");
+    for (int c = 0; c < nconfigs; c++) {
+        struct config *k = &configs[c];
+
+        fprintf(log, "%d %g %s %f %f %f %f %f %d %d\n", k->window, k->timeout, ack_policies[k->policy].name,
+                k->mean.throughput, k->throughput_sd, k->mean.latency_mean, k->mean.latency_p99,
+                k->mean.delivered > 0 ? k->mean.packets / k->mean.delivered : 0.0, k->round, k->frontier);
+    }
+}
+
+
+/****************************************************************************
+  The profile and the options.
+ ***************************************************************************/
+
+/* A profile file has a line per setting: loss, corrupt, interval (the mean
+   time between msgs) with a number each, and delay with two. '#' starts a
+   comment. */
+void read_profile(char *path)
+{
+    char line[MAX_LINE], key[32];
+    FILE *file = fopen(path, "r");
+    int lineno = 0;
+
+    if (file == NULL) {
+        printf("read_profile: unable to open %s\n", path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *hash = strchr(line, '#');
+        int ok = 0;
+
+        lineno++;
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        if (sscanf(line, "%31s", key) != 1) {
+            continue;
+        }
+        if (strcmp(key, "loss") == 0) {
+            ok = sscanf(line, "%*s %f", &lossprob) == 1;
+        }
+        else if (strcmp(key, "corrupt") == 0) {
+            ok = sscanf(line, "%*s %f", &corruptprob) == 1;
+        }
+        else if (strcmp(key, "delay") == 0) {
+            ok = sscanf(line, "%*s %f %f", &delay_min, &delay_max) == 2;
+        }
+        else if (strcmp(key, "interval") == 0) {
+            ok = sscanf(line, "%*s %f", &lambda) == 1;
+        }
+        if (!ok) {
+            printf("read_profile: %s:%d: expected loss, corrupt, interval or delay and its numbers\n", path, lineno);
+            exit(1);
+        }
+    }
+    fclose(file);
+}
+
+void usage(char *progname)
+{
+    printf("usage: %s [-f profile] [-l lossprob] [-c corruptprob] [-L min,max] [-a lambda] [-X trace] [-g gbn] [-n nsimmax] [-r replicas] [-j threads] [-W max_window] [-T min,max] [-G timeouts] [-x rounds] [-p ack_wait] [-9] [-o points]\n", progname);
+    printf("  -f  channel profile: lines of loss, corrupt, interval and delay min max; options after it override\n");
+    printf("  -l  packet loss probability (default %f)\n", lossprob);
+    printf("  -c  packet corruption probability (default %f)\n", corruptprob);
+    printf("  -L  least and most time a packet takes through the channel (default %g,%g)\n", delay_min, delay_max);
+    printf("  -a  mean time between messages from layer 5 (default %f)\n", lambda);
+    printf("  -X  a delay and loss trace from pcap_trace for gbn to replay, in place of -l and -L\n");
+    printf("  -g  the simulator to run (default %s)\n", gbn_path);
+    printf("  -n  msgs each replica sends (default %d)\n", nsimmax);
+    printf("  -r  replicas of each configuration, 1..%d (default %d)\n", MAX_REPLICAS, nreplicas);
+    printf("  -j  replicas run at once, 0 for one per core (default %d)\n", nthreads);
+    printf("  -W  largest window tried (default %d)\n", max_window);
+    printf("  -T  shortest and longest timeout tried (default the least plus the most channel delay, and 16 times the most)\n");
+    printf("  -G  timeouts on the first grid (default %d)\n", ntimeouts);
+    printf("  -x  rounds of refinement around the frontier (default %d)\n", nrounds);
+    printf("  -p  time a delayed ACK may wait (default the least channel delay)\n");
+    printf("  -9  trade throughput off against p99 latency instead of the mean\n");
+    printf("  -o  write every configuration tried and its results to this file\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *log;
+    int opt, nfrontier, first;
+
+    while ((opt = getopt(argc, argv, "f:l:c:L:a:X:g:n:r:j:W:T:G:x:p:9o:")) != -1) {
+        switch (opt) {
+            case 'f': read_profile(optarg); break;
+            case 'l': lossprob = atof(optarg); break;
+            case 'c': corruptprob = atof(optarg); break;
+            case 'L': if (sscanf(optarg, "%f,%f", &delay_min, &delay_max) != 2) usage(argv[0]); break;
+            case 'a': lambda = atof(optarg); break;
+            case 'X': trace_path = optarg; break;
+            case 'g': gbn_path = optarg; break;
+            case 'n': nsimmax = atoi(optarg); break;
+            case 'r': nreplicas = atoi(optarg); break;
+            case 'j': nthreads = atoi(optarg); break;
+            case 'W': max_window = atoi(optarg); break;
+            case 'T': if (sscanf(optarg, "%f,%f", &timeout_min, &timeout_max) != 2) usage(argv[0]); break;
+            case 'G': ntimeouts = atoi(optarg); break;
+            case 'x': nrounds = atoi(optarg); break;
+            case 'p': ack_wait = atof(optarg); break;
+            case '9': use_p99 = 1; break;
+            case 'o': points_log = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    // the timeouts and the ACK wait go by the trace's delays
+    if (trace_path != NULL) {
+        struct chantrace trace;
+
+        if (chantrace_read(trace_path, &trace) != 0) {
+            exit(1);
+        }
+        lossprob = trace.loss_rate;
+        delay_min = trace.delay_min;
+        delay_max = trace.delay_max;
+    }
+
+    if (timeout_min == 0 && timeout_max == 0) {
+        timeout_min = delay_min + delay_max;
+        timeout_max = 16 * delay_max;
+    }
+    if (ack_wait == 0) {
+        ack_wait = delay_min;
+    }
+    if (nthreads == 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (delay_min <= 0 || delay_max < delay_min || lambda <= 0 || nsimmax < 1
+            || nreplicas < 1 || nreplicas > MAX_REPLICAS || nthreads < 1 || max_window < 1
+            || timeout_min <= 0 || timeout_max < timeout_min || ntimeouts < 1 || nrounds < 0 || ack_wait < 0) {
+        printf("Settings out of range\n");
+        usage(argv[0]);
+    }
+
+    if (trace_path != NULL) {
+        printf("Channel trace:                               %s\n", trace_path);
+    }
+    printf("Packet loss probability:                     %f\n", lossprob);
+    printf("Packet corruption probability:               %f\n", corruptprob);
+    printf("Channel delay min / max:                     %f / %f\n", delay_min, delay_max);
+    printf("Time between messages from sender's layer5:  %f\n", lambda);
+    printf("Msgs / replicas per configuration:           %d / %d\n", nsimmax, nreplicas);
+    printf("Windows / timeouts tried:                    1..%d / %g..%g\n", max_window, timeout_min, timeout_max);
+    printf("Latency traded off:                          %s\n\n", use_p99 ? "p99" : "mean");
+
+    // the grid
+    double timeout_step = ntimeouts > 1 ? pow(timeout_max / timeout_min, 1.0 / (ntimeouts - 1)) : 2.0;
+    double window_step = 2.0;
+
+    for (int w = 1; w <= max_window; w *= 2) {
+        for (int t = 0; t < ntimeouts; t++) {
+            for (int p = 0; p < NPOLICIES; p++) {
+                add_config(w, (float) (timeout_min * pow(timeout_step, t)), p, 0);
+            }
+        }
+    }
+    run_configs(0);
+    nfrontier = mark_frontier();
+    printf("Round 0: %4d configurations on the grid, %d on the frontier\n", nconfigs, nfrontier);
+
+    for (int round = 1; round <= nrounds; round++) {
+        window_step = sqrt(window_step);
+        timeout_step = sqrt(timeout_step);
+        first = nconfigs;
+        refine(round, window_step, timeout_step);
+        if (nconfigs == first) {
+            break;
+        }
+        run_configs(first);
+        nfrontier = mark_frontier();
+        printf("Round %d: %4d configurations more, %d on the frontier\n", round, nconfigs - first, nfrontier);
+    }
+
+    printf("\nPareto frontier, throughput against %s latency:\n\n", use_p99 ? "p99" : "mean");
+    printf("window  timeout  ACKs       throughput (sd)        latency mean      p99  packets/msg\n");
+    for (int c = nconfigs - 1; c >= 0; c--) {
+        struct config *k = &configs[c];
+
+        if (k->frontier) {
+            printf("%6d %8.2f  %-9s  %10.6f (%.6f) %12.2f %8.2f %12.2f\n", k->window, k->timeout,
+                   ack_policies[k->policy].name, k->mean.throughput, k->throughput_sd,
+                   k->mean.latency_mean, k->mean.latency_p99, k->mean.packets / k->mean.delivered);
+        }
+    }
+
+    if (points_log != NULL) {
+        log = fopen(points_log, "w");
+        if (log == NULL) {
+            printf("main: unable to open %s\n", points_log);
+            exit(1);
+        }
+        write_points(log);
+        fclose(log);
+    }
+    return 0;
+}
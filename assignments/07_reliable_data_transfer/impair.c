@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h> // for calloc
+#include <math.h>   // for log, log1p
+
+#include "impair.h"
+
+#if defined(__AVX512F__)
+#define LANES 16
+#elif defined(__AVX2__)
+#define LANES 8
+#else
+#define LANES 4
+#endif
+
+#define  RAND_BLOCK          256     // uniforms made at a time, a multiple of LANES
+
+typedef float    vfloat __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t  vint   __attribute__((vector_size(LANES * sizeof(int32_t))));
+typedef uint32_t vuint  __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+struct impair {
+    struct impair_params params;
+    struct impair_stats stats;
+    int bad;                    // the Gilbert-Elliott channel is in its bad state
+    double log_intact;          // log(1 - ber), the log of the chance a bit comes through
+    vuint state;                // a generator per lane
+    float rand[RAND_BLOCK];     // uniforms in (0, 1], used up from next on
+    int next;
+};
+
+
+// Spreads a seed over a lane, as abp_batch.c does over its replicas.
+uint32_t lane_seed(uint32_t seed, int lane)
+{
+    uint32_t x = seed * 0x9e3779b9u + (uint32_t) lane * 0x85ebca6bu;
+
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x != 0 ? x : 1;      // xorshift never leaves 0
+}
+
+// Steps every lane's xorshift32 RAND_BLOCK / LANES times.
+void refill(struct impair *m)
+{
+    vuint x = m->state;
+
+    for (int i = 0; i < RAND_BLOCK; i += LANES) {
+        vfloat u;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        u = __builtin_convertvector((vint) (x >> 8) + 1, vfloat) * (1.0f / 16777216);
+        __builtin_memcpy(&m->rand[i], &u, sizeof(u));
+    }
+    m->state = x;
+    m->next = 0;
+}
+
+float uniform(struct impair *m)
+{
+    if (m->next == RAND_BLOCK) {
+        refill(m);
+    }
+    return m->rand[m->next++];
+}
+
+
+struct impair *impair_create(struct impair_params *params, uint32_t seed)
+{
+    struct impair *m = (struct impair *)calloc(1, sizeof(struct impair));
+
+    if (m == NULL) {
+        printf("impair_create: unable to allocate a channel model\n");
+        exit(1);
+    }
+    m->params = *params;
+    for (int i = 0; i < LANES; i++) {
+        m->state[i] = lane_seed(seed, i);
+    }
+    refill(m);
+
+    m->log_intact = log1p(-params->ber);
+
+    // start where the channel spends its time
+    if (params->ge) {
+        m->bad = uniform(m) <= params->ge_p / (params->ge_p + params->ge_r);
+    }
+    return m;
+}
+
+int impair_lose(struct impair *m)
+{
+    struct impair_params *params = &m->params;
+    int lost;
+
+    if (uniform(m) <= (m->bad ? params->ge_r : params->ge_p)) {
+        m->bad = !m->bad;
+    }
+    lost = uniform(m) <= (m->bad ? params->ge_loss_bad : params->ge_loss_good);
+
+    m->stats.packets++;
+    m->stats.bad += m->bad;
+    m->stats.lost += lost;
+    return lost;
+}
+
+/* The gap to the next error is geometric: P(gap >= k) = (1 - ber)^k. The
+   uniforms are never 0, so the log is finite. */
+long impair_skip(struct impair *m)
+{
+    double gap = log(uniform(m)) / m->log_intact;
+
+    return gap < 1e15 ? (long) gap : (long) 1e15;
+}
+
+struct impair_stats *impair_stats(struct impair *m)
+{
+    return &m->stats;
+}
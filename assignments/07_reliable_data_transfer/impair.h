@@ -0,0 +1,44 @@
+/* Impairments of one direction of the RDT emulator's channel, in place of
+   its independent losses and corruptions.
+
+   Gilbert-Elliott loss (Gilbert 1960, Elliott 1963) keeps the channel in a
+   good or a bad state. Every packet first moves it from good to bad with
+   probability p, or from bad to good with probability r, and is then lost
+   with the loss probability of the state it is in. Losses come in bursts of
+   1/r packets on average, with the channel bad p/(p+r) of the time.
+
+   A bit error rate flips every bit on the wire independently with that
+   probability. The gaps between errors are drawn instead of the bits, so a
+   packet costs one random number and one more per error.
+
+   The random numbers come from xorshift generators in SIMD lanes, a block
+   at a time. */
+
+#include <stdint.h>
+
+struct impair_params {
+    int ge;                     // whether Gilbert-Elliott loss is on
+    float ge_p;                 // chance of going from good to bad, per packet
+    float ge_r;                 // and from bad to good
+    float ge_loss_good;         // loss probability in each state
+    float ge_loss_bad;
+    double ber;                 // chance a bit is flipped, 0 for none
+};
+
+struct impair_stats {
+    long packets;               // packets through the Gilbert-Elliott channel
+    long bad;                   // of them found it bad
+    long lost;
+};
+
+struct impair;
+
+struct impair *impair_create(struct impair_params *params, uint32_t seed);
+
+// Whether the next packet is lost.
+int impair_lose(struct impair *m);
+
+// Bits that come through intact before the next bit error.
+long impair_skip(struct impair *m);
+
+struct impair_stats *impair_stats(struct impair *m);
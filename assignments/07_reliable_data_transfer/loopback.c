@@ -0,0 +1,233 @@
+#define _GNU_SOURCE             // for sendmmsg and recvmmsg
+#include <stdio.h>
+#include <stdlib.h> // for calloc
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h> // for close
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "loopback.h"
+
+#define  SOCKET_BUFFER       (4 * 1024 * 1024)   // bytes each socket buffers, for a whole window in a burst
+#define  MAX_WAKEUPS         64      // what one epoll_wait reports at most
+
+struct loopback {
+    int n;
+    int *fd;                    // the socket of each entity
+    int epoll_fd;
+    int timer_fd;
+    int max_datagram;
+    int out_from;               // the entity the queued datagrams are from
+    int nout;
+    struct mmsghdr out[LOOPBACK_BATCH];
+    struct iovec out_iov[LOOPBACK_BATCH];
+    char *out_data;             // LOOPBACK_BATCH datagrams of max_datagram bytes
+    struct mmsghdr in[LOOPBACK_BATCH];
+    struct iovec in_iov[LOOPBACK_BATCH];
+    char *in_data;
+    struct loopback_stats stats;
+};
+
+
+double loopback_clock()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Adds fd to the epoll set, reported with the number key. Returns 0, or -1 with errno set.
+int watch_fd(struct loopback *lb, int fd, int key)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = key;
+    return epoll_ctl(lb->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+struct loopback *loopback_create(int n, int max_datagram)
+{
+    struct loopback *lb = (struct loopback *)calloc(1, sizeof(struct loopback));
+    struct sockaddr_in *addr = (struct sockaddr_in *)calloc(n, sizeof(struct sockaddr_in));
+    socklen_t len = sizeof(struct sockaddr_in);
+    int size = SOCKET_BUFFER;
+    int i, ok;
+
+    if (lb == NULL || addr == NULL || (lb->fd = (int *)malloc(n * sizeof(int))) == NULL
+            || (lb->out_data = (char *)malloc(LOOPBACK_BATCH * max_datagram)) == NULL
+            || (lb->in_data = (char *)malloc(LOOPBACK_BATCH * max_datagram)) == NULL) {
+        printf("loopback_create: unable to allocate %d entities\n", n);
+        exit(1);
+    }
+    lb->n = n;
+    lb->max_datagram = max_datagram;
+    for (i = 0; i < n; i++) {
+        lb->fd[i] = -1;
+    }
+
+    lb->epoll_fd = epoll_create1(0);
+    lb->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ok = lb->epoll_fd >= 0 && lb->timer_fd >= 0 && watch_fd(lb, lb->timer_fd, n) == 0;
+
+    // bound first, to learn the port of every peer before connecting
+    for (i = 0; ok && i < n; i++) {
+        addr[i].sin_family = AF_INET;
+        addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        lb->fd[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        ok = lb->fd[i] >= 0 && bind(lb->fd[i], (struct sockaddr *)&addr[i], len) == 0
+             && getsockname(lb->fd[i], (struct sockaddr *)&addr[i], &len) == 0;
+
+        // the kernel may give less than asked, which only makes drops likelier
+        if (ok) {
+            setsockopt(lb->fd[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            setsockopt(lb->fd[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        }
+    }
+    for (i = 0; ok && i < n; i++) {
+        ok = connect(lb->fd[i], (struct sockaddr *)&addr[i ^ 1], len) == 0 && watch_fd(lb, lb->fd[i], i) == 0;
+    }
+    free(addr);
+    if (!ok) {
+        printf("loopback_create: %s\n", strerror(errno));
+        loopback_destroy(lb);
+        return NULL;
+    }
+
+    for (i = 0; i < LOOPBACK_BATCH; i++) {
+        lb->out_iov[i].iov_base = lb->out_data + i * max_datagram;
+        lb->out[i].msg_hdr.msg_iov = &lb->out_iov[i];
+        lb->out[i].msg_hdr.msg_iovlen = 1;
+        lb->in_iov[i].iov_base = lb->in_data + i * max_datagram;
+        lb->in_iov[i].iov_len = max_datagram;
+        lb->in[i].msg_hdr.msg_iov = &lb->in_iov[i];
+        lb->in[i].msg_hdr.msg_iovlen = 1;
+    }
+    return lb;
+}
+
+void loopback_destroy(struct loopback *lb)
+{
+    int i;
+
+    for (i = 0; i < lb->n; i++) {
+        if (lb->fd[i] >= 0) {
+            close(lb->fd[i]);
+        }
+    }
+    if (lb->timer_fd >= 0) {
+        close(lb->timer_fd);
+    }
+    if (lb->epoll_fd >= 0) {
+        close(lb->epoll_fd);
+    }
+    free(lb->fd);
+    free(lb->out_data);
+    free(lb->in_data);
+    free(lb);
+}
+
+void loopback_send(struct loopback *lb, int from, char *data, int length)
+{
+    if (lb->nout == LOOPBACK_BATCH || (lb->nout > 0 && lb->out_from != from)) {
+        loopback_flush(lb);
+    }
+    if (length > lb->max_datagram) {
+        length = lb->max_datagram;
+    }
+    lb->out_from = from;
+    memcpy(lb->out_iov[lb->nout].iov_base, data, length);
+    lb->out_iov[lb->nout].iov_len = length;
+    lb->nout++;
+}
+
+void loopback_flush(struct loopback *lb)
+{
+    int done = 0, k;
+
+    while (done < lb->nout) {
+        k = sendmmsg(lb->fd[lb->out_from], lb->out + done, lb->nout - done, 0);
+        lb->stats.sendmmsg_calls++;
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            // a full socket buffer loses the rest, as a router's full queue would
+            lb->stats.dropped += lb->nout - done;
+            break;
+        }
+        lb->stats.sent += k;
+        done += k;
+    }
+    lb->nout = 0;
+}
+
+void loopback_arm(struct loopback *lb, double at)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    if (at >= 0) {
+        spec.it_value.tv_sec = (time_t) at;
+        spec.it_value.tv_nsec = (long) ((at - spec.it_value.tv_sec) * 1e9);
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;      // zero would disarm it
+        }
+    }
+    timerfd_settime(lb->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Reads what has arrived at entity to, a batch at a time, until there is no more.
+void read_socket(struct loopback *lb, int to, loopback_receive_fn receive, void *arg)
+{
+    int i, k;
+
+    do {
+        k = recvmmsg(lb->fd[to], lb->in, LOOPBACK_BATCH, MSG_DONTWAIT, NULL);
+        lb->stats.recvmmsg_calls++;
+        for (i = 0; i < k; i++) {
+            lb->stats.received++;
+            receive(arg, to, lb->in_data + i * lb->max_datagram, lb->in[i].msg_len);
+        }
+    } while (k == LOOPBACK_BATCH);
+}
+
+int loopback_wait(struct loopback *lb, int timeout_ms, loopback_receive_fn receive, void *arg)
+{
+    struct epoll_event events[MAX_WAKEUPS];
+    unsigned long long expirations;
+    int i, k;
+
+    loopback_flush(lb);
+    do {
+        k = epoll_wait(lb->epoll_fd, events, MAX_WAKEUPS, timeout_ms);
+    } while (k < 0 && errno == EINTR);
+    lb->stats.wakeups++;
+    if (k <= 0) {
+        return -1;
+    }
+
+    for (i = 0; i < k; i++) {
+        if ((int) events[i].data.u32 == lb->n) {
+            if (read(lb->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                printf("loopback_wait: %s\n", strerror(errno));
+            }
+        }
+        else {
+            read_socket(lb, events[i].data.u32, receive, arg);
+        }
+    }
+    return 0;
+}
+
+struct loopback_stats *loopback_stats(struct loopback *lb)
+{
+    return &lb->stats;
+}
@@ -0,0 +1,52 @@
+/* A runtime that carries the RDT emulator's packets over real UDP sockets
+   on the loopback interface, in place of its emulated channel.
+
+   Every entity has a socket of its own, bound to 127.0.0.1 and connected
+   to the socket of its peer, entity i ^ 1. One thread waits in epoll for
+   the sockets and for a timerfd, which the caller arms for its earliest
+   timer. Datagrams are read with recvmmsg and written with sendmmsg, a
+   batch at a time: what the entities send while the caller handles one
+   wakeup goes out in as few calls as there are runs of datagrams from the
+   same entity. Linux only. */
+
+#define  LOOPBACK_BATCH      64      // datagrams per sendmmsg or recvmmsg
+
+struct loopback_stats {
+    long sent;                  // datagrams handed to the kernel
+    long received;
+    long dropped;               // datagrams the kernel would not take, a full socket buffer
+    long sendmmsg_calls;
+    long recvmmsg_calls;
+    long wakeups;               // returns from epoll_wait
+};
+
+struct loopback;
+
+// Called with each datagram that arrives at entity to.
+typedef void (*loopback_receive_fn)(void *arg, int to, char *data, int length);
+
+/* Sockets for n entities, for datagrams of up to max_datagram bytes.
+   Returns NULL with a message printed if the kernel would not give them. */
+struct loopback *loopback_create(int n, int max_datagram);
+
+void loopback_destroy(struct loopback *lb);
+
+// The monotonic clock, in seconds.
+double loopback_clock();
+
+// Queues a datagram from entity from to its peer; it goes out with the batch.
+void loopback_send(struct loopback *lb, int from, char *data, int length);
+
+// Hands the queued datagrams to the kernel.
+void loopback_flush(struct loopback *lb);
+
+// Arms the timer for this time of loopback_clock(), or disarms it if at is negative.
+void loopback_arm(struct loopback *lb, double at);
+
+/* Flushes, then waits until the timer goes off or datagrams arrive, at most
+   timeout_ms milliseconds or -1 for no limit, and calls receive with every
+   datagram that did. Returns 0, or -1 if nothing happened before the
+   timeout. */
+int loopback_wait(struct loopback *lb, int timeout_ms, loopback_receive_fn receive, void *arg);
+
+struct loopback_stats *loopback_stats(struct loopback *lb);
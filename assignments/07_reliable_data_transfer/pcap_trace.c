@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <stdlib.h> // for malloc, qsort
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h> // for getopt
+
+/* Turns a packet capture into a delay and loss trace of a channel, for
+   gbn -X to replay (see chantrace.h).
+
+   It reads pcapng and classic pcap files, of Ethernet, raw IP, Linux
+   cooked or loopback captures, and takes the TCP connection that carried
+   the most payload, or the UDP flow with the most packets if there is no
+   TCP data. -P picks a port's.
+
+   From TCP it takes the segments with data the sender sent. The first ACK
+   that covers a segment gives its RTT. A segment sent again before it was
+   acknowledged counts as lost, and the retransmission gets no RTT of its
+   own (Karn's algorithm). From UDP it takes the requests, the packets in
+   the direction of the first one, with the next reply's RTT; a request
+   followed by another before any reply counts as lost. The capture is at
+   one end, so a packet's one way delay is taken as half its RTT. */
+
+#define MAX_FLOWS       4096    // flows told apart, at most
+#define FLOW_TABLE      8192    // slots of the hash table of flows, a power of two, at least twice MAX_FLOWS
+#define MAX_IFACES      64      // interfaces of a pcapng section, at most
+#define MAX_OUTSTANDING 4096    // TCP segments unacknowledged at once, at most
+
+// Where a packet of a flow went: direction 0 is from the first endpoint of the flow.
+struct packet {
+    double time;                // seconds
+    int dir;
+    uint32_t seq;
+    uint32_t ack;
+    int flags;                  // TCP flags, with TCP_ACK
+    int len;                    // payload bytes
+};
+
+#define TCP_SYN         0x02
+#define TCP_ACK         0x10
+
+struct flow {
+    int proto;                  // 6 for TCP, 17 for UDP
+    int family;                 // 4 or 6
+    uint8_t addr[2][16];        // its endpoints, in the order of its first packet
+    uint16_t port[2];
+    struct packet *packets;
+    int npackets;
+    int size;
+    long bytes;                 // payload bytes both ways
+};
+
+// A packet that went through the channel, of the sender's or the requester's.
+struct record {
+    double sent;
+    double rtt;                 // seconds, -1 if it has none
+    uint32_t start;             // TCP: the sequence numbers of its data, from the first one
+    uint32_t end;               // and the one after them
+    int lost;
+    int again;                  // TCP: it was a retransmission
+};
+
+struct flow flows[MAX_FLOWS];
+int     nflows;
+int     flow_table[FLOW_TABLE]; // index + 1 into flows, 0 for an empty slot
+long    npackets, nip;          // packets read, and IP packets among them
+long    nskipped;               // of a link type we do not take apart
+int     only_port = -1;         // -P
+double  time_unit = 0.001;      // seconds per time unit of the emulator
+char    *trace_path = NULL;
+
+
+/****************************************************************************
+  Reading the capture.
+ ***************************************************************************/
+
+int swapped;                    // the section is in the other byte order
+
+uint32_t get16(const uint8_t *p)
+{
+    return swapped ? (uint32_t) p[0] << 8 | p[1] : (uint32_t) p[1] << 8 | p[0];
+}
+
+uint32_t get32(const uint8_t *p)
+{
+    return swapped ? (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3]
+                   : (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0];
+}
+
+// Headers are in network byte order, whatever the capture's.
+uint32_t net16(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 8 | p[1];
+}
+
+uint32_t net32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+struct flow *find_flow(int proto, int family, const uint8_t *src, const uint8_t *dst, int sport, int dport, int *dir)
+{
+    int alen = family == 4 ? 4 : 16;
+    uint32_t h = 2166136261u ^ (uint32_t) proto;
+    struct flow *f;
+    int i, slot;
+
+    // FNV-1a over both endpoints, in an order that does not depend on the direction
+    for (i = 0; i < alen; i++) {
+        h = (h ^ (src[i] ^ dst[i])) * 16777619u;
+    }
+    h = (h ^ (uint32_t) (sport ^ dport)) * 16777619u;
+
+    for (slot = h & (FLOW_TABLE - 1); flow_table[slot] != 0; slot = (slot + 1) & (FLOW_TABLE - 1)) {
+        f = &flows[flow_table[slot] - 1];
+        if (f->proto != proto || f->family != family) {
+            continue;
+        }
+        for (*dir = 0; *dir < 2; (*dir)++) {
+            if (memcmp(f->addr[*dir], src, alen) == 0 && f->port[*dir] == sport
+                    && memcmp(f->addr[!*dir], dst, alen) == 0 && f->port[!*dir] == dport) {
+                return f;
+            }
+        }
+    }
+    if (nflows == MAX_FLOWS) {
+        return NULL;
+    }
+    f = &flows[nflows];
+    f->proto = proto;
+    f->family = family;
+    memcpy(f->addr[0], src, alen);
+    memcpy(f->addr[1], dst, alen);
+    f->port[0] = sport;
+    f->port[1] = dport;
+    flow_table[slot] = ++nflows;
+    *dir = 0;
+    return f;
+}
+
+// Takes an IP packet of len captured bytes apart, and adds it to its flow if it is TCP or UDP.
+void take_ip(double time, const uint8_t *ip, int len)
+{
+    const uint8_t *l4, *src, *dst;
+    struct packet *p;
+    struct flow *f;
+    int family, proto, payload, hlen, dir;
+
+    if (len < 20) {
+        return;
+    }
+    family = ip[0] >> 4;
+    if (family == 4) {
+        hlen = (ip[0] & 0x0f) * 4;
+        if (hlen < 20 || len < hlen || (net16(ip + 6) & 0x1fff) != 0) {
+            return;             // not all there, or a later fragment
+        }
+        proto = ip[9];
+        payload = net16(ip + 2) - hlen;
+        src = ip + 12;
+        dst = ip + 16;
+    }
+    else if (family == 6 && len >= 40) {
+        hlen = 40;              // extension headers are not followed
+        proto = ip[6];
+        payload = net16(ip + 4);
+        src = ip + 8;
+        dst = ip + 24;
+    }
+    else {
+        return;
+    }
+    nip++;
+    l4 = ip + hlen;
+    len -= hlen;
+
+    if (proto == 6 && len >= 20 && payload >= (l4[12] >> 4) * 4) {
+        f = find_flow(proto, family, src, dst, net16(l4), net16(l4 + 2), &dir);
+        payload -= (l4[12] >> 4) * 4;
+    }
+    else if (proto == 17 && len >= 8 && payload >= 8) {
+        f = find_flow(proto, family, src, dst, net16(l4), net16(l4 + 2), &dir);
+        payload -= 8;
+    }
+    else {
+        return;
+    }
+    if (f == NULL) {
+        return;
+    }
+
+    if (f->npackets == f->size) {
+        f->size = f->size > 0 ? 2 * f->size : 64;
+        f->packets = (struct packet *)realloc(f->packets, f->size * sizeof(struct packet));
+        if (f->packets == NULL) {
+            printf("take_ip: unable to allocate %d packets\n", f->size);
+            exit(1);
+        }
+    }
+    p = &f->packets[f->npackets++];
+    p->time = time;
+    p->dir = dir;
+    p->len = payload;
+    p->seq = proto == 6 ? net32(l4 + 4) : 0;
+    p->ack = proto == 6 ? net32(l4 + 8) : 0;
+    p->flags = proto == 6 ? l4[13] : 0;
+    f->bytes += payload;
+}
+
+// Takes the link layer header of a packet off, and the IP packet in it apart.
+void take_frame(double time, int linktype, const uint8_t *data, int len)
+{
+    int type, off;
+
+    npackets++;
+    switch (linktype) {
+        case 1:                 // Ethernet, maybe with VLAN tags
+            for (off = 12; off + 2 <= len && (net16(data + off) == 0x8100 || net16(data + off) == 0x88a8); off += 4) {
+            }
+            if (off + 2 > len) {
+                return;
+            }
+            type = net16(data + off);
+            off += 2;
+            break;
+        case 0:                 // BSD loopback, the address family in host byte order
+        case 108:
+            off = 4;
+            type = 0;
+            break;
+        case 12:                // raw IP
+        case 14:
+        case 101:
+            off = 0;
+            type = 0;
+            break;
+        case 113:               // Linux cooked
+            if (len < 16) {
+                return;
+            }
+            type = net16(data + 14);
+            off = 16;
+            break;
+        case 276:               // Linux cooked v2
+            if (len < 20) {
+                return;
+            }
+            type = net16(data);
+            off = 20;
+            break;
+        default:
+            nskipped++;
+            return;
+    }
+    // with no ethertype the IP version tells
+    if (type == 0x0800 || type == 0x86dd || type == 0) {
+        take_ip(time, data + off, len - off);
+    }
+}
+
+/* A classic pcap file: a header with the link type, then a header with a
+   timestamp and length before each packet. */
+int read_pcap(const uint8_t *buf, long size)
+{
+    uint32_t magic = (uint32_t) buf[0] | (uint32_t) buf[1] << 8 | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+    double resolution;
+    int linktype;
+    long pos;
+
+    swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    resolution = magic == 0xa1b23c4d || magic == 0x4d3cb2a1 ? 1e-9 : 1e-6;
+    linktype = get32(buf + 20) & 0xffff;
+
+    for (pos = 24; pos + 16 <= size; ) {
+        uint32_t caplen = get32(buf + pos + 8);
+
+        if (caplen > size - pos - 16) {
+            printf("read_pcap: the last packet is cut off\n");
+            break;
+        }
+        take_frame(get32(buf + pos) + get32(buf + pos + 4) * resolution, linktype, buf + pos + 16, caplen);
+        pos += 16 + caplen;
+    }
+    return 0;
+}
+
+/* A pcapng file: blocks, in sections that each start with a section header
+   in their byte order. Interface descriptions give the link type and the
+   timestamp resolution of the packets on the interface. */
+int read_pcapng(const uint8_t *buf, long size)
+{
+    int linktype[MAX_IFACES];
+    double resolution[MAX_IFACES];
+    int nifaces = 0;
+    long pos;
+
+    for (pos = 0; pos + 12 <= size; ) {
+        const uint8_t *block = buf + pos;
+        uint32_t type, len;
+
+        if (net32(block) == 0x0a0d0d0a) {
+            swapped = net32(block + 8) == 0x1a2b3c4d;
+            nifaces = 0;
+        }
+        type = get32(block);
+        len = get32(block + 4);
+        if (len < 12 || len > size - pos || len % 4 != 0) {
+            printf("read_pcapng: block at %ld is cut off or malformed\n", pos);
+            return -1;
+        }
+
+        if (type == 1 && len >= 20 && nifaces < MAX_IFACES) {
+            long opt;
+
+            linktype[nifaces] = get16(block + 8);
+            resolution[nifaces] = 1e-6;
+            for (opt = 16; opt + 4 <= len - 4; ) {
+                uint32_t code = get16(block + opt), olen = get16(block + opt + 2);
+
+                if (code == 0 || opt + 4 + olen > len - 4) {
+                    break;
+                }
+                if (code == 9 && olen >= 1) {       // if_tsresol: a power of 10, or of 2 with the top bit
+                    int v = block[opt + 4];
+                    double r = 1.0;
+
+                    for (int i = 0; i < (v & 0x7f); i++) {
+                        r /= v & 0x80 ? 2 : 10;
+                    }
+                    resolution[nifaces] = r;
+                }
+                opt += 4 + ((olen + 3) & ~3u);
+            }
+            nifaces++;
+        }
+        else if ((type == 6 || type == 2) && len >= 32) {  // enhanced packet, or the old packet block
+            uint32_t iface = type == 6 ? get32(block + 8) : get16(block + 8);
+            uint32_t caplen = get32(block + 20);
+            uint64_t ts = (uint64_t) get32(block + 12) << 32 | get32(block + 16);
+
+            if (iface >= (uint32_t) nifaces || caplen > len - 32) {
+                printf("read_pcapng: packet block at %ld has no interface or is cut off\n", pos);
+                return -1;
+            }
+            take_frame(ts * resolution[iface], linktype[iface], block + 28, caplen);
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+int read_capture(char *path)
+{
+    FILE *file = fopen(path, "rb");
+    uint8_t *buf;
+    long size;
+    int status;
+
+    if (file == NULL) {
+        printf("read_capture: unable to open %s\n", path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+    buf = (uint8_t *)malloc(size > 0 ? size : 1);
+    if (buf == NULL || fread(buf, 1, size, file) != (size_t) size) {
+        printf("read_capture: unable to read %s\n", path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    if (size >= 12 && net32(buf) == 0x0a0d0d0a) {
+        status = read_pcapng(buf, size);
+    }
+    else if (size >= 24 && (net32(buf) == 0xd4c3b2a1 || net32(buf) == 0xa1b2c3d4
+                            || net32(buf) == 0x4d3cb2a1 || net32(buf) == 0xa1b23c4d)) {
+        status = read_pcap(buf, size);
+    }
+    else {
+        printf("read_capture: %s is neither pcapng nor pcap\n", path);
+        status = -1;
+    }
+    free(buf);
+    return status;
+}
+
+
+/****************************************************************************
+  What went through the channel.
+ ***************************************************************************/
+
+struct record *records;
+int     nrecords;
+
+struct record *add_record(double sent)
+{
+    static int size;
+    struct record *r;
+
+    if (nrecords == size) {
+        size = size > 0 ? 2 * size : 1024;
+        records = (struct record *)realloc(records, size * sizeof(struct record));
+        if (records == NULL) {
+            printf("add_record: unable to allocate %d records\n", size);
+            exit(1);
+        }
+    }
+    r = &records[nrecords++];
+    memset(r, 0, sizeof(*r));
+    r->sent = sent;
+    r->rtt = -1;
+    return r;
+}
+
+// The data segments the sender of connection f sent. Returns the direction they went in.
+int tcp_records(struct flow *f)
+{
+    long bytes[2] = { 0, 0 };
+    int outstanding[MAX_OUTSTANDING];
+    int noutstanding = 0, sender, i, j, k;
+    uint32_t base = 0, high = 0;
+    int based = 0;
+
+    for (i = 0; i < f->npackets; i++) {
+        bytes[f->packets[i].dir] += f->packets[i].len;
+    }
+    sender = bytes[1] > bytes[0];
+
+    for (i = 0; i < f->npackets; i++) {
+        struct packet *p = &f->packets[i];
+
+        if (p->dir == sender && !based) {
+            base = p->seq + ((p->flags & TCP_SYN) != 0);    // data starts after the SYN
+            high = 0;
+            based = 1;
+        }
+        if (p->dir == sender && p->len > 0 && based) {
+            uint32_t start = p->seq - base, end = start + p->len;
+            struct record *r;
+
+            // sequence numbers wrap, so they are compared by their difference
+            if ((int32_t) (end - high) <= 0) {
+                // the latest unacknowledged segment it covers was lost
+                for (j = noutstanding - 1; j >= 0; j--) {
+                    struct record *o = &records[outstanding[j]];
+
+                    if (!o->lost && (int32_t) (o->end - start) > 0 && (int32_t) (end - o->start) > 0) {
+                        o->lost = 1;
+                        break;
+                    }
+                }
+                r = add_record(p->time);
+                r->again = 1;
+            }
+            else {
+                high = end;
+                r = add_record(p->time);
+            }
+            r->start = start;
+            r->end = end;
+            if (noutstanding == MAX_OUTSTANDING) {
+                printf("tcp_records: more than %d segments unacknowledged\n", MAX_OUTSTANDING);
+                exit(1);
+            }
+            outstanding[noutstanding++] = nrecords - 1;
+        }
+        else if (p->dir != sender && (p->flags & TCP_ACK) && based) {
+            uint32_t ack = p->ack - base;
+
+            for (j = k = 0; j < noutstanding; j++) {
+                struct record *o = &records[outstanding[j]];
+
+                if ((int32_t) (ack - o->end) >= 0) {
+                    if (!o->lost && !o->again) {
+                        o->rtt = p->time - o->sent;
+                    }
+                }
+                else {
+                    outstanding[k++] = outstanding[j];
+                }
+            }
+            noutstanding = k;
+        }
+    }
+    return sender;
+}
+
+// The requests of UDP flow f, the packets in the direction of its first one, with their replies.
+int udp_records(struct flow *f)
+{
+    int pending = -1;
+
+    for (int i = 0; i < f->npackets; i++) {
+        struct packet *p = &f->packets[i];
+
+        if (p->dir == 0) {
+            if (pending >= 0) {
+                records[pending].lost = 1;
+            }
+            add_record(p->time);
+            pending = nrecords - 1;
+        }
+        else if (pending >= 0) {
+            records[pending].rtt = p->time - records[pending].sent;
+            pending = -1;
+        }
+    }
+    return 0;
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Sorts the n values and prints their min / mean / p50 / p99 / max in time units.
+void report_spread(char *label, double *values, int n)
+{
+    double sum = 0.0;
+
+    if (n == 0) {
+        printf("%-45snone\n", label);
+        return;
+    }
+    qsort(values, n, sizeof(double), compare_double);
+    for (int i = 0; i < n; i++) {
+        sum += values[i];
+    }
+    printf("%-45s%f / %f / %f / %f / %f\n", label, values[0] / time_unit, sum / n / time_unit,
+           values[n / 2] / time_unit, values[n * 99 / 100] / time_unit, values[n - 1] / time_unit);
+}
+
+void endpoint(char *text, size_t size, struct flow *f, int i)
+{
+    const uint8_t *a = f->addr[i];
+
+    if (f->family == 4) {
+        snprintf(text, size, "%d.%d.%d.%d:%d", a[0], a[1], a[2], a[3], f->port[i]);
+    }
+    else {
+        snprintf(text, size, "[%x:%x:%x:%x:%x:%x:%x:%x]:%d", net16(a), net16(a + 2), net16(a + 4), net16(a + 6),
+                 net16(a + 8), net16(a + 10), net16(a + 12), net16(a + 14), f->port[i]);
+    }
+}
+
+
+void usage(char *progname)
+{
+    printf("usage: %s [-P port] [-u seconds] [-o trace] capture\n", progname);
+    printf("  -P  take the flow with this port, TCP if it has one with data\n");
+    printf("  -u  seconds per time unit of the emulator (default %g)\n", time_unit);
+    printf("  -o  write the delay and loss trace to this file, for gbn -X\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct flow *f = NULL;
+    char from[64], to[64];
+    double *rtts, *gaps;
+    int opt, i, sender, nrtts = 0, ngaps = 0, nlost = 0, nbursts = 0, nagain = 0;
+    double delay = -1;
+    FILE *out;
+
+    while ((opt = getopt(argc, argv, "P:u:o:")) != -1) {
+        switch (opt) {
+            case 'P': only_port = atoi(optarg); break;
+            case 'u': time_unit = atof(optarg); break;
+            case 'o': trace_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || time_unit <= 0) {
+        usage(argv[0]);
+    }
+    if (read_capture(argv[optind]) != 0) {
+        exit(1);
+    }
+
+    // the connection that carried the most data, or the busiest UDP flow
+    for (i = 0; i < nflows; i++) {
+        struct flow *g = &flows[i];
+
+        if (only_port >= 0 && g->port[0] != only_port && g->port[1] != only_port) {
+            continue;
+        }
+        if (f == NULL || (g->proto == 6 && g->bytes > 0 && (f->proto != 6 || g->bytes > f->bytes))
+                || (g->proto == 17 && f->proto == 17 && g->npackets > f->npackets)
+                || (g->proto == 17 && f->proto == 6 && f->bytes == 0)) {
+            f = g;
+        }
+    }
+    printf("Capture:                                     %s\n", argv[optind]);
+    printf("Packets / IP packets / flows:                %ld / %ld / %d\n", npackets, nip, nflows);
+    if (nskipped > 0) {
+        printf("Packets of a link type not taken apart:      %ld\n", nskipped);
+    }
+    if (f == NULL) {
+        printf("No TCP or UDP flow%s to take the channel from\n", only_port >= 0 ? " with that port" : "");
+        exit(1);
+    }
+
+    sender = f->proto == 6 ? tcp_records(f) : udp_records(f);
+    endpoint(from, sizeof(from), f, sender);
+    endpoint(to, sizeof(to), f, !sender);
+    printf("Flow:                                        %s %s -> %s\n", f->proto == 6 ? "TCP" : "UDP", from, to);
+
+    rtts = (double *)malloc((nrecords + 1) * sizeof(double));
+    gaps = (double *)malloc((nrecords + 1) * sizeof(double));
+    if (rtts == NULL || gaps == NULL) {
+        printf("main: unable to allocate %d records\n", nrecords);
+        exit(1);
+    }
+    for (i = 0; i < nrecords; i++) {
+        if (records[i].rtt >= 0) {
+            rtts[nrtts++] = records[i].rtt;
+        }
+        if (i > 0) {
+            gaps[ngaps++] = records[i].sent - records[i - 1].sent;
+        }
+        nlost += records[i].lost;
+        nbursts += records[i].lost && (i == 0 || !records[i - 1].lost);
+        nagain += records[i].again;
+    }
+    printf("Packets / lost / sent again:                 %d / %d / %d\n", nrecords, nlost, nagain);
+    printf("Loss rate / mean loss burst:                 %f / %f\n", nrecords > 0 ? (double) nlost / nrecords : 0.0,
+           nbursts > 0 ? (double) nlost / nbursts : 0.0);
+    printf("Time unit (seconds):                         %g\n", time_unit);
+    report_spread("RTT min / mean / p50 / p99 / max:", rtts, nrtts);
+    report_spread("Gaps min / mean / p50 / p99 / max:", gaps, ngaps);
+    free(rtts);
+    free(gaps);
+
+    if (trace_path == NULL) {
+        return 0;
+    }
+    out = fopen(trace_path, "w");
+    if (out == NULL) {
+        printf("main: unable to open %s for the trace\n", trace_path);
+        exit(1);
+    }
+    fprintf(out, "# delay and loss trace for gbn -X, from %s\n", argv[optind]);
+    fprintf(out, "# %s %s -> %s, a time unit is %g s\n", f->proto == 6 ? "TCP" : "UDP", from, to, time_unit);
+    fprintf(out, "# delay lost\n");
+    /* Packets with no RTT of their own take the last one, those before the
+       first RTT the first one. Those never acknowledged at the end of the
+       capture are left out. */
+    for (i = 0; i < nrecords && delay < 0; i++) {
+        if (records[i].rtt >= 0) {
+            delay = records[i].rtt / 2 / time_unit;
+        }
+    }
+    for (i = 0, nrtts = 0; i < nrecords && delay >= 0; i++) {
+        struct record *r = &records[i];
+
+        if (r->rtt >= 0) {
+            delay = r->rtt / 2 / time_unit;
+        }
+        else if (!r->lost && !r->again) {
+            continue;
+        }
+        fprintf(out, "%.6g %d\n", delay > 0 ? delay : 1e-6, r->lost);
+        nrtts++;
+    }
+    fclose(out);
+    printf("Trace packets written:                       %d to %s\n", nrtts, trace_path);
+    return 0;
+}
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h> // for calloc, erand48
+#include <string.h>
+#include <math.h>   // for pow, sqrt
+
+#include "qdisc.h"
+
+#define  NO_FLOW             -1
+#define  ON_NO_LIST          0
+#define  ON_NEW_FLOWS        1
+#define  ON_OLD_FLOWS        2
+
+
+struct fifo {
+    struct qpkt *head;
+    struct qpkt *tail;
+    int count;
+    long bytes;
+};
+
+// CoDel's state, with the names of the RFC 8289 pseudocode.
+struct codel {
+    float first_above_time;     // when the sojourn time has been above target for an interval, 0 while it is below
+    float drop_next;            // when to drop next in the dropping state
+    int count;                  // drops since entering the dropping state
+    int lastcount;              // count when it was last left
+    int dropping;
+};
+
+struct flow_queue {
+    struct fifo fifo;
+    struct codel codel;
+    int deficit;                // bytes the flow may still send in this round
+    int list;                   // which list of flows it is on, ON_NO_LIST if neither
+    int next;                   // the next flow on that list
+};
+
+// A list of flows, by index; only ever taken from at the head.
+struct flow_list {
+    int head;
+    int tail;
+};
+
+struct qdisc_algorithm {
+    char *name;
+    void (*enqueue)(struct qdisc *q, struct qpkt *p, float now);
+    struct qpkt *(*dequeue)(struct qdisc *q, float now);
+};
+
+struct qdisc {
+    struct qdisc_algorithm *algo;
+    struct qdisc_params params;
+    void (*drop)(struct qpkt *p, void *arg);
+    void *drop_arg;
+    struct qdisc_stats stats;
+    int length;                 // packets held, over every queue
+
+    struct fifo fifo;           // the one queue of droptail, red and codel
+    struct codel codel;
+
+    double red_avg;
+    int red_count;              // packets since red last dropped, -1 below red_min
+    int red_idle;               // the queue is empty
+    float red_idle_since;
+
+    struct flow_queue *flows;   // fq_codel
+    struct flow_list new_flows;
+    struct flow_list old_flows;
+};
+
+
+void fifo_push(struct fifo *fifo, struct qpkt *p)
+{
+    p->next = NULL;
+    if (fifo->tail != NULL) {
+        fifo->tail->next = p;
+    }
+    else {
+        fifo->head = p;
+    }
+    fifo->tail = p;
+    fifo->count++;
+    fifo->bytes += p->size;
+}
+
+struct qpkt *fifo_pop(struct fifo *fifo)
+{
+    struct qpkt *p = fifo->head;
+
+    if (p != NULL) {
+        fifo->head = p->next;
+        if (fifo->head == NULL) {
+            fifo->tail = NULL;
+        }
+        fifo->count--;
+        fifo->bytes -= p->size;
+    }
+    return p;
+}
+
+// A drop because the queue is full, which no discipline marks instead.
+void overflow(struct qdisc *q, struct qpkt *p)
+{
+    q->stats.overflow++;
+    q->drop(p, q->drop_arg);
+}
+
+/* Tells the packet's sender about congestion: marks the packet if it can
+   take a mark, otherwise drops it. Returns whether the packet is still
+   there. */
+int signal_congestion(struct qdisc *q, struct qpkt *p)
+{
+    if (q->params.ecn && p->ect) {
+        p->ce = 1;
+        q->stats.marked++;
+        return 1;
+    }
+    q->stats.dropped++;
+    q->drop(p, q->drop_arg);
+    return 0;
+}
+
+
+/******************** DROP-TAIL ********************/
+
+void droptail_enqueue(struct qdisc *q, struct qpkt *p, float now)
+{
+    (void) now;
+
+    if (q->length >= q->params.limit) {
+        overflow(q, p);
+        return;
+    }
+    fifo_push(&q->fifo, p);
+    q->length++;
+}
+
+struct qpkt *fifo_dequeue(struct qdisc *q, float now)
+{
+    struct qpkt *p = fifo_pop(&q->fifo);
+
+    if (p != NULL) {
+        q->length--;
+    }
+    if (q->length == 0 && !q->red_idle) {
+        q->red_idle = 1;
+        q->red_idle_since = now;
+    }
+    return p;
+}
+
+
+/******************** RED ********************/
+
+/* The average queue length is taken on every arrival. After the queue has
+   been empty it decays as if packets of mtu_time had come along all the
+   while and found it empty. Between red_min and red_max the drop
+   probability is spread out by the count since the last drop, so drops come
+   about evenly spaced rather than in bursts. */
+void red_enqueue(struct qdisc *q, struct qpkt *p, float now)
+{
+    struct qdisc_params *params = &q->params;
+
+    if (q->red_idle) {
+        q->red_avg *= pow(1 - params->red_weight, (now - q->red_idle_since) / params->mtu_time);
+        q->red_idle = 0;
+    }
+    q->red_avg = (1 - params->red_weight) * q->red_avg + params->red_weight * q->length;
+
+    if (q->length >= params->limit) {
+        overflow(q, p);
+        return;
+    }
+
+    if (q->red_avg >= params->red_max) {
+        q->red_count = 0;
+        if (!signal_congestion(q, p)) {
+            return;
+        }
+    }
+    else if (q->red_avg >= params->red_min) {
+        double pb = params->red_max_p * (q->red_avg - params->red_min) / (params->red_max - params->red_min);
+        double pa = ++q->red_count * pb >= 1 ? 1.0 : pb / (1 - q->red_count * pb);
+
+        if (erand48(params->seed) < pa) {
+            q->red_count = 0;
+            if (!signal_congestion(q, p)) {
+                return;
+            }
+        }
+    }
+    else {
+        q->red_count = -1;
+    }
+
+    fifo_push(&q->fifo, p);
+    q->length++;
+}
+
+
+/******************** CODEL ********************/
+
+float control_law(struct qdisc *q, float t, int count)
+{
+    return t + q->params.codel_interval / sqrt(count);
+}
+
+/* Takes the head packet of fifo, and tells whether it has been above
+   target long enough for CoDel to drop it. A queue down to one packet is
+   never too long. */
+struct qpkt *codel_dodequeue(struct qdisc *q, struct fifo *fifo, struct codel *c, float now, int *ok_to_drop)
+{
+    struct qpkt *p = fifo_pop(fifo);
+
+    *ok_to_drop = 0;
+    if (p == NULL) {
+        c->first_above_time = 0;
+        return NULL;
+    }
+    q->length--;
+
+    if (now - p->enqueued_at < q->params.codel_target || fifo->bytes <= q->params.mtu) {
+        c->first_above_time = 0;
+    }
+    else if (c->first_above_time == 0) {
+        c->first_above_time = now + q->params.codel_interval;
+    }
+    else if (now >= c->first_above_time) {
+        *ok_to_drop = 1;
+    }
+    return p;
+}
+
+/* RFC 8289's dequeue. In the dropping state it drops at intervals that
+   shrink with the square root of the drops so far; a mark ends the round,
+   since the marked packet still goes out. */
+struct qpkt *codel_dequeue_from(struct qdisc *q, struct fifo *fifo, struct codel *c, float now)
+{
+    int ok_to_drop;
+    struct qpkt *p = codel_dodequeue(q, fifo, c, now, &ok_to_drop);
+
+    if (c->dropping) {
+        if (!ok_to_drop) {
+            c->dropping = 0;
+        }
+        while (c->dropping && now >= c->drop_next) {
+            c->count++;
+            if (signal_congestion(q, p)) {
+                c->drop_next = control_law(q, c->drop_next, c->count);
+                return p;
+            }
+            p = codel_dodequeue(q, fifo, c, now, &ok_to_drop);
+            if (!ok_to_drop) {
+                c->dropping = 0;
+            }
+            else {
+                c->drop_next = control_law(q, c->drop_next, c->count);
+            }
+        }
+    }
+    else if (ok_to_drop) {
+        int delta = c->count - c->lastcount;
+
+        // drop again about as often as when it was last left, if that was not long ago
+        c->dropping = 1;
+        c->count = delta > 1 && now - c->drop_next < 16 * q->params.codel_interval ? delta : 1;
+        c->drop_next = control_law(q, now, c->count);
+        c->lastcount = c->count;
+        if (!signal_congestion(q, p)) {
+            p = codel_dodequeue(q, fifo, c, now, &ok_to_drop);
+        }
+    }
+    return p;
+}
+
+struct qpkt *codel_dequeue(struct qdisc *q, float now)
+{
+    return codel_dequeue_from(q, &q->fifo, &q->codel, now);
+}
+
+
+/******************** FQ-CODEL ********************/
+
+void flow_list_append(struct qdisc *q, struct flow_list *list, int flow, int which)
+{
+    q->flows[flow].next = NO_FLOW;
+    q->flows[flow].list = which;
+    if (list->tail != NO_FLOW) {
+        q->flows[list->tail].next = flow;
+    }
+    else {
+        list->head = flow;
+    }
+    list->tail = flow;
+}
+
+int flow_list_pop(struct qdisc *q, struct flow_list *list)
+{
+    int flow = list->head;
+
+    list->head = q->flows[flow].next;
+    if (list->head == NO_FLOW) {
+        list->tail = NO_FLOW;
+    }
+    q->flows[flow].list = ON_NO_LIST;
+    return flow;
+}
+
+/* A flow that was idle goes on the list of new flows with a full quantum.
+   When the queue overflows, the flow with the most bytes waiting loses its
+   head packet, which need not be the one that just came. */
+void fq_codel_enqueue(struct qdisc *q, struct qpkt *p, float now)
+{
+    struct flow_queue *f = &q->flows[p->flow];
+    int fattest = 0;
+
+    (void) now;
+
+    fifo_push(&f->fifo, p);
+    q->length++;
+    if (f->list == ON_NO_LIST) {
+        f->deficit = q->params.mtu;
+        flow_list_append(q, &q->new_flows, p->flow, ON_NEW_FLOWS);
+    }
+
+    if (q->length > q->params.limit) {
+        for (int i = 1; i < q->params.nflows; i++) {
+            if (q->flows[i].fifo.bytes > q->flows[fattest].fifo.bytes) {
+                fattest = i;
+            }
+        }
+        q->length--;
+        overflow(q, fifo_pop(&q->flows[fattest].fifo));
+    }
+}
+
+struct qpkt *fq_codel_dequeue(struct qdisc *q, float now)
+{
+    struct flow_list *list;
+    struct flow_queue *f;
+    struct qpkt *p;
+    int flow;
+
+    for (;;) {
+        if (q->new_flows.head != NO_FLOW) {
+            list = &q->new_flows;
+        }
+        else if (q->old_flows.head != NO_FLOW) {
+            list = &q->old_flows;
+        }
+        else {
+            return NULL;
+        }
+        flow = list->head;
+        f = &q->flows[flow];
+
+        // a flow through its quantum waits for the next round
+        if (f->deficit <= 0) {
+            f->deficit += q->params.mtu;
+            flow_list_pop(q, list);
+            flow_list_append(q, &q->old_flows, flow, ON_OLD_FLOWS);
+            continue;
+        }
+
+        p = codel_dequeue_from(q, &f->fifo, &f->codel, now);
+        if (p == NULL) {
+            // an emptied new flow still has its turn among the old ones, so it cannot jump the queue by going idle
+            flow_list_pop(q, list);
+            if (list == &q->new_flows && q->old_flows.head != NO_FLOW) {
+                flow_list_append(q, &q->old_flows, flow, ON_OLD_FLOWS);
+            }
+            continue;
+        }
+
+        f->deficit -= p->size;
+        return p;
+    }
+}
+
+
+/******************** THE DISCIPLINES ********************/
+
+struct qdisc_algorithm qdisc_algorithms[] = {
+    { "droptail", droptail_enqueue,  fifo_dequeue },
+    { "red",      red_enqueue,       fifo_dequeue },
+    { "codel",    droptail_enqueue,  codel_dequeue },
+    { "fq_codel", fq_codel_enqueue,  fq_codel_dequeue },
+};
+
+struct qdisc_algorithm *qdisc_lookup(const char *name)
+{
+    for (size_t i = 0; i < sizeof(qdisc_algorithms) / sizeof(qdisc_algorithms[0]); i++) {
+        if (strcmp(qdisc_algorithms[i].name, name) == 0) {
+            return &qdisc_algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+int qdisc_known(const char *name)
+{
+    return qdisc_lookup(name) != NULL;
+}
+
+struct qdisc *qdisc_create(const char *name, struct qdisc_params *params,
+                           void (*drop)(struct qpkt *p, void *arg), void *arg)
+{
+    struct qdisc *q = (struct qdisc *)calloc(1, sizeof(struct qdisc));
+
+    if (q == NULL || (q->flows = (struct flow_queue *)calloc(params->nflows, sizeof(struct flow_queue))) == NULL) {
+        printf("qdisc_create: unable to allocate queues for %d flows\n", params->nflows);
+        exit(1);
+    }
+    q->algo = qdisc_lookup(name);
+    q->params = *params;
+    q->drop = drop;
+    q->drop_arg = arg;
+    q->red_count = -1;
+    q->red_idle = 1;
+    q->new_flows.head = q->new_flows.tail = NO_FLOW;
+    q->old_flows.head = q->old_flows.tail = NO_FLOW;
+    return q;
+}
+
+void qdisc_enqueue(struct qdisc *q, struct qpkt *p, float now)
+{
+    p->enqueued_at = now;
+    q->stats.enqueued++;
+    q->algo->enqueue(q, p, now);
+}
+
+struct qpkt *qdisc_dequeue(struct qdisc *q, float now)
+{
+    return q->algo->dequeue(q, now);
+}
+
+int qdisc_length(struct qdisc *q)
+{
+    return q->length;
+}
+
+struct qdisc_stats *qdisc_stats(struct qdisc *q)
+{
+    return &q->stats;
+}
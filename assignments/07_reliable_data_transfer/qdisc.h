@@ -0,0 +1,60 @@
+/* Queue disciplines for the bottleneck of the RDT emulator.
+
+   A discipline holds the packets waiting for the link and picks the one it
+   sends next. droptail takes packets in order until it is full. red (Floyd
+   and Jacobson, 1993) drops arriving packets with a probability that grows
+   with the average queue length. codel (RFC 8289) drops at the head once
+   packets have waited longer than target for at least interval, more often
+   the longer that lasts. fq_codel (RFC 8290) gives every flow a CoDel queue
+   of its own and serves them by deficit round robin, new flows first.
+
+   With ecn set, the active disciplines mark ECN-capable packets Congestion
+   Experienced where they would drop them; a full queue still drops. Every
+   packet dropped goes to the drop callback, which owns it from then on. */
+
+struct qpkt {
+    struct qpkt *next;
+    int flow;                   // the fq_codel queue it goes in, 0 .. nflows - 1
+    int size;                   // bytes on the wire
+    int ect;                    // sent by an ECN-capable transport
+    int ce;                     // marked Congestion Experienced on the way through
+    float enqueued_at;
+};
+
+struct qdisc_params {
+    int limit;                  // packets held at most
+    int nflows;
+    int mtu;                    // bytes of a full packet: the fq_codel quantum, and codel's nearly empty queue
+    float mtu_time;             // time the link takes to send one, which red's average decays by while idle
+    int ecn;
+    float red_min;              // average queue length, in packets, red starts dropping at
+    float red_max;              // and drops every packet from
+    float red_max_p;            // drop probability just below red_max
+    float red_weight;           // weight of the current queue length in the average
+    float codel_target;         // sojourn time codel tolerates
+    float codel_interval;       // for how long it tolerates more
+    unsigned short seed[3];     // of red's random numbers
+};
+
+struct qdisc_stats {
+    long enqueued;
+    long overflow;              // dropped because the queue was full
+    long dropped;               // dropped by the AQM
+    long marked;                // marked by the AQM instead
+};
+
+struct qdisc;
+
+int qdisc_known(const char *name);
+
+struct qdisc *qdisc_create(const char *name, struct qdisc_params *params,
+                           void (*drop)(struct qpkt *p, void *arg), void *arg);
+
+void qdisc_enqueue(struct qdisc *q, struct qpkt *p, float now);
+
+// The packet to send at time now, NULL if none is left.
+struct qpkt *qdisc_dequeue(struct qdisc *q, float now);
+
+int qdisc_length(struct qdisc *q);
+
+struct qdisc_stats *qdisc_stats(struct qdisc *q);
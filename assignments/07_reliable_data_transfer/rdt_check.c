@@ -0,0 +1,845 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>     // for malloc, realloc, free
+#include <string.h>
+#include <stdatomic.h>  // for atomic_compare_exchange_strong
+#include <pthread.h>
+#include <time.h>       // for clock_gettime
+#include <unistd.h>     // for getopt, sysconf
+
+/* Exhaustive exploration of the alternating-bit protocol of abp.c and the
+   Go-Back-N of gbn.c, up to a bounded depth.
+
+   The emulators draw one random run. Here every choice the network makes is
+   a branch: each packet handed to tolayer3() is delivered, lost or
+   corrupted, the timer may go off whenever it runs, the next message may
+   come from layer 5, and the packets on the wire arrive in order but at any
+   point. The emulator corrupts the payload, the seqnum or the acknum; the
+   checksum catches all three alike, so they are one branch here. Every
+   delivery to layer 5 is checked: it must be the next message A took from
+   layer 5, so nothing is lost, duplicated or reordered.
+
+   The state is that of A's sender, B's receiver and the packets on the
+   wire each way. The search goes breadth first, a depth at a time, so the
+   first violation found is one of the shortest. The states of a depth are
+   expanded by all the threads, and the states seen so far are kept as
+   64-bit fingerprints in a lock-free open-addressing hash set, as in hash
+   compaction: a fingerprint collision could hide a state, with odds of
+   about n^2 / 2^65 for n states. */
+
+#define MAX_CHANNEL     8       // packets on the wire each way, at most
+#define MAX_SEQNUM_BITS 4
+#define MAX_MSGS        50      // below gbn.c's MSG_BUFFER_SIZE, so A never turns a msg away
+#define MAX_SENDS       16      // packets one event may hand to layer 3
+#define EMPTY           0xff    // a free slot of B's receive buffer
+#define NO_DATA         (-1)    // seqnum of a packet that only carries an ACK or NACK
+#define NO_PACKET       (-99)   // B_sender.last_packet.seqnum before the first packet (-999 in abp.c)
+#define CHUNK           64      // states a thread takes at a time
+
+// events
+#define LAYER5          0       // a msg from layer 5 at A
+#define TIMER           1       // A's retransmission timer goes off
+#define AT_B            2       // the first packet on the wire to B arrives
+#define AT_A            3       // the first packet on the wire to A arrives
+#define NEVENTS         4
+
+// what layer 3 does to a packet
+#define DELIVER         0
+#define LOSE            1
+#define CORRUPT         2
+#define NOUTCOMES       3
+
+char    *protocol       = "abp";     // abp or gbn
+int     window_size     = 4;         // gbn's -w
+int     seqnum_bits     = 3;         // gbn's -s
+int     dupack_threshold = 3;        // gbn's -k
+int     nmsgs           = 3;         // msgs from layer 5
+int     max_depth       = 40;        // events along a run, at most
+int     channel_capacity = 3;        // packets on the wire each way, more are lost
+int     nthreads        = 0;         // 0 for one per core
+int     table_bits      = 24;        // the hash set has 2^table_bits slots
+
+struct packet {
+    int8_t seq;
+    int8_t ack;
+    uint8_t msg;                // the msg it carries, numbered from 0 in the order A took them
+    uint8_t bad;                // corrupted, which the receiver's checksum catches
+};
+
+struct state {
+    uint8_t nsim;               // msgs from layer 5 so far
+    uint8_t accepted;           // msgs A took from layer 5
+    uint8_t delivered;          // msgs B handed to layer 5
+    uint8_t timer;              // A's retransmission timer runs
+
+    // abp.c: A_sender and B_sender
+    int8_t a_seq;
+    int8_t a_wait;              // WAITING_FOR_ACK
+    struct packet a_last;
+    int8_t b_ack;
+    int8_t b_last;
+
+    // gbn.c: A's sender and B's receiver
+    uint8_t base;               // window_base_seqnum
+    uint8_t next;               // next_seqnum
+    uint8_t send;               // send_seqnum
+    uint8_t base_msg;           // the msg in the packet at base, the others follow it
+    uint8_t waiting;            // msgs in the send buffer
+    uint8_t dupacks;
+    uint8_t in_recovery;
+    uint8_t expected;           // expected_seqnum
+    uint8_t rcv_msg[1 << MAX_SEQNUM_BITS];  // msgs kept past a gap, by seqnum
+
+    uint8_t nto_b;
+    uint8_t nto_a;
+    struct packet to_b[MAX_CHANNEL];
+    struct packet to_a[MAX_CHANNEL];
+};
+
+// An event being run on a state, and the packets it hands to layer 3.
+struct step {
+    struct state s;
+    struct packet sends[MAX_SENDS];
+    int to_b[MAX_SENDS];        // whether each goes to B
+    int nsends;
+    int violation;
+    int trace;                  // print what happens, for the counterexample
+};
+
+// How a state was reached: from which state of the depth before, by which event and outcomes.
+struct link {
+    long parent;
+    uint32_t outcomes;          // the outcome of each packet sent, base NOUTCOMES
+    uint8_t event;
+};
+
+struct level {
+    struct state *states;
+    struct link *links;
+    long n;
+    long size;
+};
+
+
+/****************************************************************************
+  What the protocols call.
+ ***************************************************************************/
+
+void note(struct step *st, const char *format, ...)
+{
+    va_list args;
+
+    if (st->trace) {
+        va_start(args, format);
+        printf("\t\t");
+        vprintf(format, args);
+        printf("\n");
+        va_end(args);
+    }
+}
+
+void tolayer3(struct step *st, int to_b, struct packet packet)
+{
+    if (st->nsends == MAX_SENDS) {
+        printf("tolayer3: more than %d packets sent in one event\n", MAX_SENDS);
+        exit(1);
+    }
+    st->sends[st->nsends] = packet;
+    st->to_b[st->nsends++] = to_b;
+}
+
+void tolayer5(struct step *st, int msg)
+{
+    note(st, "TOLAYER5: B hands msg %d to layer 5", msg);
+    if (msg != st->s.delivered || msg >= st->s.accepted) {
+        if (!st->violation && st->trace) {
+            printf("\t\tVIOLATION: B delivered msg %d where msg %d was next\n", msg, st->s.delivered);
+        }
+        st->violation = 1;
+    }
+    st->s.delivered++;
+}
+
+void starttimer(struct step *st)
+{
+    st->s.timer = 1;
+}
+
+void stoptimer(struct step *st)
+{
+    st->s.timer = 0;
+}
+
+
+/****************************************************************************
+  abp.c, A_output() to B_input(), with its timer restarted only if it is off.
+ ***************************************************************************/
+
+void abp_output(struct step *st)
+{
+    struct state *s = &st->s;
+    struct packet out = { 0 };
+
+    if (s->a_wait) {
+        note(st, "A_OUTPUT: A is waiting for an ACK, dropping the msg");
+        return;
+    }
+
+    out.seq = s->a_seq;
+    out.msg = s->accepted++;
+    tolayer3(st, 1, out);
+    s->a_seq = 1 - s->a_seq;
+    if (!s->timer) {
+        starttimer(st);
+    }
+    s->a_wait = 1;
+    s->a_last = out;
+}
+
+void abp_a_input(struct step *st, struct packet packet)
+{
+    struct state *s = &st->s;
+
+    if (packet.bad) {
+        return;
+    }
+    if (packet.ack == s->a_last.seq - 2) {
+        stoptimer(st);
+        tolayer3(st, 1, s->a_last);
+        starttimer(st);
+    }
+    else if (packet.ack == s->a_last.seq) {
+        stoptimer(st);
+        s->a_wait = 0;
+    }
+}
+
+void abp_timer(struct step *st)
+{
+    st->s.a_wait = 0;
+    tolayer3(st, 1, st->s.a_last);
+    starttimer(st);
+}
+
+void abp_b_input(struct step *st, struct packet packet)
+{
+    struct state *s = &st->s;
+    struct packet out = { 0 };
+
+    if (packet.bad) {
+        out.ack = s->b_ack - 2;     // NACK
+        tolayer3(st, 0, out);
+        return;
+    }
+
+    out.ack = packet.seq;
+    tolayer3(st, 0, out);
+    if (packet.seq == s->b_last) {
+        return;
+    }
+    s->b_ack = 1 - s->b_ack;
+    tolayer5(st, packet.msg);
+    s->b_last = packet.seq;
+}
+
+
+/****************************************************************************
+  gbn.c with its defaults: a window of window_size with no congestion
+  control, an ACK or NACK at once for every data packet, and with
+  dupack_threshold fast retransmit and packets kept past a gap.
+ ***************************************************************************/
+
+int seqnum_add(int seqnum, int n)
+{
+    return (seqnum + n) & ((1 << seqnum_bits) - 1);
+}
+
+int seqnum_dist(int a, int b)
+{
+    return (a - b) & ((1 << seqnum_bits) - 1);
+}
+
+int seqnum_diff(int a, int b)
+{
+    int d = seqnum_dist(a, b);
+
+    return d & (1 << (seqnum_bits - 1)) ? d - (1 << seqnum_bits) : d;
+}
+
+struct packet gbn_packet(struct state *s, int seq)
+{
+    struct packet out = { 0 };
+
+    out.seq = seq;
+    out.msg = s->base_msg + seqnum_dist(seq, s->base);
+    return out;
+}
+
+void gbn_send_window(struct step *st)
+{
+    struct state *s = &st->s;
+
+    while (seqnum_dist(s->send, s->base) < window_size) {
+        int new_data = s->send == s->next;
+
+        if (new_data && s->waiting == 0) {
+            break;
+        }
+        tolayer3(st, 1, gbn_packet(s, s->send));
+        if (new_data) {
+            s->waiting--;
+            s->next = seqnum_add(s->next, 1);
+        }
+        s->send = seqnum_add(s->send, 1);
+        starttimer(st);
+    }
+}
+
+void gbn_output(struct step *st)
+{
+    st->s.accepted++;
+    st->s.waiting++;
+    gbn_send_window(st);
+}
+
+void gbn_retransmit(struct step *st, int seq)
+{
+    tolayer3(st, 1, gbn_packet(&st->s, seq));
+    stoptimer(st);
+    starttimer(st);
+}
+
+// entity_ack() and what entity_input() does after it; A's receiver takes no data, so a corrupt packet is dropped.
+void gbn_a_input(struct step *st, struct packet packet)
+{
+    struct state *s = &st->s;
+    int nack = packet.ack < 0;
+    int acknum = nack ? -packet.ack - 1 : packet.ack;
+    int acked = seqnum_dist(acknum, s->base);
+
+    if (packet.bad) {
+        return;
+    }
+
+    if (acked > seqnum_dist(s->next, s->base)) {
+        note(st, "A_INPUT: ignoring ACK %d outside of the window", acknum);
+    }
+    else if (acked > 0) {
+        s->dupacks = 0;
+        s->in_recovery = 0;     // with no congestion control any new ACK ends recovery
+        if (seqnum_dist(s->send, s->base) < acked) {
+            s->send = acknum;
+        }
+        s->base = acknum;
+        s->base_msg += acked;
+        stoptimer(st);
+        if (s->base != s->next) {
+            starttimer(st);
+        }
+    }
+    else if (s->base == s->next) {
+    }
+    else if (dupack_threshold > 0) {
+        // past the threshold gbn.c only counts on, so stop there and keep the state space finite
+        if (s->dupacks <= dupack_threshold) {
+            s->dupacks++;
+        }
+        if (s->dupacks == dupack_threshold && !s->in_recovery) {
+            s->in_recovery = 1;
+            gbn_retransmit(st, s->base);
+        }
+    }
+    else if (nack) {
+        s->in_recovery = 1;
+        stoptimer(st);
+        s->send = s->base;
+    }
+
+    gbn_send_window(st);
+}
+
+void gbn_timer(struct step *st)
+{
+    st->s.in_recovery = 0;
+    st->s.send = st->s.base;
+    gbn_send_window(st);
+}
+
+// entity_input() and entity_receive() at B, which answers every packet at once.
+void gbn_b_input(struct step *st, struct packet packet)
+{
+    struct state *s = &st->s;
+    struct packet out = { 0 };
+    int nack = packet.bad;
+
+    if (!packet.bad) {
+        int ahead = seqnum_diff(packet.seq, s->expected);
+
+        if (ahead > 0) {
+            nack = 1;
+            if (dupack_threshold > 0 && ahead < window_size) {
+                s->rcv_msg[packet.seq] = packet.msg;
+            }
+        }
+        else if (ahead == 0) {
+            s->rcv_msg[packet.seq] = EMPTY;
+            tolayer5(st, packet.msg);
+            s->expected = seqnum_add(s->expected, 1);
+
+            while (s->rcv_msg[s->expected] != EMPTY) {
+                tolayer5(st, s->rcv_msg[s->expected]);
+                s->rcv_msg[s->expected] = EMPTY;
+                s->expected = seqnum_add(s->expected, 1);
+            }
+        }
+    }
+
+    out.seq = NO_DATA;
+    out.ack = nack ? -s->expected - 1 : s->expected;
+    tolayer3(st, 0, out);
+}
+
+
+/****************************************************************************
+  The events and their outcomes.
+ ***************************************************************************/
+
+void init_state(struct state *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->b_last = NO_PACKET;
+    memset(s->rcv_msg, EMPTY, sizeof(s->rcv_msg));
+}
+
+int event_enabled(struct state *s, int event)
+{
+    switch (event) {
+        case LAYER5: return s->nsim < nmsgs;
+        case TIMER:  return s->timer;
+        case AT_B:   return s->nto_b > 0;
+        default:     return s->nto_a > 0;
+    }
+}
+
+struct packet channel_pop(struct packet *channel, uint8_t *n)
+{
+    struct packet first = channel[0];
+
+    memmove(channel, channel + 1, --*n * sizeof(struct packet));
+    memset(&channel[*n], 0, sizeof(struct packet));
+    return first;
+}
+
+// Runs the event on st->s; the packets it sent are left in st->sends.
+void run_event(struct step *st, int event)
+{
+    struct state *s = &st->s;
+    int abp = protocol[0] == 'a';
+    struct packet packet;
+
+    st->nsends = 0;
+    st->violation = 0;
+
+    switch (event) {
+        case LAYER5:
+            s->nsim++;
+            note(st, "LAYER5: msg %d from layer 5 at A", s->nsim - 1);
+            if (abp) {
+                abp_output(st);
+            }
+            else {
+                gbn_output(st);
+            }
+            break;
+        case TIMER:
+            stoptimer(st);
+            note(st, "TIMER: A's timer goes off");
+            if (abp) {
+                abp_timer(st);
+            }
+            else {
+                gbn_timer(st);
+            }
+            break;
+        case AT_B:
+            packet = channel_pop(s->to_b, &s->nto_b);
+            if (packet.bad) {
+                note(st, "FROMLAYER3: a corrupt packet arrives at B");
+            }
+            else {
+                note(st, "FROMLAYER3: seq %d with msg %d arrives at B", packet.seq, packet.msg);
+            }
+            if (abp) {
+                abp_b_input(st, packet);
+            }
+            else {
+                gbn_b_input(st, packet);
+            }
+            break;
+        default:
+            packet = channel_pop(s->to_a, &s->nto_a);
+            if (packet.bad) {
+                note(st, "FROMLAYER3: a corrupt packet arrives at A");
+            }
+            else {
+                note(st, "FROMLAYER3: ack %d arrives at A", packet.ack);
+            }
+            if (abp) {
+                abp_a_input(st, packet);
+            }
+            else {
+                gbn_a_input(st, packet);
+            }
+            break;
+    }
+}
+
+long outcome_count(int nsends)
+{
+    long n = 1;
+
+    for (int i = 0; i < nsends; i++) {
+        n *= NOUTCOMES;
+    }
+    return n;
+}
+
+// The state after the event's packets met the given outcomes. A packet that finds its channel full is lost.
+void apply_outcomes(struct step *st, uint32_t outcomes, struct state *to)
+{
+    static const char *names[] = { "delivered", "lost", "corrupted" };
+
+    *to = st->s;
+    for (int i = 0; i < st->nsends; i++) {
+        struct packet packet = st->sends[i];
+        int outcome = outcomes % NOUTCOMES;
+        uint8_t *n = st->to_b[i] ? &to->nto_b : &to->nto_a;
+        struct packet *channel = st->to_b[i] ? to->to_b : to->to_a;
+
+        outcomes /= NOUTCOMES;
+        if (outcome != LOSE && *n == channel_capacity) {
+            outcome = LOSE;
+        }
+        if (st->trace) {
+            printf("\t\tTOLAYER3: to %c seq %d ack %d msg %d: %s\n",
+                   st->to_b[i] ? 'B' : 'A', packet.seq, packet.ack, packet.msg, names[outcome]);
+        }
+        if (outcome != LOSE) {
+            packet.bad = outcome == CORRUPT;
+            channel[(*n)++] = packet;
+        }
+    }
+}
+
+
+/****************************************************************************
+  The set of states seen: fingerprints in an open-addressing table, claimed
+  with a compare-and-swap so threads insert without locks. 0 is a free slot.
+ ***************************************************************************/
+
+_Atomic uint64_t *visited;
+uint64_t visited_mask;
+_Atomic long nvisited;
+
+// The state's bytes eight at a time, multiplied in and folded.
+uint64_t state_hash(struct state *s)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    uint64_t h = 0x9e3779b97f4a7c15u;
+    size_t i;
+
+    for (i = 0; i + 8 <= sizeof(*s); i += 8) {
+        uint64_t w;
+
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0xbf58476d1ce4e5b9u;
+        h ^= h >> 31;
+    }
+    for (; i < sizeof(*s); i++) {
+        h = (h ^ p[i]) * 0x100000001b3u;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdu;
+    h ^= h >> 33;
+    return h != 0 ? h : 1;
+}
+
+// Adds the state to the set; returns whether it was new.
+int visit(struct state *s)
+{
+    uint64_t h = state_hash(s);
+    uint64_t i = h & visited_mask;
+
+    while (1) {
+        uint64_t seen = 0;
+
+        if (atomic_compare_exchange_strong(&visited[i], &seen, h)) {
+            nvisited++;
+            return 1;
+        }
+        if (seen == h) {
+            return 0;
+        }
+        i = (i + 1) & visited_mask;
+    }
+}
+
+
+/****************************************************************************
+  The breadth-first search.
+ ***************************************************************************/
+
+struct level *levels;
+int     depth;                  // the depth being expanded
+_Atomic long next_state;        // the next state of it to take
+_Atomic long ntransitions;
+pthread_mutex_t found_lock = PTHREAD_MUTEX_INITIALIZER;
+long    found_state = -1;       // the state a violation was found from, and by which event
+int     found_event;
+
+struct worker {
+    pthread_t thread;
+    struct level out;           // the new states it found
+};
+
+void level_add(struct level *level, struct state *s, long parent, int event, uint32_t outcomes)
+{
+    if (level->n == level->size) {
+        level->size = level->size > 0 ? 2 * level->size : 1024;
+        level->states = (struct state *)realloc(level->states, level->size * sizeof(struct state));
+        level->links = (struct link *)realloc(level->links, level->size * sizeof(struct link));
+        if (level->states == NULL || level->links == NULL) {
+            printf("level_add: unable to allocate room for %ld states\n", level->size);
+            exit(1);
+        }
+    }
+    level->states[level->n] = *s;
+    level->links[level->n].parent = parent;
+    level->links[level->n].event = (uint8_t) event;
+    level->links[level->n].outcomes = outcomes;
+    level->n++;
+}
+
+void *expand(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    struct level *from = &levels[depth];
+    struct step st;
+    struct state to;
+    long first;
+
+    memset(&st, 0, sizeof(st));
+
+    while ((first = atomic_fetch_add(&next_state, CHUNK)) < from->n) {
+        long last = first + CHUNK < from->n ? first + CHUNK : from->n;
+
+        for (long i = first; i < last; i++) {
+            for (int event = 0; event < NEVENTS; event++) {
+                if (!event_enabled(&from->states[i], event)) {
+                    continue;
+                }
+
+                st.s = from->states[i];
+                run_event(&st, event);
+                if (st.violation) {
+                    // keep the first one of the depth
+                    pthread_mutex_lock(&found_lock);
+                    if (found_state < 0 || i < found_state || (i == found_state && event < found_event)) {
+                        found_state = i;
+                        found_event = event;
+                    }
+                    pthread_mutex_unlock(&found_lock);
+                    continue;
+                }
+
+                long n = outcome_count(st.nsends);
+
+                ntransitions += n;
+                for (uint32_t outcomes = 0; outcomes < n; outcomes++) {
+                    apply_outcomes(&st, outcomes, &to);
+                    if (visit(&to)) {
+                        level_add(&w->out, &to, i, event, outcomes);
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Runs the events that led to the state of levels[d] numbered i, printing what happens, then the event that broke it.
+void print_counterexample(int d, long i, int last_event)
+{
+    long *path = (long *)malloc((d + 1) * sizeof(long));
+    struct step st;
+
+    for (int k = d; k >= 0; k--) {
+        path[k] = i;
+        i = levels[k].links[i].parent;
+    }
+
+    memset(&st, 0, sizeof(st));
+    init_state(&st.s);
+    st.trace = 1;
+    for (int k = 1; k <= d; k++) {
+        struct link *link = &levels[k].links[path[k]];
+        struct state to;
+
+        printf("%d.\n", k);
+        run_event(&st, link->event);
+        apply_outcomes(&st, link->outcomes, &to);
+        st.s = to;
+    }
+    printf("%d.\n", d + 1);
+    run_event(&st, last_event);
+    free(path);
+}
+
+double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void usage(char *progname)
+{
+    printf("usage: %s [-p abp|gbn] [-w window_size] [-s seqnum_bits] [-k dupacks] [-n msgs] [-d depth] [-c capacity] [-j threads] [-m table_bits]\n", progname);
+    printf("  -p  protocol to check (default %s)\n", protocol);
+    printf("  -w  gbn: packets in flight, 1..2^seqnum_bits-1 (default %d)\n", window_size);
+    printf("  -s  gbn: width of the sequence number field in bits, 1..%d (default %d)\n", MAX_SEQNUM_BITS, seqnum_bits);
+    printf("  -k  gbn: duplicate ACKs for fast retransmit, 0 to go back N on every NACK (default %d)\n", dupack_threshold);
+    printf("  -n  msgs from layer 5, 1..%d (default %d)\n", MAX_MSGS, nmsgs);
+    printf("  -d  events along a run, at most (default %d)\n", max_depth);
+    printf("  -c  packets on the wire each way, 1..%d; more are lost (default %d)\n", MAX_CHANNEL, channel_capacity);
+    printf("  -j  threads, 0 for one per core (default %d)\n", nthreads);
+    printf("  -m  the set of states seen has 2^table_bits slots of 8 bytes (default %d)\n", table_bits);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct worker *workers;
+    struct state s;
+    double start;
+    int opt;
+    int d;
+
+    while ((opt = getopt(argc, argv, "p:w:s:k:n:d:c:j:m:")) != -1) {
+        switch (opt) {
+            case 'p': protocol = optarg; break;
+            case 'w': window_size = atoi(optarg); break;
+            case 's': seqnum_bits = atoi(optarg); break;
+            case 'k': dupack_threshold = atoi(optarg); break;
+            case 'n': nmsgs = atoi(optarg); break;
+            case 'd': max_depth = atoi(optarg); break;
+            case 'c': channel_capacity = atoi(optarg); break;
+            case 'j': nthreads = atoi(optarg); break;
+            case 'm': table_bits = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (strcmp(protocol, "abp") != 0 && strcmp(protocol, "gbn") != 0) {
+        printf("Unknown protocol %s\n", protocol);
+        usage(argv[0]);
+    }
+    if (seqnum_bits < 1 || seqnum_bits > MAX_SEQNUM_BITS || window_size < 1 || window_size >= (1 << seqnum_bits)
+            || dupack_threshold < 0) {
+        printf("The window must be between 1 and 2^seqnum_bits - 1, with 1 to %d seqnum bits\n", MAX_SEQNUM_BITS);
+        usage(argv[0]);
+    }
+    if (nmsgs < 1 || nmsgs > MAX_MSGS || max_depth < 1 || channel_capacity < 1 || channel_capacity > MAX_CHANNEL
+            || nthreads < 0 || table_bits < 10 || table_bits > 40) {
+        printf("Bounds out of range\n");
+        usage(argv[0]);
+    }
+    if (nthreads == 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    visited_mask = ((uint64_t) 1 << table_bits) - 1;
+    visited = (_Atomic uint64_t *)calloc(visited_mask + 1, sizeof(uint64_t));
+    levels = (struct level *)calloc(max_depth + 1, sizeof(struct level));
+    workers = (struct worker *)calloc(nthreads, sizeof(struct worker));
+    if (visited == NULL || levels == NULL || workers == NULL) {
+        printf("main: unable to allocate the set of states seen\n");
+        exit(1);
+    }
+
+    printf("Protocol:                                    %s\n", protocol);
+    if (protocol[0] == 'g') {
+        printf("Window size / sequence number bits:          %d / %d\n", window_size, seqnum_bits);
+        printf("Duplicate ACKs for fast retransmit:          %d\n", dupack_threshold);
+    }
+    printf("Msgs from layer 5:                           %d\n", nmsgs);
+    printf("Packets on the wire each way:                %d\n", channel_capacity);
+    printf("Depth bound:                                 %d\n", max_depth);
+    printf("Threads:                                     %d\n\n", nthreads);
+
+    start = now_seconds();
+    init_state(&s);
+    visit(&s);
+    level_add(&levels[0], &s, -1, 0, 0);
+
+    for (d = 0; d < max_depth && levels[d].n > 0 && found_state < 0; d++) {
+        depth = d;
+        next_state = 0;
+        for (int t = 0; t < nthreads; t++) {
+            memset(&workers[t].out, 0, sizeof(struct level));
+            if (pthread_create(&workers[t].thread, NULL, expand, &workers[t]) != 0) {
+                printf("main: unable to start thread %d\n", t);
+                exit(1);
+            }
+        }
+        for (int t = 0; t < nthreads; t++) {
+            struct level *out = &workers[t].out;
+
+            pthread_join(workers[t].thread, NULL);
+            for (long i = 0; i < out->n; i++) {
+                level_add(&levels[d + 1], &out->states[i], out->links[i].parent, out->links[i].event, out->links[i].outcomes);
+            }
+            free(out->states);
+            free(out->links);
+        }
+
+        printf("Depth %3d: %ld states, %ld new\n", d + 1, (long) nvisited, levels[d + 1].n);
+
+        // the states of a depth are not needed once expanded, how they were reached is
+        free(levels[d].states);
+        levels[d].states = NULL;
+
+        if ((uint64_t) nvisited > visited_mask / 4 * 3) {
+            printf("The set of states seen is full, raise -m\n");
+            exit(1);
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+
+    printf("\nStates:                                      %ld\n", (long) nvisited);
+    printf("Transitions:                                 %ld\n", (long) ntransitions);
+    printf("States per second:                           %.0f\n", elapsed > 0 ? nvisited / elapsed : 0.0);
+
+    if (found_state >= 0) {
+        printf("\nIn-order, exactly-once delivery is violated after %d events:\n\n", d);
+        print_counterexample(d - 1, found_state, found_event);
+    }
+    else if (levels[d].n == 0) {
+        printf("\nEvery reachable state explored, the deepest %d events in: delivery is in order and exactly once.\n", d - 1);
+    }
+    else {
+        printf("\nDelivery is in order and exactly once in every run of up to %d events.\n", d);
+    }
+
+    for (int i = 0; i <= max_depth; i++) {
+        free(levels[i].states);
+        free(levels[i].links);
+    }
+    free(levels);
+    free(workers);
+    free((void *) visited);
+    return found_state >= 0 ? 2 : 0;
+}